@@ -16,15 +16,86 @@ extern "C" {
 /******************************************************************************/
 /* Includes                                                                   */
 /******************************************************************************/
+#include <zephyr/sys/iterable_sections.h>
+
 #include "command.pb.h"
+#include "ampoule_ext.pb.h"
 
 /******************************************************************************/
 /* Global Definitions/Macros                                                  */
 /******************************************************************************/
+/**
+ * @brief Registers the handler of an opcode of the ampoule protocol
+ * @params name - unique name of the registration
+ * @params opcode - ampoule_Opcode handled
+ * @params handle - called for every command with that opcode, see struct command_handler
+ * @params init - called once at boot before any command is handled, may be NULL
+ */
+#define COMMAND_HANDLER_DEFINE(name, _opcode, _handle, _init)                                      \
+	static const STRUCT_SECTION_ITERABLE(command_handler, command_handler_##name) = {          \
+		.opcode = _opcode,                                                                 \
+		.handle = _handle,                                                                 \
+		.init = _init,                                                                     \
+	}
+
+/**
+ * @brief Registers the handler of an opcode of the ampoule extension protocol
+ * @params name - unique name of the registration
+ * @params opcode - ampoule_ExtOpcode handled
+ * @params handle - called for every command with that opcode, see struct command_ext_handler
+ * @params init - called once at boot before any command is handled, may be NULL
+ */
+#define COMMAND_EXT_HANDLER_DEFINE(name, _opcode, _handle, _init)                                  \
+	static const STRUCT_SECTION_ITERABLE(command_ext_handler, command_ext_handler_##name) = {  \
+		.opcode = _opcode,                                                                 \
+		.handle = _handle,                                                                 \
+		.init = _init,                                                                     \
+	}
+
+/**
+ * @brief Registers the handler of an urgent opcode of the ampoule protocol, with
+ *        CONFIG_AMPOULE_INGESTION_PRIORITY its identified requests overtake queued ones
+ * @params see COMMAND_HANDLER_DEFINE
+ */
+#define COMMAND_URGENT_HANDLER_DEFINE(name, _opcode, _handle, _init)                               \
+	static const STRUCT_SECTION_ITERABLE(command_handler, command_handler_##name) = {          \
+		.opcode = _opcode,                                                                 \
+		.handle = _handle,                                                                 \
+		.init = _init,                                                                     \
+		.urgent = true,                                                                    \
+	}
+
+/**
+ * @brief Registers the handler of an urgent opcode of the ampoule extension protocol
+ * @params see COMMAND_EXT_HANDLER_DEFINE
+ */
+#define COMMAND_EXT_URGENT_HANDLER_DEFINE(name, _opcode, _handle, _init)                           \
+	static const STRUCT_SECTION_ITERABLE(command_ext_handler, command_ext_handler_##name) = {  \
+		.opcode = _opcode,                                                                 \
+		.handle = _handle,                                                                 \
+		.init = _init,                                                                     \
+		.urgent = true,                                                                    \
+	}
 
 /******************************************************************************/
 /* External Typedefs                                                          */
 /******************************************************************************/
+struct command_handler {
+	ampoule_Opcode opcode;
+	/* Response opcode defaults to the command one, returns 0 or a negative error code */
+	int (*handle)(ampoule_Command *command, ampoule_Response *response);
+	/* Brings the peripheral up, the opcode isn't served if it fails */
+	int (*init)(void);
+	/* Handled ahead of queued requests, it must not depend on them having run */
+	bool urgent;
+};
+
+struct command_ext_handler {
+	ampoule_ExtOpcode opcode;
+	int (*handle)(ampoule_ExtCommand *command, ampoule_ExtResponse *response);
+	int (*init)(void);
+	bool urgent;
+};
 
 /******************************************************************************/
 /* External Variables                                                         */
@@ -34,12 +105,29 @@ extern "C" {
 /* Global Function Prototypes                                                 */
 /******************************************************************************/
 /**
- * @brief
- * @params <++>
- * @return <++>
+ * @brief Process a command with the handler registered for its opcode
+ * @params [in] command - decoded command
+ * @params [out] response - response to send back
+ * @return 0 on success, -ENOSYS if no handler is registered, handler error code otherwise
  */
 int command_process(ampoule_Command *command, ampoule_Response *response);
 
+/**
+ * @brief Process a command of the ampoule extension protocol
+ * @params [in] command - decoded command
+ * @params [out] response - response to send back
+ * @return 0 on success, negative error code also reported in response otherwise
+ */
+int command_ext_process(ampoule_ExtCommand *command, ampoule_ExtResponse *response);
+
+/**
+ * @brief Tells whether the handler of an opcode was registered as urgent
+ * @params [in] ext - opcode is an ampoule_ExtOpcode rather than an ampoule_Opcode
+ * @params [in] opcode - opcode of the command
+ * @return true if its requests may overtake queued ones
+ */
+bool command_is_urgent(bool ext, uint32_t opcode);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,100 @@
+/**
+ * @file effect
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-16 10:42:13
+ * @brief Effects rendered on the device at a fixed frame rate
+ *
+ */
+
+#ifndef EFFECT_H_
+#define EFFECT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdbool.h>
+#include <stdint.h>
+
+/******************************************************************************/
+/* Global Definitions/Macros                                                  */
+/******************************************************************************/
+#define EFFECT_KEYFRAMES_MAX_SIZE 8
+
+/* Duration of a frame, effect time advances by this much on every frame */
+#define EFFECT_FRAME_US (USEC_PER_SEC / CONFIG_AMPOULE_EFFECT_FPS)
+
+/******************************************************************************/
+/* External Typedefs                                                          */
+/******************************************************************************/
+enum effect_type {
+	EFFECT_NONE,
+	/* Whole strip goes from color_a to color_b and back every period */
+	EFFECT_FADE,
+	/* color_a to color_b across the strip, scrolling by one strip length every period */
+	EFFECT_GRADIENT,
+	/* length pixels of color_a run over color_b, crossing the strip every period */
+	EFFECT_CHASE,
+	/* Whole strip interpolates between keyframes, looping after the last one */
+	EFFECT_KEYFRAMES,
+};
+
+struct effect_keyframe {
+	uint32_t time_ms;
+	/* 0xRRGGBB */
+	uint32_t color;
+};
+
+struct effect {
+	enum effect_type type;
+	uint32_t color_a;
+	uint32_t color_b;
+	uint32_t period_ms;
+	uint32_t length;
+	struct effect_keyframe keyframes[EFFECT_KEYFRAMES_MAX_SIZE];
+	uint8_t keyframes_count;
+};
+
+/******************************************************************************/
+/* External Variables                                                         */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Starts rendering an effect from its first frame, replacing the running one
+ * @params [in] effect - parameters, copied
+ * @return 0 on success, -EINVAL if the parameters can't be rendered, such as a CHASE length of
+ * 0 or longer than the strip
+ */
+int effect_start(const struct effect *effect);
+
+/**
+ * @brief Stops rendering, the strip keeps showing the last frame
+ * @return 0 on success, -EALREADY if no effect is running
+ */
+int effect_stop(void);
+
+/**
+ * @brief Replaces the parameters of the running effect without restarting its time base
+ * @params [in] effect - parameters, copied
+ * @return 0 on success, -EINVAL if the parameters can't be rendered, -ESRCH if no effect is
+ * running
+ */
+int effect_tune(const struct effect *effect);
+
+/**
+ * @brief Tells whether an effect is being rendered
+ * @return true if an effect is running
+ */
+bool effect_running(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EFFECT */
@@ -18,51 +18,233 @@ extern "C" {
 /******************************************************************************/
 #include "zephyr/kernel.h"
 #include "zephyr/sys/ring_buffer.h"
+#include "zephyr/sys/slist.h"
+
+#if defined(CONFIG_STATS)
+#include "zephyr/stats/stats.h"
+#endif
 
 #include "command.pb.h"
+#include "ampoule_ext.pb.h"
 
 /******************************************************************************/
 /* Global Definitions/Macros                                                  */
 /******************************************************************************/
-#define INGESTION_PACKET_MAX_SIZE    1024
+#define INGESTION_PACKET_MAX_SIZE    CONFIG_AMPOULE_INGESTION_RX_BUF_SIZE
+#define INGESTION_RESPONSE_MAX_SIZE  512
 #define INGESTION_OBSERVERS_MAX_SIZE 3
 
+/* Upper bits of the size header carry frame flags, packets never exceed 12 bits */
+#define INGESTION_FRAME_SIZE_MASK    0x0FFF
+/* Payload is a sequence of varint delimited commands, answered by one batch frame */
+#define INGESTION_FRAME_FLAG_BATCH   BIT(15)
+/* Payload starts with a big endian request id, echoed in the response header */
+#define INGESTION_FRAME_FLAG_ID      BIT(14)
+/* Payload holds ampoule_ExtCommand messages instead of ampoule_Command */
+#define INGESTION_FRAME_FLAG_EXT     BIT(13)
+/* Response header ends with the big endian count of free bytes in the RX ring */
+#define INGESTION_FRAME_FLAG_CREDIT  BIT(12)
+#define INGESTION_FRAME_FLAGS_MASK                                                                 \
+	(INGESTION_FRAME_FLAG_BATCH | INGESTION_FRAME_FLAG_ID | INGESTION_FRAME_FLAG_EXT |         \
+	 INGESTION_FRAME_FLAG_CREDIT)
+
+#define INGESTION_FRAME_ID_SIZE     sizeof(uint16_t)
+#define INGESTION_FRAME_CREDIT_SIZE sizeof(uint16_t)
+
+/* COBS frames end with a CRC-16/CCITT-FALSE of the decoded frame, then a zero delimiter */
+#define INGESTION_COBS_CRC_SIZE   sizeof(uint16_t)
+#define INGESTION_COBS_DELIMITER  0x00
+/* Largest growth of len bytes once COBS encoded, one code byte per 254 bytes */
+#define INGESTION_COBS_OVERHEAD(len) (1 + (len) / 254)
+
+/* Bus frames lead with an address byte: a device, a group of devices or all of them */
+#define INGESTION_BUS_ADDRESS_MAX  0x6F
+#define INGESTION_BUS_GROUP(n)     (0x70 + (n))
+#define INGESTION_BUS_GROUPS       15
+#define INGESTION_BUS_BROADCAST    0x7F
+/* Set in the address of responses, along with the address of the device answering */
+#define INGESTION_BUS_RESPONSE     BIT(7)
+#define INGESTION_BUS_ADDRESS_SIZE sizeof(uint8_t)
+
+/* Bucket 0 counts frames handled under 1 us, bucket n > 0 those from 2^(n-1) us, the last one
+ * also takes everything slower.
+ */
+#define INGESTION_STATS_LATENCY_BUCKETS 16
+
 /******************************************************************************/
 /* External Typedefs                                                          */
 /******************************************************************************/
 enum ingestion_state {
+	/* Bus frames only, see ingestion_set_bus() */
+	RCV_ADDRESS,
 	RCV_LENGTH_HIGH,
 	RCV_LENGTH_LOW,
 	RCV_DATA,
 	PARSING,
 };
 
+enum ingestion_framing {
+	/* Frames are only delimited by their 2 byte size header */
+	INGESTION_FRAMING_LENGTH,
+	/* Frames are COBS encoded with a CRC trailer and end at a zero byte, a corrupted frame
+	 * is dropped and the next one is read from the following delimiter.
+	 */
+	INGESTION_FRAMING_COBS,
+};
+
+/* Addressing of a device sharing a multi-drop link with others */
+struct ingestion_bus {
+	/* Up to INGESTION_BUS_ADDRESS_MAX, unique on the link */
+	uint8_t address;
+	/* Bit n is set if the device belongs to INGESTION_BUS_GROUP(n) */
+	uint16_t groups;
+	/* Broadcast and group requests are only answered if they carry an id, each device waiting
+	 * address * slot_us from the end of the request so their responses don't collide
+	 */
+	uint32_t slot_us;
+};
+
+/* COBS decoder state, frames are decoded into the RX ring as they are fed */
+struct ingestion_cobs {
+	/* Decoded bytes of the current frame, claimed in the ring and committed once valid */
+	uint8_t *start;
+	uint8_t *out;
+	uint32_t out_left;
+	uint16_t len;
+	/* Code byte of the current block and data bytes still expected in it */
+	uint8_t code;
+	uint8_t left;
+	/* Frame didn't fit in the ring, skipped until the next delimiter */
+	bool dropping;
+};
+
 struct ingestion_transport {
 	/* Should return either an error either the size written */
 	int (*write)(void *context, uint8_t *data, uint16_t len);
+
+	/* Optional, responses are then encoded in place in the transport buffer instead of being
+	 * passed to write. claim returns a contiguous span of at most len bytes and may be called
+	 * several times, commit sends the first len claimed bytes and releases the rest.
+	 */
+	int (*claim)(void *context, uint8_t **data, uint16_t len);
+	int (*commit)(void *context, uint16_t len);
+
+	/* Optional, called from the ingestion queue once the RX space asked by
+	 * ingestion_rx_pause() is free, the transport then reads again.
+	 */
+	void (*resume)(void *context);
 };
 
 struct ingestion_rpc {
 	int (*on_command)(ampoule_Command *command, ampoule_Response *response);
+	/* Optional, EXT frames are answered with -ENOTSUP without it */
+	int (*on_ext_command)(ampoule_ExtCommand *command, ampoule_ExtResponse *response);
+	/* Optional, with CONFIG_AMPOULE_INGESTION_PRIORITY identified requests whose opcode it
+	 * returns true for overtake queued frames. opcode is an ampoule_ExtOpcode if ext is set.
+	 */
+	bool (*is_urgent)(bool ext, uint32_t opcode);
+};
+
+/* Counters since boot. Each one has a single writer, the feeding context, the ingestion queue
+ * or whoever holds tx_lock, so they are plain integers.
+ */
+struct ingestion_stats {
+#if defined(CONFIG_STATS)
+	/* Exposes the counters below through the stats subsystem */
+	struct stats_hdr hdr;
+#endif
+	/* Frames decoded and handed to their handler */
+	uint32_t frames_ok;
+	/* Bytes lost to a full RX ring */
+	uint32_t bytes_dropped;
+	/* COBS frames dropped for a bad CRC, size or encoding, counted by the feeding context */
+	uint32_t crc_errors;
+	uint32_t timeouts;
+	/* Malformed frames, unknown flags included */
+	uint32_t decode_errors;
+	/* Responses that didn't fit the transport or response buffer */
+	uint32_t encode_errors;
+	/* Transport writes that took less than they were given */
+	uint32_t tx_short_writes;
+	/* Frames dropped as no frame was returned to the pool in time */
+	uint32_t frames_dropped;
+	/* Time from a complete frame to its response, see INGESTION_STATS_LATENCY_BUCKETS */
+	uint32_t latency[INGESTION_STATS_LATENCY_BUCKETS];
 };
 
 struct ingestion {
-	/* Used by sys work q */
+	/* Queue processing this instance, the ampoule one unless set otherwise */
+	struct k_work_q *workq;
 	struct k_work ingest_work;
 	struct k_work_delayable timeout_work;
 
+	/* Single producer, single consumer: the feeding context, an ISR for serial, only puts and
+	 * the ingestion queue only gets, timeouts included, so neither side takes a lock. Only
+	 * ingestion_init() and ingestion_reset() reset it, while nothing is fed.
+	 */
 	struct ring_buf rb;
 
 	enum ingestion_state state;
 
-	uint8_t current[INGESTION_PACKET_MAX_SIZE];
+	/* Backing store of rb, frames are decoded in place from it */
+	uint8_t rx_buffer[INGESTION_PACKET_MAX_SIZE];
 	uint16_t expected_size;
-	uint16_t bytes_read;
+	uint16_t frame_flags;
 
 	struct ingestion_transport *transport;
 	struct ingestion_rpc *rpc;
 
+	/* Serialises responses, they may come from several threads when pipelining */
+	struct k_mutex tx_lock;
+
 	void *transport_context;
+
+	enum ingestion_framing framing;
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+	struct ingestion_cobs cobs;
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	/* Set by ingestion_set_bus(), frames then lead with an address */
+	bool bus_enabled;
+	struct ingestion_bus bus;
+	/* Address of the frame being received, and uptime in ticks once it was complete */
+	uint8_t frame_address;
+	int64_t frame_ticks;
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+	/* Set while a frame larger than the ring is decoded as it arrives, feeding gives the sem */
+	atomic_t streaming;
+	struct k_sem stream_sem;
+	/* Bytes of the streamed frame not taken off the ring yet */
+	uint16_t stream_left;
+#endif
+
+	/* Set while the transport holds off reading, until rx_resume_space bytes are free */
+	atomic_t rx_paused;
+	uint16_t rx_resume_space;
+
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+	/* Bit n stands for the n-th frame queued behind the one being received: answered ahead of
+	 * its turn, and already looked at
+	 */
+	uint64_t overtaken;
+	uint64_t inspected;
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+	/* Requests handed to the pipeline and not answered yet */
+	atomic_t pipelined;
+	/* Given when the last of them is answered */
+	struct k_sem pipeline_drained;
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	struct ingestion_stats stats;
+	const char *name;
+	sys_snode_t stats_node;
+#endif
 };
 
 /******************************************************************************/
@@ -81,6 +263,30 @@ struct ingestion {
 int ingestion_init(struct ingestion *ingestion, struct ingestion_transport *transport,
 		   struct ingestion_rpc *rpc, void *context);
 
+/**
+ * @brief Process an ingestion object on a given workqueue, call before feeding it
+ * @params [in] workq - workqueue frames of this instance are processed on
+ */
+void ingestion_set_workq(struct ingestion *ingestion, struct k_work_q *workq);
+
+/**
+ * @brief Selects how frames of an ingestion object are delimited, call before feeding it
+ * @params [in] framing - framing of both received and sent frames
+ * @return 0 on success, -ENOTSUP if CONFIG_AMPOULE_INGESTION_COBS is needed
+ */
+int ingestion_set_framing(struct ingestion *ingestion, enum ingestion_framing framing);
+
+/**
+ * @brief Puts an ingestion object on a multi-drop bus, call before feeding it. Frames both
+ *        ways then lead with an address, frames addressed to other devices are dropped
+ *        undecoded. Group and broadcast responses wait for their slot on the workqueue of
+ *        the instance, give it one of its own with ingestion_set_workq().
+ * @params [in] bus - addressing of the device, copied
+ * @return 0 on success, -EINVAL if the address or groups are out of range, -ENOTSUP if
+ * CONFIG_AMPOULE_INGESTION_BUS is needed
+ */
+int ingestion_set_bus(struct ingestion *ingestion, const struct ingestion_bus *bus);
+
 /**
  * @brief Feeds chunk to the ingestion layer
  * @params [in] data - pointer to the chunk
@@ -88,6 +294,51 @@ int ingestion_init(struct ingestion *ingestion, struct ingestion_transport *tran
  */
 int ingestion_feed(struct ingestion *ingestion, uint8_t *data, uint16_t len);
 
+/**
+ * @brief Free space in the RX ring, what the next ingestion_feed() takes without dropping. A
+ *        COBS frame outgrowing the ring is still dropped, up to its delimiter.
+ * @return number of bytes
+ */
+uint32_t ingestion_rx_space(struct ingestion *ingestion);
+
+/**
+ * @brief Tells the ingestion that the transport stopped reading, its resume callback is then
+ *        called once frames have been consumed. Callable from an ISR.
+ * @params [in] space - free RX bytes the transport needs to read again
+ * @return true if reception should stay paused, false if the space is already free
+ */
+bool ingestion_rx_pause(struct ingestion *ingestion, uint16_t space);
+
+/**
+ * @brief Drops the stream state of an instance so it can serve a new peer. Call once the
+ *        transport stopped feeding it, frames already received are answered before it returns.
+ * @return 0
+ */
+int ingestion_reset(struct ingestion *ingestion);
+
+/**
+ * @brief Frames left in the pool shared by every instance, each one is held from the decoding
+ *        of a request to the sending of its response
+ * @return number of frames
+ */
+uint32_t ingestion_frames_free(void);
+
+/**
+ * @brief Publishes the statistics of an instance, to the STATS command and the stats subsystem
+ * @params [in] name - name of the instance, must outlive it
+ * @return 0 on success, -EALREADY if the instance is already published
+ */
+int ingestion_stats_register(struct ingestion *ingestion, const char *name);
+
+/**
+ * @brief Reads the statistics of a published instance
+ * @params [in] index - instance, in order of publication
+ * @params [out] name - name given at publication
+ * @params [out] stats - snapshot of the counters
+ * @return 0 on success, -ENOENT if there is no such instance
+ */
+int ingestion_stats_get(uint32_t index, const char **name, struct ingestion_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
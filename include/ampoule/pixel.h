@@ -0,0 +1,119 @@
+/**
+ * @file pixel
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-01-11 09:48:26
+ * @brief Post-processing of the pixels handed to the strip: gamma, brightness and color order
+ *
+ */
+
+#ifndef PIXEL_H_
+#define PIXEL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/drivers/led_strip.h>
+
+/******************************************************************************/
+/* Global Definitions/Macros                                                  */
+/******************************************************************************/
+/* One entry per channel value */
+#define PIXEL_LUT_SIZE 256
+
+/* Leaves channels as they are */
+#define PIXEL_BRIGHTNESS_MAX 255
+
+/******************************************************************************/
+/* External Typedefs                                                          */
+/******************************************************************************/
+/* Order the strip expects the channels in, as ampoule.ColorOrder */
+enum pixel_order {
+	PIXEL_ORDER_RGB,
+	PIXEL_ORDER_RBG,
+	PIXEL_ORDER_GRB,
+	PIXEL_ORDER_GBR,
+	PIXEL_ORDER_BRG,
+	PIXEL_ORDER_BGR,
+	PIXEL_ORDER_COUNT,
+};
+
+struct pixel_config {
+	/* Channels are scaled by (brightness + 1) / 256 */
+	uint8_t brightness;
+	/* Channels go through pixel_gamma_lut first */
+	bool gamma;
+	enum pixel_order order;
+};
+
+/* A config ready to run, see pixel_pipeline_init */
+struct pixel_pipeline {
+	struct pixel_config config;
+	/* Gamma with the brightness folded in, only used with config.gamma */
+	uint8_t lut[PIXEL_LUT_SIZE];
+};
+
+/******************************************************************************/
+/* External Variables                                                         */
+/******************************************************************************/
+/* round(255 * (i / 255) ^ 2.2) */
+extern const uint8_t pixel_gamma_lut[PIXEL_LUT_SIZE];
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Maps every byte through a lookup table, four at a time
+ * @params [in,out] data - bytes mapped in place, any alignment
+ * @params [in] len - number of bytes
+ * @params [in] lut - value of each byte after mapping
+ */
+void pixel_gamma(uint8_t *data, size_t len, const uint8_t lut[PIXEL_LUT_SIZE]);
+
+/**
+ * @brief Scales every byte by (brightness + 1) / 256, rounding down, four at a time
+ *
+ * Uses the DSP extension where available, the portable version gives the same bytes.
+ *
+ * @params [in,out] data - bytes scaled in place, any alignment
+ * @params [in] len - number of bytes
+ * @params [in] brightness - PIXEL_BRIGHTNESS_MAX leaves them as they are, 0 turns them off
+ */
+void pixel_brightness(uint8_t *data, size_t len, uint8_t brightness);
+
+/**
+ * @brief Swaps the channels of each pixel, from RGB to order
+ * @params [in,out] pixels - pixels reordered in place
+ * @params [in] count - number of pixels
+ * @params [in] order - order the channels end up in
+ */
+void pixel_reorder(struct led_rgb *pixels, size_t count, enum pixel_order order);
+
+/**
+ * @brief Prepares a pipeline running config, the lookup table is built once here
+ * @params [out] pipeline - pipeline to prepare
+ * @params [in] config - post-processing to apply
+ * @return 0 on success, -EINVAL if the order is unknown
+ */
+int pixel_pipeline_init(struct pixel_pipeline *pipeline, const struct pixel_config *config);
+
+/**
+ * @brief Applies gamma, brightness then color order to pixels, in as few passes as possible
+ * @params [in] pipeline - prepared pipeline
+ * @params [in,out] pixels - pixels processed in place
+ * @params [in] count - number of pixels
+ */
+void pixel_pipeline_run(const struct pixel_pipeline *pipeline, struct led_rgb *pixels,
+			size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIXEL */
@@ -0,0 +1,89 @@
+/**
+ * @file schedule
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-12-21 09:12:36
+ * @brief Host clock sync and extension commands run at a host time
+ *
+ */
+
+#ifndef SCHEDULE_H_
+#define SCHEDULE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdint.h>
+
+#include "ampoule_ext.pb.h"
+
+/******************************************************************************/
+/* Global Definitions/Macros                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* External Typedefs                                                          */
+/******************************************************************************/
+/* Maps a host time to the device one: host_us + offset_us + drift_ppb * (host_us - host_ref_us) */
+struct schedule_clock {
+	int64_t offset_us;
+	int32_t drift_ppb;
+	/* Host time of the latest sample, the drift applies from there */
+	uint64_t host_ref_us;
+	/* Samples the estimate was made from, 0 until the first sync */
+	uint32_t samples;
+};
+
+/******************************************************************************/
+/* External Variables                                                         */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Reads the device clock scheduled commands are run against
+ * @return time since boot in us
+ */
+int64_t schedule_now_us(void);
+
+/**
+ * @brief Adds a sync sample and updates the estimate of the host clock
+ * @params [in] host_us - host time when the host sent the sample
+ * @params [in] device_us - device time when it was received, see schedule_now_us
+ * @params [out] estimate - estimate including this sample, may be NULL
+ * @return 0 on success
+ */
+int schedule_sync(uint64_t host_us, int64_t device_us, struct schedule_clock *estimate);
+
+/**
+ * @brief Converts a host time to the device time it happens at
+ * @params [in] host_us - host time
+ * @params [out] device_us - device time
+ * @return 0 on success, -EAGAIN if the host clock was never synced, -ERANGE if host_us is more
+ * than a day away from the latest sample
+ */
+int schedule_to_device_us(uint64_t host_us, int64_t *device_us);
+
+/**
+ * @brief Queues an extension command to run at its at_us host time, right away if it passed
+ * @params [in] command - decoded command, copied
+ * @return 0 on success, -EAGAIN or -ERANGE as schedule_to_device_us, -ENOTSUP unless it is
+ * STRIP_PRESENT or an EFFECT_* command, -ENOMEM if CONFIG_AMPOULE_SCHEDULE_SIZE commands are
+ * waiting
+ */
+int schedule_command(const ampoule_ExtCommand *command);
+
+/**
+ * @brief Drops the sync samples and the commands waiting for their time
+ */
+void schedule_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SCHEDULE */
@@ -0,0 +1,95 @@
+/**
+ * @file strip
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-09 15:21:07
+ * @brief Double buffered framebuffer of the ampoule LED strip
+ *
+ */
+
+#ifndef STRIP_H_
+#define STRIP_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdint.h>
+
+/******************************************************************************/
+/* Global Definitions/Macros                                                  */
+/******************************************************************************/
+/* Pixels are exchanged packed, one byte per channel in RGB order */
+#define STRIP_PIXEL_SIZE 3
+
+/******************************************************************************/
+/* External Typedefs                                                          */
+/******************************************************************************/
+struct pixel_config;
+
+/******************************************************************************/
+/* External Variables                                                         */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Number of pixels of the strip
+ * @return number of pixels
+ */
+uint16_t strip_length(void);
+
+/**
+ * @brief Writes pixels in the back buffer, they are displayed on the next present
+ * @params [in] offset - index of the first pixel written
+ * @params [in] rgb - packed RGB pixels
+ * @params [in] count - number of pixels
+ * @return 0 on success, -EINVAL if the range exceeds the strip
+ */
+int strip_write(uint16_t offset, const uint8_t *rgb, uint16_t count);
+
+/**
+ * @brief Writes one color to a range of pixels in the back buffer
+ * @params [in] offset - index of the first pixel written
+ * @params [in] rgb - packed RGB color
+ * @params [in] count - number of pixels
+ * @return 0 on success, -EINVAL if the range exceeds the strip
+ */
+int strip_fill(uint16_t offset, const uint8_t *rgb, uint16_t count);
+
+/**
+ * @brief XORs pixels into the back buffer, they are displayed on the next present
+ * @params [in] offset - index of the first pixel changed
+ * @params [in] rgb - packed RGB pixels XORed with the back buffer
+ * @params [in] count - number of pixels
+ * @return 0 on success, -EINVAL if the range exceeds the strip
+ */
+int strip_xor(uint16_t offset, const uint8_t *rgb, uint16_t count);
+
+/**
+ * @brief Pushes the pixels written since the last present to the strip
+ * @return 0 on success, negative error code from the led_strip driver otherwise
+ */
+int strip_present(void);
+
+/**
+ * @brief Changes the post-processing of the pixels, the whole strip is pushed on the next present
+ * @params [in] config - post-processing, see CONFIG_AMPOULE_PIXEL
+ * @return 0 on success, -EINVAL if the config is invalid
+ */
+int strip_configure(const struct pixel_config *config);
+
+/**
+ * @brief Reads the post-processing of the pixels in use
+ * @params [out] config - post-processing
+ */
+void strip_config_get(struct pixel_config *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STRIP */
@@ -0,0 +1,74 @@
+/**
+ * @file trace
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-01-18 10:26:44
+ * @brief Named trace points on the path of a frame, from feed to write
+ *
+ * With CONFIG_AMPOULE_TRACING, each point is a Zephyr named event, "amp_<point>" or a pair of
+ * "amp_<point>_enter" and "amp_<point>_exit" around a section. Their first argument is the
+ * ingestion instance, the second one depends on the point. They compile to nothing otherwise.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdint.h>
+
+#if defined(CONFIG_AMPOULE_TRACING)
+#include <zephyr/toolchain.h>
+#include <zephyr/tracing/tracing.h>
+#endif
+
+/******************************************************************************/
+/* Global Definitions/Macros                                                  */
+/******************************************************************************/
+#if defined(CONFIG_AMPOULE_TRACING)
+/* CTF events hold names of up to 19 characters, longer ones would be cut */
+#define AMPOULE_TRACE_NAME_MAX_SIZE 20
+
+#define AMPOULE_TRACE_NAMED(name, instance, arg)                                                   \
+	do {                                                                                       \
+		BUILD_ASSERT(sizeof(name) <= AMPOULE_TRACE_NAME_MAX_SIZE, name " is too long");   \
+		sys_trace_named_event(name, (uint32_t)(uintptr_t)(instance), (uint32_t)(arg));     \
+	} while (0)
+#else
+#define AMPOULE_TRACE_NAMED(name, instance, arg)                                                   \
+	do {                                                                                       \
+	} while (0)
+#endif
+
+/* A single event, the state of the ingestion engine for instance */
+#define AMPOULE_TRACE(point, instance, arg) AMPOULE_TRACE_NAMED("amp_" #point, instance, arg)
+
+/* Start of a section, what it works on for arg */
+#define AMPOULE_TRACE_ENTER(point, instance, arg)                                                  \
+	AMPOULE_TRACE_NAMED("amp_" #point "_enter", instance, arg)
+
+/* End of a section, its outcome for arg */
+#define AMPOULE_TRACE_EXIT(point, instance, arg)                                                   \
+	AMPOULE_TRACE_NAMED("amp_" #point "_exit", instance, arg)
+
+/******************************************************************************/
+/* External Typedefs                                                          */
+/******************************************************************************/
+
+/******************************************************************************/
+/* External Variables                                                         */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE */
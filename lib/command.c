@@ -10,83 +10,590 @@
 /* Includes                                                                   */
 /******************************************************************************/
 #include "command.pb.h"
+#include "pb_decode.h"
 #include "errno.h"
+#include "string.h"
 #include "ampoule/command.h"
+#include "ampoule/effect.h"
+#include "ampoule/ingestion.h"
+#include "ampoule/pixel.h"
+#include "ampoule/schedule.h"
+#include "ampoule/strip.h"
+#include "zephyr/init.h"
 #include "zephyr/logging/log.h"
 #include "zephyr/drivers/gpio.h"
+#include "zephyr/sys/iterable_sections.h"
 
 /******************************************************************************/
 /* Local Constant, Macro and Type Definitions                                 */
 /******************************************************************************/
 LOG_MODULE_REGISTER(command, CONFIG_AMPOULE_LOG_LEVEL);
 
+#define LED0_NODE DT_ALIAS(led0)
+
+/* A PIXELS_RLE run is its length - 1 followed by the color */
+#define COMMAND_RLE_RUN_SIZE (1 + STRIP_PIXEL_SIZE)
+/* A PIXELS_DELTA span starts with the pixels skipped and the pixels changed */
+#define COMMAND_DELTA_HEADER_SIZE 2
+/* Palette pixels are looked up this many at a time before being written */
+#define COMMAND_PALETTE_CHUNK_SIZE 32
+/* Streamed pixels are read this many at a time before being written */
+#define COMMAND_PIXELS_CHUNK_SIZE 32
+
+/* Last of POST_KERNEL, handler inits use peripheral drivers such as GPIO */
+#define COMMAND_INIT_PRIORITY 99
+
+#if defined(CONFIG_GPIO)
+BUILD_ASSERT(CONFIG_GPIO_INIT_PRIORITY < COMMAND_INIT_PRIORITY,
+	     "GPIO drivers must be up before the command handlers");
+#endif
+
 /******************************************************************************/
 /* Local Function Prototypes                                                  */
 /******************************************************************************/
-#define LED0_NODE DT_ALIAS(led0)
+#if defined(CONFIG_AMPOULE_STRIP)
+static bool command_strip_fits(uint32_t offset, uint32_t count);
+#endif
 
 /******************************************************************************/
 /* Local Variable Definitions                                                 */
 /******************************************************************************/
+/* Registered handlers indexed by opcode, filled once at boot */
+static const struct command_handler *handlers[_ampoule_Opcode_ARRAYSIZE];
+static const struct command_ext_handler *ext_handlers[_ampoule_ExtOpcode_ARRAYSIZE];
+
+#if DT_NODE_EXISTS(LED0_NODE)
+static const struct gpio_dt_spec led = GPIO_DT_SPEC_GET(LED0_NODE, gpios);
+#endif
 
 /******************************************************************************/
 /* Global Function Definitions                                                */
 /******************************************************************************/
+int command_process(ampoule_Command *command, ampoule_Response *response)
+{
+	const struct command_handler *handler = NULL;
+	int rc;
+
+	response->opcode = command->opcode;
+
+	if (command->opcode >= 0 && command->opcode < ARRAY_SIZE(handlers)) {
+		handler = handlers[command->opcode];
+	}
+
+	rc = handler != NULL ? handler->handle(command, response) : -ENOSYS;
+
+	response->success = rc == 0;
+
+	return rc;
+}
+
+int command_ext_process(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
+{
+	const struct command_ext_handler *handler = NULL;
+	int rc;
+
+	response->opcode = command->opcode;
+
+	if (command->opcode >= 0 && command->opcode < ARRAY_SIZE(ext_handlers)) {
+		handler = ext_handlers[command->opcode];
+	}
+
+	if (handler == NULL) {
+		rc = -ENOSYS;
+#if defined(CONFIG_AMPOULE_SCHEDULE)
+	} else if (command->at_us != 0) {
+		/* Answered once queued, the command itself only runs when its time comes */
+		rc = schedule_command(command);
+#endif
+	} else {
+		rc = handler->handle(command, response);
+	}
+
+	response->success = rc == 0;
+	response->error = rc;
+
+	return rc;
+}
+
+bool command_is_urgent(bool ext, uint32_t opcode)
+{
+	if (ext) {
+		return opcode < ARRAY_SIZE(ext_handlers) && ext_handlers[opcode] != NULL &&
+		       ext_handlers[opcode]->urgent;
+	}
+
+	return opcode < ARRAY_SIZE(handlers) && handlers[opcode] != NULL &&
+	       handlers[opcode]->urgent;
+}
+
+/* Named by ampoule_ext.options, nanopb calls it for StripWrite.pixels while decoding, its storage
+ * holds the offset the pixels were written at plus one, 0 until then.
+ */
+bool command_strip_write_callback(pb_istream_t *istream, pb_ostream_t *ostream,
+				  const pb_field_t *field)
+{
+	/* Only hosts send pixels, nanopb skips what is left unread */
+	if (istream == NULL || field->tag != ampoule_StripWrite_pixels_tag) {
+		return true;
+	}
+
+#if defined(CONFIG_AMPOULE_STRIP)
+	const ampoule_StripWrite *write = field->message;
+	uint32_t *streamed = field->pData;
+	uint32_t offset = write->offset;
+	uint8_t rgb[COMMAND_PIXELS_CHUNK_SIZE * STRIP_PIXEL_SIZE];
+
+	/* Fields are encoded in order, offset and encoding are known by now, the handler rejects
+	 * one decoded after the pixels. The whole span is checked upfront so a bad command leaves
+	 * the back buffer untouched.
+	 */
+	if (*streamed != 0 || write->encoding != ampoule_PixelEncoding_PIXELS_RAW ||
+	    write->rgb.size != 0 || istream->bytes_left % STRIP_PIXEL_SIZE != 0 ||
+	    !command_strip_fits(offset, istream->bytes_left / STRIP_PIXEL_SIZE)) {
+		return false;
+	}
+
+	*streamed = offset + 1;
+
+	while (istream->bytes_left > 0) {
+		uint32_t count =
+			MIN(COMMAND_PIXELS_CHUNK_SIZE, istream->bytes_left / STRIP_PIXEL_SIZE);
+
+		if (!pb_read(istream, rgb, count * STRIP_PIXEL_SIZE)) {
+			return false;
+		}
+
+		strip_write(offset, rgb, count);
+		offset += count;
+	}
+#endif
+
+	return true;
+}
 
 /******************************************************************************/
 /* Local Function Definitions                                                 */
 /******************************************************************************/
-int command_handle_led(ampoule_Command *command, ampoule_Response *response)
+static int command_handle_ping(ampoule_Command *command, ampoule_Response *response)
 {
-#if !DT_NODE_EXISTS(LED0_NODE)
-	return -ENOSYS;
-#else
+	response->opcode = ampoule_Opcode_PONG;
 
-	int rc = 0;
-	ampoule_Led *led = &command->operation.led;
+	return 0;
+}
 
-	const struct gpio_dt_spec dev = GPIO_DT_SPEC_GET(LED0_NODE, gpios);
+/* Health checks are answered even behind a queue of pixels */
+COMMAND_URGENT_HANDLER_DEFINE(ping, ampoule_Opcode_PING, command_handle_ping, NULL);
 
-	if (!gpio_is_ready_dt(&dev)) {
+#if DT_NODE_EXISTS(LED0_NODE)
+static int command_led_init(void)
+{
+	if (!gpio_is_ready_dt(&led)) {
 		return -EIO;
 	}
 
-	rc = gpio_pin_configure_dt(&dev, GPIO_OUTPUT_ACTIVE);
-	if (rc < 0) {
-		return rc;
-	}
+	return gpio_pin_configure_dt(&led, GPIO_OUTPUT_INACTIVE);
+}
 
-	switch (led->color) {
+static int command_handle_led(ampoule_Command *command, ampoule_Response *response)
+{
+	switch (command->operation.led.color) {
 	case ampoule_Led_Color_WHITE:
-		gpio_pin_set_dt(&dev, 1);
-		break;
+		return gpio_pin_set_dt(&led, 1);
 	case ampoule_Led_Color_OFF:
-		gpio_pin_set_dt(&dev, 0);
-		break;
+		return gpio_pin_set_dt(&led, 0);
 	}
 
 	return 0;
+}
+
+COMMAND_HANDLER_DEFINE(led, ampoule_Opcode_SET_LED, command_handle_led, command_led_init);
 #endif
+
+#if defined(CONFIG_AMPOULE_STRIP)
+static bool command_strip_fits(uint32_t offset, uint32_t count)
+{
+	return offset <= strip_length() && count <= strip_length() - offset;
 }
 
-int command_process(ampoule_Command *command, ampoule_Response *response)
+static int command_strip_write_raw(ampoule_StripWrite *write)
+{
+	if (write->rgb.size % STRIP_PIXEL_SIZE != 0 ||
+	    !command_strip_fits(write->offset, write->rgb.size / STRIP_PIXEL_SIZE)) {
+		return -EINVAL;
+	}
+
+	return strip_write(write->offset, write->rgb.bytes, write->rgb.size / STRIP_PIXEL_SIZE);
+}
+
+static int command_strip_write_rle(ampoule_StripWrite *write)
+{
+	const uint8_t *runs = write->rgb.bytes;
+	uint32_t offset = write->offset;
+	uint32_t count = 0;
+
+	if (write->rgb.size % COMMAND_RLE_RUN_SIZE != 0) {
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < write->rgb.size; i += COMMAND_RLE_RUN_SIZE) {
+		count += runs[i] + 1;
+	}
+
+	/* Checked upfront so a bad command leaves the back buffer untouched */
+	if (!command_strip_fits(offset, count)) {
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < write->rgb.size; i += COMMAND_RLE_RUN_SIZE) {
+		strip_fill(offset, &runs[i + 1], runs[i] + 1);
+		offset += runs[i] + 1;
+	}
+
+	return 0;
+}
+
+static uint8_t command_palette_index(const uint8_t *indexes, uint32_t pixel, uint8_t bits)
+{
+	uint32_t bit = pixel * bits;
+
+	return (indexes[bit / 8] >> (8 - bits - bit % 8)) & BIT_MASK(bits);
+}
+
+static int command_strip_write_palette(ampoule_StripWrite *write)
+{
+	uint8_t rgb[COMMAND_PALETTE_CHUNK_SIZE * STRIP_PIXEL_SIZE];
+	uint32_t colors = write->palette.size / STRIP_PIXEL_SIZE;
+	uint8_t bits = colors <= 2 ? 1 : colors <= 4 ? 2 : 4;
+
+	if (colors == 0 || write->palette.size % STRIP_PIXEL_SIZE != 0 ||
+	    !command_strip_fits(write->offset, write->count) ||
+	    write->rgb.size != DIV_ROUND_UP(write->count * bits, 8)) {
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < write->count; i++) {
+		if (command_palette_index(write->rgb.bytes, i, bits) >= colors) {
+			return -EINVAL;
+		}
+	}
+
+	for (uint32_t offset = 0; offset < write->count; offset += COMMAND_PALETTE_CHUNK_SIZE) {
+		uint32_t count = MIN(COMMAND_PALETTE_CHUNK_SIZE, write->count - offset);
+
+		for (uint32_t i = 0; i < count; i++) {
+			uint8_t index = command_palette_index(write->rgb.bytes, offset + i, bits);
+
+			memcpy(&rgb[i * STRIP_PIXEL_SIZE],
+			       &write->palette.bytes[index * STRIP_PIXEL_SIZE], STRIP_PIXEL_SIZE);
+		}
+
+		strip_write(write->offset + offset, rgb, count);
+	}
+
+	return 0;
+}
+
+static int command_strip_write_delta(ampoule_StripWrite *write)
+{
+	const uint8_t *spans = write->rgb.bytes;
+	uint32_t offset = write->offset;
+	uint32_t count = 0;
+	uint32_t i = 0;
+
+	while (i + COMMAND_DELTA_HEADER_SIZE <= write->rgb.size) {
+		count += spans[i] + spans[i + 1];
+		i += COMMAND_DELTA_HEADER_SIZE + spans[i + 1] * STRIP_PIXEL_SIZE;
+	}
+
+	if (i != write->rgb.size || !command_strip_fits(offset, count)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < write->rgb.size;) {
+		offset += spans[i];
+		strip_xor(offset, &spans[i + COMMAND_DELTA_HEADER_SIZE], spans[i + 1]);
+		offset += spans[i + 1];
+		i += COMMAND_DELTA_HEADER_SIZE + spans[i + 1] * STRIP_PIXEL_SIZE;
+	}
+
+	return 0;
+}
+
+/* Encoded pixels are decoded straight into the back buffer, never expanded to a whole frame */
+static int command_handle_strip_write(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
 {
-	int rc = 0;
+	ampoule_StripWrite *write = &command->operation.strip_write;
+
+	if (command->which_operation != ampoule_ExtCommand_strip_write_tag) {
+		return -EINVAL;
+	}
 
-	switch (command->opcode) {
-	case ampoule_Opcode_PING:
-		response->opcode = ampoule_Opcode_PONG;
-		break;
-	case ampoule_Opcode_SET_LED:
-		response->opcode = ampoule_Opcode_SET_LED;
-		rc = command_handle_led(command, response);
-		break;
+	/* Streamed pixels went where the fields decoded before them said, any field after them
+	 * would be ignored
+	 */
+	if (write->pixels != 0 &&
+	    (write->pixels - 1 != write->offset ||
+	     write->encoding != ampoule_PixelEncoding_PIXELS_RAW || write->rgb.size != 0)) {
+		return -EINVAL;
+	}
+
+	switch (write->encoding) {
+	case ampoule_PixelEncoding_PIXELS_RAW:
+		return command_strip_write_raw(write);
+	case ampoule_PixelEncoding_PIXELS_RLE:
+		return command_strip_write_rle(write);
+	case ampoule_PixelEncoding_PIXELS_PALETTE:
+		return command_strip_write_palette(write);
+	case ampoule_PixelEncoding_PIXELS_DELTA:
+		return command_strip_write_delta(write);
 	default:
-		rc = -ENOSYS;
-		break;
+		return -ENOTSUP;
 	}
+}
 
-	response->success = rc == 0;
+static int command_handle_strip_present(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
+{
+	return strip_present();
+}
 
-	return rc;
+COMMAND_EXT_HANDLER_DEFINE(strip_write, ampoule_ExtOpcode_STRIP_WRITE, command_handle_strip_write,
+			   NULL);
+COMMAND_EXT_HANDLER_DEFINE(strip_present, ampoule_ExtOpcode_STRIP_PRESENT,
+			   command_handle_strip_present, NULL);
+
+#if defined(CONFIG_AMPOULE_PIXEL)
+BUILD_ASSERT((int)ampoule_ColorOrder_ORDER_BGR == (int)PIXEL_ORDER_BGR,
+	     "ampoule.ColorOrder and enum pixel_order disagree");
+
+static int command_handle_strip_config(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
+{
+	ampoule_StripConfig *request = &command->operation.strip_config;
+	struct pixel_config config;
+	int rc;
+
+	strip_config_get(&config);
+
+	/* Without a config or with an empty one, the one in use is only read */
+	if (command->which_operation == ampoule_ExtCommand_strip_config_tag &&
+	    (request->has_brightness || request->has_gamma || request->has_order)) {
+		if (request->has_brightness) {
+			if (request->brightness > PIXEL_BRIGHTNESS_MAX) {
+				return -EINVAL;
+			}
+
+			config.brightness = request->brightness;
+		}
+
+		if (request->has_gamma) {
+			config.gamma = request->gamma;
+		}
+
+		if (request->has_order) {
+			config.order = (enum pixel_order)request->order;
+		}
+
+		rc = strip_configure(&config);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	response->which_result = ampoule_ExtResponse_strip_config_tag;
+	response->result.strip_config = (ampoule_StripConfig){
+		.has_brightness = true,
+		.brightness = config.brightness,
+		.has_gamma = true,
+		.gamma = config.gamma,
+		.has_order = true,
+		.order = (ampoule_ColorOrder)config.order,
+	};
+
+	return 0;
+}
+
+COMMAND_EXT_HANDLER_DEFINE(strip_config, ampoule_ExtOpcode_STRIP_CONFIG,
+			   command_handle_strip_config, NULL);
+#endif
+#endif
+
+#if defined(CONFIG_AMPOULE_EFFECT)
+BUILD_ASSERT(ARRAY_SIZE(((ampoule_Effect *)0)->keyframes) == EFFECT_KEYFRAMES_MAX_SIZE,
+	     "ampoule_ext.options and EFFECT_KEYFRAMES_MAX_SIZE disagree");
+
+static int command_effect_from_proto(ampoule_ExtCommand *command, struct effect *effect)
+{
+	ampoule_Effect *proto = &command->operation.effect;
+
+	if (command->which_operation != ampoule_ExtCommand_effect_tag) {
+		return -EINVAL;
+	}
+
+	*effect = (struct effect){
+		.type = (enum effect_type)proto->type,
+		.color_a = proto->color_a,
+		.color_b = proto->color_b,
+		.period_ms = proto->period_ms,
+		.length = proto->length,
+		.keyframes_count = proto->keyframes_count,
+	};
+
+	for (pb_size_t i = 0; i < proto->keyframes_count; i++) {
+		effect->keyframes[i].time_ms = proto->keyframes[i].time_ms;
+		effect->keyframes[i].color = proto->keyframes[i].color;
+	}
+
+	return 0;
+}
+
+static int command_handle_effect(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
+{
+	struct effect effect;
+	int rc;
+
+	if (command->opcode == ampoule_ExtOpcode_EFFECT_STOP) {
+		return effect_stop();
+	}
+
+	rc = command_effect_from_proto(command, &effect);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (command->opcode == ampoule_ExtOpcode_EFFECT_TUNE) {
+		return effect_tune(&effect);
+	}
+
+	return effect_start(&effect);
 }
+
+COMMAND_EXT_HANDLER_DEFINE(effect_start, ampoule_ExtOpcode_EFFECT_START, command_handle_effect,
+			   NULL);
+COMMAND_EXT_HANDLER_DEFINE(effect_stop, ampoule_ExtOpcode_EFFECT_STOP, command_handle_effect, NULL);
+COMMAND_EXT_HANDLER_DEFINE(effect_tune, ampoule_ExtOpcode_EFFECT_TUNE, command_handle_effect, NULL);
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+BUILD_ASSERT(ARRAY_SIZE(((ampoule_Stats *)0)->latency) == INGESTION_STATS_LATENCY_BUCKETS,
+	     "ampoule_ext.options and INGESTION_STATS_LATENCY_BUCKETS disagree");
+
+static int command_handle_stats(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
+{
+	struct ingestion_stats stats;
+	ampoule_Stats *out = &response->result.stats;
+	uint32_t instance = 0;
+	const char *name;
+	int rc;
+
+	/* Without a request, the first instance is read */
+	if (command->which_operation == ampoule_ExtCommand_stats_request_tag) {
+		instance = command->operation.stats_request.instance;
+	}
+
+	rc = ingestion_stats_get(instance, &name, &stats);
+	if (rc < 0) {
+		return rc;
+	}
+
+	response->which_result = ampoule_ExtResponse_stats_tag;
+	*out = (ampoule_Stats){
+		.instance = instance,
+		.frames_ok = stats.frames_ok,
+		.bytes_dropped = stats.bytes_dropped,
+		.crc_errors = stats.crc_errors,
+		.timeouts = stats.timeouts,
+		.decode_errors = stats.decode_errors,
+		.encode_errors = stats.encode_errors,
+		.tx_short_writes = stats.tx_short_writes,
+		.frames_dropped = stats.frames_dropped,
+		.latency_count = INGESTION_STATS_LATENCY_BUCKETS,
+	};
+
+	strncpy(out->name, name, sizeof(out->name) - 1);
+	memcpy(out->latency, stats.latency, sizeof(stats.latency));
+
+	return 0;
+}
+
+COMMAND_EXT_URGENT_HANDLER_DEFINE(stats, ampoule_ExtOpcode_STATS, command_handle_stats, NULL);
+#endif
+
+#if defined(CONFIG_AMPOULE_SCHEDULE)
+static int command_handle_clock_sync(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
+{
+	/* Read first, the sample is the time the request was received at */
+	int64_t device_us = schedule_now_us();
+	struct schedule_clock clock;
+	int rc;
+
+	if (command->which_operation != ampoule_ExtCommand_clock_sync_tag) {
+		return -EINVAL;
+	}
+
+	rc = schedule_sync(command->operation.clock_sync.host_us, device_us, &clock);
+	if (rc < 0) {
+		return rc;
+	}
+
+	response->which_result = ampoule_ExtResponse_clock_tag;
+	response->result.clock = (ampoule_Clock){
+		.device_us = device_us,
+		.offset_us = clock.offset_us,
+		.drift_ppb = clock.drift_ppb,
+		.samples = clock.samples,
+	};
+
+	return 0;
+}
+
+/* Time spent behind queued frames would show up as transport delay in the sample */
+COMMAND_EXT_URGENT_HANDLER_DEFINE(clock_sync, ampoule_ExtOpcode_CLOCK_SYNC,
+				  command_handle_clock_sync, NULL);
+#endif
+
+/* Runs the init hook of every registered handler once, a handler whose peripheral fails to
+ * come up is left out and its opcode answers -ENOSYS.
+ */
+static int command_init(void)
+{
+	STRUCT_SECTION_FOREACH(command_handler, handler) {
+		__ASSERT(handler->opcode >= 0 && handler->opcode < ARRAY_SIZE(handlers),
+			 "Invalid opcode %d", handler->opcode);
+
+		if (handlers[handler->opcode] != NULL) {
+			LOG_ERR("Opcode %d registered twice", handler->opcode);
+			continue;
+		}
+
+		int rc = handler->init != NULL ? handler->init() : 0;
+		if (rc < 0) {
+			LOG_ERR("Failed to init handler of opcode %d (%d)", handler->opcode, rc);
+			continue;
+		}
+
+		handlers[handler->opcode] = handler;
+	}
+
+	STRUCT_SECTION_FOREACH(command_ext_handler, handler) {
+		__ASSERT(handler->opcode >= 0 && handler->opcode < ARRAY_SIZE(ext_handlers),
+			 "Invalid opcode %d", handler->opcode);
+
+		if (ext_handlers[handler->opcode] != NULL) {
+			LOG_ERR("Extension opcode %d registered twice", handler->opcode);
+			continue;
+		}
+
+		int rc = handler->init != NULL ? handler->init() : 0;
+		if (rc < 0) {
+			LOG_ERR("Failed to init handler of extension opcode %d (%d)",
+				handler->opcode, rc);
+			continue;
+		}
+
+		ext_handlers[handler->opcode] = handler;
+	}
+
+	return 0;
+}
+
+/* Peripheral drivers are up, transports only start receiving at the APPLICATION level */
+SYS_INIT(command_init, POST_KERNEL, COMMAND_INIT_PRIORITY);
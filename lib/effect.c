@@ -0,0 +1,285 @@
+/**
+ * @file effect
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-16 10:41:52
+ * @brief Effects rendered on the device at a fixed frame rate
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "ampoule/effect.h"
+#include "ampoule/strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+LOG_MODULE_REGISTER(effect, CONFIG_AMPOULE_LOG_LEVEL);
+
+/* Pixels rendered before being written to the framebuffer at once */
+#define EFFECT_CHUNK_SIZE 32
+
+/* Interpolation positions are fixed point, EFFECT_LERP_ONE is the second color */
+#define EFFECT_LERP_ONE 256
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void effect_timer_expiry(struct k_timer *timer);
+static void effect_thread(void *p1, void *p2, void *p3);
+static int effect_validate(const struct effect *effect);
+static uint32_t effect_pixel(const struct effect *effect, uint16_t index, uint16_t length,
+			     uint32_t time_ms);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+/* Parameters of the running effect, guarded by effect_lock */
+static struct effect current;
+static bool running;
+
+static K_MUTEX_DEFINE(effect_lock);
+
+/* Frames elapsed since the effect started, counted by the timer so an overrun frame is
+ * skipped instead of slowing the animation down.
+ */
+static atomic_t frames;
+
+static K_SEM_DEFINE(frame_sem, 0, 1);
+static K_TIMER_DEFINE(frame_timer, effect_timer_expiry, NULL);
+
+K_THREAD_DEFINE(effect_tid, CONFIG_AMPOULE_EFFECT_STACK_SIZE, effect_thread, NULL, NULL, NULL,
+		CONFIG_AMPOULE_EFFECT_PRIORITY, 0, 0);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int effect_start(const struct effect *effect)
+{
+	int rc = effect_validate(effect);
+	if (rc < 0) {
+		return rc;
+	}
+
+	k_mutex_lock(&effect_lock, K_FOREVER);
+
+	k_timer_stop(&frame_timer);
+	k_sem_reset(&frame_sem);
+	atomic_set(&frames, 0);
+
+	current = *effect;
+	running = true;
+
+	/* First frame is rendered right away, then every period */
+	k_timer_start(&frame_timer, K_NO_WAIT, K_USEC(EFFECT_FRAME_US));
+
+	k_mutex_unlock(&effect_lock);
+
+	return 0;
+}
+
+int effect_stop(void)
+{
+	int rc = 0;
+
+	k_mutex_lock(&effect_lock, K_FOREVER);
+
+	if (!running) {
+		rc = -EALREADY;
+	}
+
+	k_timer_stop(&frame_timer);
+	running = false;
+
+	k_mutex_unlock(&effect_lock);
+
+	return rc;
+}
+
+int effect_tune(const struct effect *effect)
+{
+	int rc = effect_validate(effect);
+	if (rc < 0) {
+		return rc;
+	}
+
+	k_mutex_lock(&effect_lock, K_FOREVER);
+
+	if (running) {
+		current = *effect;
+	} else {
+		rc = -ESRCH;
+	}
+
+	k_mutex_unlock(&effect_lock);
+
+	return rc;
+}
+
+bool effect_running(void)
+{
+	return running;
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int effect_validate(const struct effect *effect)
+{
+	switch (effect->type) {
+	case EFFECT_FADE:
+	case EFFECT_GRADIENT:
+		return effect->period_ms > 0 ? 0 : -EINVAL;
+	case EFFECT_CHASE:
+		if (effect->length == 0 || effect->length > strip_length()) {
+			return -EINVAL;
+		}
+
+		return effect->period_ms > 0 ? 0 : -EINVAL;
+	case EFFECT_KEYFRAMES:
+		if (effect->keyframes_count == 0 ||
+		    effect->keyframes_count > EFFECT_KEYFRAMES_MAX_SIZE ||
+		    effect->keyframes[0].time_ms != 0) {
+			return -EINVAL;
+		}
+
+		for (uint8_t i = 1; i < effect->keyframes_count; i++) {
+			if (effect->keyframes[i].time_ms <= effect->keyframes[i - 1].time_ms) {
+				return -EINVAL;
+			}
+		}
+
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static uint32_t effect_lerp(uint32_t a, uint32_t b, uint32_t position)
+{
+	uint32_t color = 0;
+
+	for (uint8_t shift = 0; shift < 24; shift += 8) {
+		int32_t from = (a >> shift) & 0xFF;
+		int32_t to = (b >> shift) & 0xFF;
+
+		color |= (uint32_t)(from + (to - from) * (int32_t)position / EFFECT_LERP_ONE)
+			 << shift;
+	}
+
+	return color;
+}
+
+/* Maps a phase in [0, EFFECT_LERP_ONE) to a position going to EFFECT_LERP_ONE and back */
+static uint32_t effect_triangle(uint32_t phase)
+{
+	return phase < EFFECT_LERP_ONE / 2 ? phase * 2 : (EFFECT_LERP_ONE - phase) * 2;
+}
+
+static uint32_t effect_keyframes(const struct effect *effect, uint32_t time_ms)
+{
+	const struct effect_keyframe *keyframes = effect->keyframes;
+	uint8_t last = effect->keyframes_count - 1;
+
+	if (last == 0) {
+		return keyframes[0].color;
+	}
+
+	/* The last keyframe closes the loop, it is shown for an instant only */
+	time_ms %= keyframes[last].time_ms;
+
+	uint8_t i = 0;
+	while (keyframes[i + 1].time_ms <= time_ms) {
+		i++;
+	}
+
+	uint32_t span = keyframes[i + 1].time_ms - keyframes[i].time_ms;
+	uint32_t position = (uint64_t)(time_ms - keyframes[i].time_ms) * EFFECT_LERP_ONE / span;
+
+	return effect_lerp(keyframes[i].color, keyframes[i + 1].color, position);
+}
+
+static uint32_t effect_pixel(const struct effect *effect, uint16_t index, uint16_t length,
+			     uint32_t time_ms)
+{
+	if (effect->type == EFFECT_KEYFRAMES) {
+		return effect_keyframes(effect, time_ms);
+	}
+
+	/* Periods go up to 2^32 ms, the products of the phase need 64 bits */
+	uint32_t phase = time_ms % effect->period_ms;
+	uint32_t position = (uint64_t)phase * EFFECT_LERP_ONE / effect->period_ms;
+
+	switch (effect->type) {
+	case EFFECT_FADE:
+		return effect_lerp(effect->color_a, effect->color_b, effect_triangle(position));
+	case EFFECT_GRADIENT:
+		position = (index * EFFECT_LERP_ONE / length + position) % EFFECT_LERP_ONE;
+		return effect_lerp(effect->color_a, effect->color_b, effect_triangle(position));
+	case EFFECT_CHASE: {
+		/* The head leads, the tail wraps around the end of the strip */
+		uint32_t head = (uint64_t)phase * length / effect->period_ms;
+
+		return (head + length - index) % length < effect->length ? effect->color_a
+									 : effect->color_b;
+	}
+	default:
+		return 0;
+	}
+}
+
+static void effect_render(const struct effect *effect, uint32_t time_ms)
+{
+	uint8_t rgb[EFFECT_CHUNK_SIZE * STRIP_PIXEL_SIZE];
+	uint16_t length = strip_length();
+
+	for (uint16_t offset = 0; offset < length; offset += EFFECT_CHUNK_SIZE) {
+		uint16_t count = MIN(EFFECT_CHUNK_SIZE, length - offset);
+
+		for (uint16_t i = 0; i < count; i++) {
+			uint32_t color = effect_pixel(effect, offset + i, length, time_ms);
+
+			rgb[i * STRIP_PIXEL_SIZE] = color >> 16;
+			rgb[i * STRIP_PIXEL_SIZE + 1] = color >> 8;
+			rgb[i * STRIP_PIXEL_SIZE + 2] = color;
+		}
+
+		strip_write(offset, rgb, count);
+	}
+
+	strip_present();
+}
+
+static void effect_timer_expiry(struct k_timer *timer)
+{
+	atomic_inc(&frames);
+	k_sem_give(&frame_sem);
+}
+
+static void effect_thread(void *p1, void *p2, void *p3)
+{
+	struct effect effect;
+
+	while (true) {
+		k_sem_take(&frame_sem, K_FOREVER);
+
+		k_mutex_lock(&effect_lock, K_FOREVER);
+
+		if (!running) {
+			k_mutex_unlock(&effect_lock);
+			continue;
+		}
+
+		effect = current;
+		/* frames counts expiries, the first one is frame 0 */
+		uint32_t frame = atomic_get(&frames) - 1;
+
+		k_mutex_unlock(&effect_lock);
+
+		effect_render(&effect, (uint64_t)frame * EFFECT_FRAME_US / USEC_PER_MSEC);
+	}
+}
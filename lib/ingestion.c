@@ -11,6 +11,7 @@
 /******************************************************************************/
 #include <zephyr/logging/log.h>
 #include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
 #include <zephyr/kernel.h>
 
 #include "pb_decode.h"
@@ -18,21 +19,173 @@
 
 #include <ampoule/ingestion.h>
 #include "ampoule/command.h"
+#include "ampoule/trace.h"
 
 /******************************************************************************/
 /* Local Constant, Macro and Type Definitions                                 */
 /******************************************************************************/
 LOG_MODULE_REGISTER(ingestion, CONFIG_AMPOULE_LOG_LEVEL);
 
+#define INGESTION_HEADER_MAX_SIZE                                                                  \
+	(INGESTION_BUS_ADDRESS_SIZE + sizeof(uint16_t) + INGESTION_FRAME_ID_SIZE +                 \
+	 INGESTION_FRAME_CREDIT_SIZE)
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+#define INGESTION_STATS_INC(ingestion, counter)     ((ingestion)->stats.counter++)
+#define INGESTION_STATS_ADD(ingestion, counter, n) ((ingestion)->stats.counter += (n))
+#else
+#define INGESTION_STATS_INC(ingestion, counter)
+#define INGESTION_STATS_ADD(ingestion, counter, n) ((void)(n))
+#endif
+
+/* Either message set, picked by the EXT frame flag */
+union ingestion_command {
+	ampoule_Command command;
+	ampoule_ExtCommand ext;
+};
+
+union ingestion_response {
+	ampoule_Response response;
+	ampoule_ExtResponse ext;
+};
+
+/* A frame from its decoding to its response, loaned from a pool shared by every instance so
+ * neither the workqueues nor the pipeline threads need room for one on their stack. It is
+ * returned to the pool by whichever stage drops the last reference. Received bytes are not part
+ * of it, they are copied by the transport into the instance ring and decoded from there.
+ */
+struct ingestion_frame {
+	atomic_t refs;
+	struct ingestion *ingestion;
+	uint16_t flags;
+	uint16_t id;
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	/* Address the request was sent to, and uptime in ticks once it was received */
+	uint8_t address;
+	int64_t ticks;
+#endif
+	union ingestion_command command;
+	union ingestion_response response;
+	/* Response as sent, only used by transports without claim and by COBS framing */
+	uint8_t output[INGESTION_RESPONSE_MAX_SIZE];
+};
+
+/* A response frame being encoded, either in place in the transport or in a local buffer */
+struct ingestion_tx {
+	struct ingestion *ingestion;
+	pb_ostream_t ostream;
+
+	/* Frame flags and request id echoed in the header */
+	uint16_t flags;
+	uint16_t id;
+	/* Bus frames lead with the address of the device answering */
+	uint8_t address_size;
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	/* Response to a broadcast nobody asked to be answered, encoded but not sent */
+	bool silent;
+#endif
+
+	/* Header is filled once the size is known, it may straddle two claimed spans */
+	uint8_t *header[INGESTION_HEADER_MAX_SIZE];
+	uint8_t header_size;
+
+	/* Only used by transports without claim and by COBS framing */
+	uint8_t *buffer;
+	uint16_t buffer_size;
+	/* Room left at the start of buffer for the frame to be COBS encoded in place */
+	uint8_t buffer_offset;
+};
+
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+/* Reads a frame queued in the ring without consuming it, from offset bytes past the read position
+ * head points to
+ */
+struct ingestion_peek {
+	struct ingestion *ingestion;
+	uint8_t *head;
+	uint16_t offset;
+};
+#endif
+
 /******************************************************************************/
 /* Local Function Prototypes                                                  */
 /******************************************************************************/
 static void ingestion_process(struct k_work *work);
+static enum ingestion_state ingestion_first_state(struct ingestion *ingestion);
+static uint32_t ingestion_rx_free(struct ingestion *ingestion);
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+static void ingestion_cobs_reset(struct ingestion *ingestion);
+static bool ingestion_cobs_feed(struct ingestion *ingestion, const uint8_t *data, uint16_t len);
+#endif
 static void ingestion_timeout(struct k_work *work);
+static void ingestion_submit(struct ingestion *ingestion, struct k_work *work);
+static struct k_work_q *ingestion_workq_get(void);
 
 /******************************************************************************/
 /* Local Variable Definitions                                                 */
 /******************************************************************************/
+#if defined(CONFIG_AMPOULE_INGESTION_WORKQ)
+K_THREAD_STACK_DEFINE(ingestion_workq_stack, CONFIG_AMPOULE_INGESTION_WORKQ_STACK_SIZE);
+
+static struct k_work_q ingestion_workq;
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+/* Published instances, in order */
+static sys_slist_t ingestion_instances = SYS_SLIST_STATIC_INIT(&ingestion_instances);
+static K_MUTEX_DEFINE(ingestion_instances_lock);
+
+#if defined(CONFIG_STATS)
+#define INGESTION_STATS_NAME(counter) {offsetof(struct ingestion_stats, counter), #counter}
+#define INGESTION_STATS_LATENCY_NAME(bucket, lower_bound)                                          \
+	{offsetof(struct ingestion_stats, latency[bucket]), "latency_" #lower_bound "us"}
+
+static const struct stats_name_map ingestion_stats_names[] = {
+	INGESTION_STATS_NAME(frames_ok),
+	INGESTION_STATS_NAME(bytes_dropped),
+	INGESTION_STATS_NAME(crc_errors),
+	INGESTION_STATS_NAME(timeouts),
+	INGESTION_STATS_NAME(decode_errors),
+	INGESTION_STATS_NAME(encode_errors),
+	INGESTION_STATS_NAME(tx_short_writes),
+	INGESTION_STATS_NAME(frames_dropped),
+	INGESTION_STATS_LATENCY_NAME(0, 0),
+	INGESTION_STATS_LATENCY_NAME(1, 1),
+	INGESTION_STATS_LATENCY_NAME(2, 2),
+	INGESTION_STATS_LATENCY_NAME(3, 4),
+	INGESTION_STATS_LATENCY_NAME(4, 8),
+	INGESTION_STATS_LATENCY_NAME(5, 16),
+	INGESTION_STATS_LATENCY_NAME(6, 32),
+	INGESTION_STATS_LATENCY_NAME(7, 64),
+	INGESTION_STATS_LATENCY_NAME(8, 128),
+	INGESTION_STATS_LATENCY_NAME(9, 256),
+	INGESTION_STATS_LATENCY_NAME(10, 512),
+	INGESTION_STATS_LATENCY_NAME(11, 1024),
+	INGESTION_STATS_LATENCY_NAME(12, 2048),
+	INGESTION_STATS_LATENCY_NAME(13, 4096),
+	INGESTION_STATS_LATENCY_NAME(14, 8192),
+	INGESTION_STATS_LATENCY_NAME(15, 16384),
+};
+
+BUILD_ASSERT(ARRAY_SIZE(ingestion_stats_names) ==
+		     (sizeof(struct ingestion_stats) - sizeof(struct stats_hdr)) / sizeof(uint32_t),
+	     "Every counter needs a name");
+#endif
+#endif
+
+/* Frames are loaned from here, its size bounds the frames handled at once by all instances */
+K_MEM_SLAB_DEFINE_STATIC(ingestion_frames, sizeof(struct ingestion_frame),
+			 CONFIG_AMPOULE_INGESTION_FRAME_POOL_SIZE, 4);
+
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+/* Frames waiting for a pipeline thread, never more than the pool holds */
+K_MSGQ_DEFINE(ingestion_request_q, sizeof(struct ingestion_frame *),
+	      CONFIG_AMPOULE_INGESTION_FRAME_POOL_SIZE, 4);
+
+K_THREAD_STACK_ARRAY_DEFINE(ingestion_pipeline_stacks, CONFIG_AMPOULE_INGESTION_PIPELINE_THREADS,
+			    CONFIG_AMPOULE_INGESTION_PIPELINE_STACK_SIZE);
+static struct k_thread ingestion_pipeline_threads[CONFIG_AMPOULE_INGESTION_PIPELINE_THREADS];
+#endif
 
 /******************************************************************************/
 /* Global Function Definitions                                                */
@@ -44,132 +197,1433 @@ int ingestion_init(struct ingestion *ingestion, struct ingestion_transport *tran
 		return -EINVAL;
 	}
 
+	if ((transport->claim == NULL) != (transport->commit == NULL)) {
+		return -EINVAL;
+	}
+
 	ingestion->transport = transport;
 	ingestion->transport_context = context;
 
 	ingestion->rpc = rpc;
+	ingestion->workq = ingestion_workq_get();
+	k_mutex_init(&ingestion->tx_lock);
 
-	ingestion->bytes_read = 0;
 	ingestion->state = RCV_LENGTH_HIGH;
+	ingestion->framing = INGESTION_FRAMING_LENGTH;
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	ingestion->bus_enabled = false;
+#endif
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+	atomic_clear(&ingestion->streaming);
+	k_sem_init(&ingestion->stream_sem, 0, 1);
+#endif
+	atomic_clear(&ingestion->rx_paused);
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+	atomic_clear(&ingestion->pipelined);
+	k_sem_init(&ingestion->pipeline_drained, 0, 1);
+#endif
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+	ingestion->overtaken = 0;
+	ingestion->inspected = 0;
+#endif
 
 	k_work_init(&ingestion->ingest_work, ingestion_process);
 	k_work_init_delayable(&ingestion->timeout_work, ingestion_timeout);
 
-	ring_buf_init(&ingestion->rb, INGESTION_PACKET_MAX_SIZE, &ingestion->current[0]);
+	ring_buf_init(&ingestion->rb, sizeof(ingestion->rx_buffer), ingestion->rx_buffer);
+
+	return 0;
+}
+
+void ingestion_set_workq(struct ingestion *ingestion, struct k_work_q *workq)
+{
+	ingestion->workq = workq;
+}
+
+int ingestion_set_framing(struct ingestion *ingestion, enum ingestion_framing framing)
+{
+	if (framing == INGESTION_FRAMING_COBS && !IS_ENABLED(CONFIG_AMPOULE_INGESTION_COBS)) {
+		return -ENOTSUP;
+	}
+
+	ingestion->framing = framing;
+
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+	ingestion_cobs_reset(ingestion);
+#endif
+
+	return 0;
+}
+
+int ingestion_set_bus(struct ingestion *ingestion, const struct ingestion_bus *bus)
+{
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	if (bus->address > INGESTION_BUS_ADDRESS_MAX ||
+	    (bus->groups >> INGESTION_BUS_GROUPS) != 0) {
+		return -EINVAL;
+	}
+
+	ingestion->bus = *bus;
+	ingestion->bus_enabled = true;
+	ingestion->state = RCV_ADDRESS;
 
 	return 0;
+#else
+	return -ENOTSUP;
+#endif
 }
 
 int ingestion_feed(struct ingestion *ingestion, uint8_t *data, uint16_t len)
 {
-	ring_buf_put(&ingestion->rb, data, len);
+	AMPOULE_TRACE_ENTER(feed, ingestion, len);
+
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+	if (ingestion->framing == INGESTION_FRAMING_COBS) {
+		/* Only complete frames reach the ring, nothing to wake the worker for otherwise */
+		if (!ingestion_cobs_feed(ingestion, data, len)) {
+			AMPOULE_TRACE_EXIT(feed, ingestion, ring_buf_size_get(&ingestion->rb));
+			return 0;
+		}
+	} else
+#endif
+	{
+		uint32_t written = ring_buf_put(&ingestion->rb, data, len);
+
+		INGESTION_STATS_ADD(ingestion, bytes_dropped, len - written);
+	}
 
-	k_work_submit(&ingestion->ingest_work);
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+	/* The worker is decoding a frame larger than the ring, it takes bytes as they come */
+	if (atomic_get(&ingestion->streaming)) {
+		k_sem_give(&ingestion->stream_sem);
+	} else
+#endif
+	/* While waiting for a payload, only wake the worker once the whole frame is buffered */
+	if (ingestion->state != RCV_DATA ||
+	    ring_buf_size_get(&ingestion->rb) >= ingestion->expected_size) {
+		ingestion_submit(ingestion, &ingestion->ingest_work);
+	}
 
 	LOG_HEXDUMP_DBG(data, len, "Feed data");
 
+	AMPOULE_TRACE_EXIT(feed, ingestion, ring_buf_size_get(&ingestion->rb));
+
+	return 0;
+}
+
+uint32_t ingestion_rx_space(struct ingestion *ingestion)
+{
+	return ingestion_rx_free(ingestion);
+}
+
+bool ingestion_rx_pause(struct ingestion *ingestion, uint16_t space)
+{
+	ingestion->rx_resume_space = space;
+	atomic_set(&ingestion->rx_paused, 1);
+
+	/* The queue may have freed the space before seeing the flag, nobody would resume then */
+	if (ingestion_rx_free(ingestion) >= space) {
+		return !atomic_cas(&ingestion->rx_paused, 1, 0);
+	}
+
+	return true;
+}
+
+int ingestion_reset(struct ingestion *ingestion)
+{
+	struct k_work_sync sync;
+
+	/* Frames already buffered are still answered, pipelined ones included */
+	k_work_flush(&ingestion->ingest_work, &sync);
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+	/* A give left from an earlier drain only costs another look at the count */
+	while (atomic_get(&ingestion->pipelined) > 0) {
+		k_sem_take(&ingestion->pipeline_drained, K_FOREVER);
+	}
+#endif
+	k_work_cancel_delayable_sync(&ingestion->timeout_work, &sync);
+
+	ring_buf_reset(&ingestion->rb);
+	ingestion->state = ingestion_first_state(ingestion);
+	atomic_clear(&ingestion->rx_paused);
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+	ingestion->overtaken = 0;
+	ingestion->inspected = 0;
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+	ingestion_cobs_reset(ingestion);
+#endif
+
 	return 0;
 }
 
+uint32_t ingestion_frames_free(void)
+{
+	return k_mem_slab_num_free_get(&ingestion_frames);
+}
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+int ingestion_stats_register(struct ingestion *ingestion, const char *name)
+{
+	int rc = 0;
+
+	k_mutex_lock(&ingestion_instances_lock, K_FOREVER);
+
+	if (sys_slist_find(&ingestion_instances, &ingestion->stats_node, NULL)) {
+		rc = -EALREADY;
+		goto out;
+	}
+
+	ingestion->name = name;
+	sys_slist_append(&ingestion_instances, &ingestion->stats_node);
+
+#if defined(CONFIG_STATS)
+	stats_init(&ingestion->stats.hdr, STATS_SIZE_32, ARRAY_SIZE(ingestion_stats_names),
+		   IS_ENABLED(CONFIG_STATS_NAMES) ? ingestion_stats_names : NULL,
+		   IS_ENABLED(CONFIG_STATS_NAMES) ? ARRAY_SIZE(ingestion_stats_names) : 0);
+	rc = stats_register(name, &ingestion->stats.hdr);
+#endif
+
+out:
+	k_mutex_unlock(&ingestion_instances_lock);
+
+	return rc;
+}
+
+int ingestion_stats_get(uint32_t index, const char **name, struct ingestion_stats *stats)
+{
+	struct ingestion *ingestion;
+	int rc = -ENOENT;
+
+	k_mutex_lock(&ingestion_instances_lock, K_FOREVER);
+
+	SYS_SLIST_FOR_EACH_CONTAINER(&ingestion_instances, ingestion, stats_node) {
+		if (index-- == 0) {
+			*name = ingestion->name;
+			*stats = ingestion->stats;
+			rc = 0;
+			break;
+		}
+	}
+
+	k_mutex_unlock(&ingestion_instances_lock);
+
+	return rc;
+}
+#endif
+
 /******************************************************************************/
 /* Local Function Definitions                                                 */
 /******************************************************************************/
+static struct k_work_q *ingestion_workq_get(void)
+{
+#if defined(CONFIG_AMPOULE_INGESTION_WORKQ)
+	return &ingestion_workq;
+#else
+	return &k_sys_work_q;
+#endif
+}
+
+static void ingestion_submit(struct ingestion *ingestion, struct k_work *work)
+{
+	k_work_submit_to_queue(ingestion->workq, work);
+}
+
+/* Bytes in front of the size header, the address of bus frames */
+static uint8_t ingestion_address_size(struct ingestion *ingestion)
+{
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	if (ingestion->bus_enabled) {
+		return INGESTION_BUS_ADDRESS_SIZE;
+	}
+#endif
+
+	return 0;
+}
+
+static enum ingestion_state ingestion_first_state(struct ingestion *ingestion)
+{
+	return ingestion_address_size(ingestion) > 0 ? RCV_ADDRESS : RCV_LENGTH_HIGH;
+}
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+/* Group and broadcast requests reach several devices at once */
+static bool ingestion_bus_multicast(uint8_t address)
+{
+	return address >= INGESTION_BUS_GROUP(0) && address <= INGESTION_BUS_BROADCAST;
+}
+
+/* Responses of other devices carry INGESTION_BUS_RESPONSE and are never accepted */
+static bool ingestion_bus_accepts(const struct ingestion_bus *bus, uint8_t address)
+{
+	if (address == INGESTION_BUS_BROADCAST) {
+		return true;
+	}
+
+	if (ingestion_bus_multicast(address)) {
+		return bus->groups & BIT(address - INGESTION_BUS_GROUP(0));
+	}
+
+	return address == bus->address;
+}
+#endif
+
+static uint32_t ingestion_rx_free(struct ingestion *ingestion)
+{
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+	if (ingestion->framing == INGESTION_FRAMING_COBS) {
+		uint32_t capacity = ring_buf_capacity_get(&ingestion->rb);
+		uint32_t used = ring_buf_size_get(&ingestion->rb);
+
+		/* The claim of the frame being decoded spans the whole free space but only holds
+		 * what was decoded so far. With no complete frame ahead of it, nothing would ever
+		 * free the ring for a transport waiting on it, so it is left out: reading goes on
+		 * and a frame outgrowing the ring is dropped until the next delimiter.
+		 */
+		if (used > 0 && !ingestion->cobs.dropping) {
+			used += ingestion->cobs.len;
+		}
+
+		return capacity - MIN(used, capacity);
+	}
+#endif
+
+	return ring_buf_space_get(&ingestion->rb);
+}
+
+static void ingestion_rx_resume(struct ingestion *ingestion)
+{
+	if (!atomic_get(&ingestion->rx_paused) ||
+	    ingestion_rx_free(ingestion) < ingestion->rx_resume_space) {
+		return;
+	}
+
+	if (atomic_cas(&ingestion->rx_paused, 1, 0) && ingestion->transport->resume != NULL) {
+		ingestion->transport->resume(ingestion->transport_context);
+	}
+}
+
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+static void ingestion_cobs_reset(struct ingestion *ingestion)
+{
+	/* No block yet, the first code byte doesn't follow an implicit zero */
+	ingestion->cobs = (struct ingestion_cobs){.code = 0xFF};
+}
+
+static void ingestion_cobs_emit(struct ingestion *ingestion, uint8_t byte)
+{
+	struct ingestion_cobs *cobs = &ingestion->cobs;
+
+	/* Still counted, to account for the dropped bytes */
+	cobs->len++;
+
+	if (cobs->dropping) {
+		return;
+	}
+
+	/* Claims stay open across feeds, each one continues where the previous one ended */
+	if (cobs->out_left == 0) {
+		cobs->out_left = ring_buf_put_claim(&ingestion->rb, &cobs->out, UINT32_MAX);
+		if (cobs->out_left == 0) {
+			ring_buf_put_finish(&ingestion->rb, 0);
+			cobs->dropping = true;
+			return;
+		}
+
+		if (cobs->len == 1) {
+			cobs->start = cobs->out;
+		}
+	}
+
+	*cobs->out++ = byte;
+	cobs->out_left--;
+}
+
+/* Decoded frames are contiguous in the ring memory, past its end they continue at its start */
+static uint8_t *ingestion_cobs_at(struct ingestion *ingestion, uint16_t offset)
+{
+	uint16_t index = ingestion->cobs.start - ingestion->rx_buffer + offset;
+
+	return &ingestion->rx_buffer[index % sizeof(ingestion->rx_buffer)];
+}
+
+static uint16_t ingestion_cobs_crc(struct ingestion *ingestion)
+{
+	struct ingestion_cobs *cobs = &ingestion->cobs;
+	uint8_t *end = &ingestion->rx_buffer[sizeof(ingestion->rx_buffer)];
+	uint16_t head = MIN(cobs->len, end - cobs->start);
+	uint16_t crc = crc16_itu_t(0xFFFF, cobs->start, head);
+
+	return crc16_itu_t(crc, ingestion->rx_buffer, cobs->len - head);
+}
+
+/* Commits the frame ending at a delimiter to the ring if it is valid, returns true if so */
+static bool ingestion_cobs_end(struct ingestion *ingestion)
+{
+	struct ingestion_cobs *cobs = &ingestion->cobs;
+	bool valid = false;
+
+	if (cobs->dropping) {
+		INGESTION_STATS_ADD(ingestion, bytes_dropped, cobs->len);
+	} else if (cobs->len > 0) {
+		uint8_t header = ingestion_address_size(ingestion);
+		uint16_t size = cobs->len - header - sizeof(uint16_t) - INGESTION_COBS_CRC_SIZE;
+
+		/* The CRC over a frame and its CRC trailer is null, the size header must agree */
+		valid = cobs->left == 0 &&
+			cobs->len >= header + sizeof(uint16_t) + INGESTION_COBS_CRC_SIZE &&
+			ingestion_cobs_crc(ingestion) == 0 &&
+			(((*ingestion_cobs_at(ingestion, header) << 8) |
+			  *ingestion_cobs_at(ingestion, header + 1)) &
+			 INGESTION_FRAME_SIZE_MASK) == size;
+	}
+
+	if (valid) {
+		ring_buf_put_finish(&ingestion->rb, cobs->len - INGESTION_COBS_CRC_SIZE);
+	} else {
+		ring_buf_put_finish(&ingestion->rb, 0);
+
+		if (cobs->len > 0 && !cobs->dropping) {
+			INGESTION_STATS_INC(ingestion, crc_errors);
+		}
+	}
+
+	ingestion_cobs_reset(ingestion);
+
+	return valid;
+}
+
+/* Decodes data into the ring, returns true if at least one frame was completed */
+static bool ingestion_cobs_feed(struct ingestion *ingestion, const uint8_t *data, uint16_t len)
+{
+	struct ingestion_cobs *cobs = &ingestion->cobs;
+	bool complete = false;
+
+	for (uint16_t i = 0; i < len; i++) {
+		uint8_t byte = data[i];
+
+		if (byte == INGESTION_COBS_DELIMITER) {
+			complete |= ingestion_cobs_end(ingestion);
+		} else if (cobs->left > 0) {
+			ingestion_cobs_emit(ingestion, byte);
+			cobs->left--;
+		} else {
+			/* Every block but a maximal one ends with a zero, implied by the next code */
+			if (cobs->code != 0xFF) {
+				ingestion_cobs_emit(ingestion, 0);
+			}
+
+			cobs->code = byte;
+			cobs->left = byte - 1;
+		}
+	}
+
+	return complete;
+}
+
+/* Encodes len bytes found at offset in buf to its start, offset covers the COBS overhead so
+ * nothing is overwritten before being read. Returns the encoded size.
+ */
+static uint16_t ingestion_cobs_encode(uint8_t *buf, uint16_t offset, uint16_t len)
+{
+	uint16_t code_index = 0;
+	uint16_t out = 1;
+	uint8_t code = 1;
+
+	for (uint16_t i = 0; i < len; i++) {
+		uint8_t byte = buf[offset + i];
+
+		if (byte != 0) {
+			buf[out++] = byte;
+			code++;
+		}
+
+		if (byte == 0 || code == 0xFF) {
+			buf[code_index] = code;
+			code_index = out++;
+			code = 1;
+		}
+	}
+
+	buf[code_index] = code;
+
+	return out;
+}
+#endif
+
 static void ingestion_timeout(struct k_work *work)
 {
 	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
 	struct ingestion *ingestion = CONTAINER_OF(dwork, struct ingestion, timeout_work);
 
-	ring_buf_reset(&ingestion->rb);
-	ingestion->state = RCV_LENGTH_HIGH;
+	/* Completed as the timer fired, ingestion_feed() already queued its processing */
+	if (ingestion->state == RCV_DATA &&
+	    ring_buf_size_get(&ingestion->rb) >= ingestion->expected_size) {
+		return;
+	}
+
+	/* The feeding context may be putting bytes right now, resetting the ring would move its
+	 * indices under it. Only what it published up to here is dropped, from our side of the
+	 * ring, what it puts from now on starts the next frame.
+	 */
+	ring_buf_get(&ingestion->rb, NULL, ring_buf_size_get(&ingestion->rb));
+	ingestion->state = ingestion_first_state(ingestion);
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+	ingestion->overtaken = 0;
+	ingestion->inspected = 0;
+#endif
+
+	INGESTION_STATS_INC(ingestion, timeouts);
+
+	/* Bytes fed since the drop may have seen the previous state and not woken us */
+	if (ring_buf_size_get(&ingestion->rb) != 0) {
+		ingestion_submit(ingestion, &ingestion->ingest_work);
+	}
+
+	/* A frame larger than the free space never completes, the drop makes room for the next */
+	ingestion_rx_resume(ingestion);
 }
 
-static int ingestion_parse(struct ingestion *ingestion, uint8_t *data, uint16_t len)
+static bool ingestion_ring_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
 {
-	int ret;
-	bool status;
-	uint8_t output[512];
-	ampoule_Command command;
-	ampoule_Response response;
+	struct ring_buf *rb = stream->state;
 
-	pb_istream_t istream = pb_istream_from_buffer(data, len);
+	/* A NULL buffer asks to skip bytes, ring_buf_get() discards them the same way */
+	return ring_buf_get(rb, buf, count) == count;
+}
 
-	status = pb_decode(&istream, ampoule_Command_fields, &command);
-	if (!status) {
-		return -EINVAL;
-	}
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+/* COBS frames are only queued once complete, larger ones are dropped while being received */
+static bool ingestion_streamed(struct ingestion *ingestion)
+{
+	return ingestion->framing == INGESTION_FRAMING_LENGTH &&
+	       ingestion->expected_size > ring_buf_capacity_get(&ingestion->rb);
+}
 
-	ingestion->rpc->on_command(&command, &response);
+static void ingestion_stream_begin(struct ingestion *ingestion)
+{
+	ingestion->stream_left = ingestion->expected_size;
+	k_sem_reset(&ingestion->stream_sem);
+	atomic_set(&ingestion->streaming, 1);
+}
 
-	pb_ostream_t ostream =
-		pb_ostream_from_buffer(&output[2], sizeof(output) - sizeof(uint16_t));
-	status = pb_encode(&ostream, ampoule_Response_fields, &response);
-	if (!status) {
-		return -EINVAL;
+/* Takes count bytes off the ring as they are fed, false if the link stalled or already had */
+static bool ingestion_stream_get(struct ingestion *ingestion, uint8_t *buf, size_t count)
+{
+	while (count > 0) {
+		if (!atomic_get(&ingestion->streaming)) {
+			return false;
+		}
+
+		uint32_t got = ring_buf_get(&ingestion->rb, buf, count);
+
+		if (got > 0) {
+			buf = buf != NULL ? buf + got : NULL;
+			count -= got;
+			ingestion->stream_left -= got;
+			ingestion_rx_resume(ingestion);
+			continue;
+		}
+
+		/* The timeout applies between chunks, a whole frame may take longer at low baud */
+		int rc = k_sem_take(&ingestion->stream_sem,
+				    K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
+
+		if (rc < 0) {
+			atomic_clear(&ingestion->streaming);
+			INGESTION_STATS_INC(ingestion, timeouts);
+			return false;
+		}
 	}
 
-	uint16_t bytes_to_write = ostream.bytes_written;
-	sys_put_be16(bytes_to_write, &output[0]);
+	return true;
+}
+
+static bool ingestion_stream_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
+{
+	return ingestion_stream_get(stream->state, buf, count);
+}
+
+/* Drops what is left of the frame, returns -ETIMEDOUT if it never came. A decoder failing in a
+ * submessage leaves its stream behind, what was read is counted here instead.
+ */
+static int ingestion_stream_end(struct ingestion *ingestion)
+{
+	bool complete = ingestion_stream_get(ingestion, NULL, ingestion->stream_left);
 
-	bytes_to_write += sizeof(uint16_t);
+	atomic_clear(&ingestion->streaming);
+
+	return complete ? 0 : -ETIMEDOUT;
+}
+#endif
 
+static int ingestion_write(struct ingestion *ingestion, uint8_t *data, uint16_t len)
+{
+	int ret;
 	int bytes_written = 0;
 
 	do {
+		AMPOULE_TRACE_ENTER(write, ingestion, len - bytes_written);
 		ret = ingestion->transport->write(ingestion->transport_context,
-						  &output[bytes_written],
-						  bytes_to_write - bytes_written);
+						  &data[bytes_written], len - bytes_written);
+		AMPOULE_TRACE_EXIT(write, ingestion, ret);
 		if (ret < 0) {
-			break;
+			return ret;
+		}
+
+		/* Transports wait for TX space themselves, nothing written means they gave up */
+		if (ret == 0) {
+			return -EAGAIN;
+		}
+
+		if (ret < len - bytes_written) {
+			INGESTION_STATS_INC(ingestion, tx_short_writes);
 		}
+
 		bytes_written += ret;
-	} while (bytes_written < bytes_to_write);
+	} while (bytes_written < len);
 
 	return 0;
 }
 
-static void ingestion_process(struct k_work *work)
+static bool ingestion_tx_stream(pb_ostream_t *stream, const pb_byte_t *buf, size_t count)
 {
-	struct ingestion *ingestion = CONTAINER_OF(work, struct ingestion, ingest_work);
+	struct ingestion_tx *tx = stream->state;
+	struct ingestion *ingestion = tx->ingestion;
+	uint8_t *data;
 	int rc;
 
-	do {
-		switch (ingestion->state) {
-		case RCV_LENGTH_HIGH: {
-			uint8_t high;
-			rc = ring_buf_get(&ingestion->rb, &high, sizeof(uint8_t));
-			__ASSERT_NO_MSG(rc == 1);
-			ingestion->expected_size = high << 8;
-			ingestion->state = RCV_LENGTH_LOW;
-			k_work_schedule(&ingestion->timeout_work,
-					K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
-		} break;
-		case RCV_LENGTH_LOW: {
-			uint8_t low;
-			rc = ring_buf_get(&ingestion->rb, &low, sizeof(uint8_t));
-			__ASSERT_NO_MSG(rc == 1);
-			ingestion->expected_size += low;
-			ingestion->state = RCV_DATA;
+	while (count > 0) {
+		rc = ingestion->transport->claim(ingestion->transport_context, &data, count);
+		if (rc <= 0) {
+			return false;
 		}
 
-		break;
-		case RCV_DATA: {
-			k_sleep(K_MSEC(1));
+		memcpy(data, buf, rc);
+		buf += rc;
+		count -= rc;
+	}
 
-			if (ring_buf_size_get(&ingestion->rb) >= ingestion->expected_size) {
-				ingestion->state = PARSING;
-				k_work_cancel_delayable(&ingestion->timeout_work);
-				k_work_submit(&ingestion->ingest_work);
-				return;
-			}
-		} break;
-		case PARSING: {
-			uint8_t *data;
-			rc = ring_buf_get_claim(&ingestion->rb, &data, ingestion->expected_size);
-			ingestion_parse(ingestion, data, rc);
+	return true;
+}
+
+static int ingestion_tx_open(struct ingestion *ingestion, struct ingestion_tx *tx)
+{
+	tx->ingestion = ingestion;
+	tx->header_size = tx->address_size + sizeof(uint16_t);
+
+	if (tx->flags & INGESTION_FRAME_FLAG_ID) {
+		tx->header_size += INGESTION_FRAME_ID_SIZE;
+	}
+
+	if (tx->flags & INGESTION_FRAME_FLAG_CREDIT) {
+		tx->header_size += INGESTION_FRAME_CREDIT_SIZE;
+	}
+
+	if (tx->buffer != NULL) {
+		uint16_t trailer_size = 0;
+
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+		if (ingestion->framing == INGESTION_FRAMING_COBS) {
+			tx->buffer_offset = INGESTION_COBS_OVERHEAD(tx->buffer_size);
+			trailer_size = INGESTION_COBS_CRC_SIZE + sizeof(uint8_t);
+		}
+#endif
+
+		tx->ostream = pb_ostream_from_buffer(
+			&tx->buffer[tx->buffer_offset + tx->header_size],
+			tx->buffer_size - tx->buffer_offset - tx->header_size - trailer_size);
+		return 0;
+	}
+
+	/* Reserve the header, byte by byte as it may wrap the transport buffer */
+	for (int i = 0; i < tx->header_size; i++) {
+		if (ingestion->transport->claim(ingestion->transport_context, &tx->header[i], 1) !=
+		    1) {
+			ingestion->transport->commit(ingestion->transport_context, 0);
+			return -ENOMEM;
+		}
+	}
+
+	tx->ostream = (pb_ostream_t){
+		.callback = ingestion_tx_stream,
+		.state = tx,
+		.max_size = INGESTION_RESPONSE_MAX_SIZE - tx->header_size,
+	};
+
+	return 0;
+}
+
+static void ingestion_tx_abort(struct ingestion_tx *tx)
+{
+	struct ingestion *ingestion = tx->ingestion;
+
+	if (tx->buffer == NULL) {
+		ingestion->transport->commit(ingestion->transport_context, 0);
+	}
+}
+
+static int ingestion_tx_close(struct ingestion_tx *tx)
+{
+	struct ingestion *ingestion = tx->ingestion;
+	uint16_t frame_size =
+		tx->ostream.bytes_written + tx->header_size - tx->address_size - sizeof(uint16_t);
+	uint16_t len = tx->address_size + sizeof(uint16_t) + frame_size;
+	uint8_t header[INGESTION_HEADER_MAX_SIZE];
+	uint8_t offset = tx->address_size;
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	if (tx->silent) {
+		return 0;
+	}
+
+	if (tx->address_size > 0) {
+		header[0] = INGESTION_BUS_RESPONSE | ingestion->bus.address;
+	}
+#endif
+
+	sys_put_be16(frame_size | tx->flags, &header[offset]);
+	offset += sizeof(uint16_t);
+
+	if (tx->flags & INGESTION_FRAME_FLAG_ID) {
+		sys_put_be16(tx->id, &header[offset]);
+		offset += INGESTION_FRAME_ID_SIZE;
+	}
+
+	/* Measured as late as possible, the request this answers has been consumed by now */
+	if (tx->flags & INGESTION_FRAME_FLAG_CREDIT) {
+		sys_put_be16(MIN(ring_buf_space_get(&ingestion->rb), UINT16_MAX), &header[offset]);
+	}
+
+	if (tx->buffer != NULL) {
+		uint8_t *frame = &tx->buffer[tx->buffer_offset];
+
+		memcpy(frame, header, tx->header_size);
+
+#if defined(CONFIG_AMPOULE_INGESTION_COBS)
+		if (ingestion->framing == INGESTION_FRAMING_COBS) {
+			sys_put_be16(crc16_itu_t(0xFFFF, frame, len), &frame[len]);
+			len = ingestion_cobs_encode(tx->buffer, tx->buffer_offset,
+						    len + INGESTION_COBS_CRC_SIZE);
+			tx->buffer[len++] = INGESTION_COBS_DELIMITER;
+			frame = tx->buffer;
+		}
+#endif
+
+		return ingestion_write(ingestion, frame, len);
+	}
+
+	for (int i = 0; i < tx->header_size; i++) {
+		*tx->header[i] = header[i];
+	}
+
+	AMPOULE_TRACE_ENTER(commit, ingestion, len);
+	int rc = ingestion->transport->commit(ingestion->transport_context, len);
+	AMPOULE_TRACE_EXIT(commit, ingestion, rc);
+
+	return rc;
+}
+
+static const pb_msgdesc_t *ingestion_command_fields(uint16_t flags)
+{
+	return (flags & INGESTION_FRAME_FLAG_EXT) ? ampoule_ExtCommand_fields
+						  : ampoule_Command_fields;
+}
+
+static const pb_msgdesc_t *ingestion_response_fields(uint16_t flags)
+{
+	return (flags & INGESTION_FRAME_FLAG_EXT) ? ampoule_ExtResponse_fields
+						  : ampoule_Response_fields;
+}
+
+static void ingestion_handle(struct ingestion *ingestion, uint16_t flags,
+			     union ingestion_command *command, union ingestion_response *response)
+{
+	if (!(flags & INGESTION_FRAME_FLAG_EXT)) {
+		AMPOULE_TRACE_ENTER(handler, ingestion, command->command.opcode);
+		ingestion->rpc->on_command(&command->command, &response->response);
+		AMPOULE_TRACE_EXIT(handler, ingestion, response->response.success);
+		return;
+	}
+
+	if (ingestion->rpc->on_ext_command == NULL) {
+		response->ext.opcode = command->ext.opcode;
+		response->ext.success = false;
+		response->ext.error = -ENOTSUP;
+		return;
+	}
+
+	AMPOULE_TRACE_ENTER(handler, ingestion, command->ext.opcode);
+	ingestion->rpc->on_ext_command(&command->ext, &response->ext);
+	AMPOULE_TRACE_EXIT(handler, ingestion, response->ext.success);
+}
+
+/* Dispatches every command of the batch and sends their responses. A malformed command ends the
+ * batch, those before it have run so it is answered by an error response closing the batch, and
+ * malformed is set.
+ */
+static int ingestion_dispatch_batch(struct ingestion_frame *frame, pb_istream_t *istream,
+				    struct ingestion_tx *tx, bool *malformed)
+{
+	struct ingestion *ingestion = frame->ingestion;
+	size_t response_size;
+	int rc;
+
+	while (!*malformed && istream->bytes_left > 0) {
+		AMPOULE_TRACE_ENTER(decode, ingestion, istream->bytes_left);
+		bool decoded = pb_decode_ex(istream, ingestion_command_fields(tx->flags),
+					    &frame->command, PB_DECODE_DELIMITED);
+		AMPOULE_TRACE_EXIT(decode, ingestion, decoded);
+
+		memset(&frame->response, 0, sizeof(frame->response));
+
+		if (decoded) {
+			ingestion_handle(ingestion, tx->flags, &frame->command, &frame->response);
+		} else {
+			/* Unsuccessful, and with no opcode as none could be read */
+			*malformed = true;
+			if (tx->flags & INGESTION_FRAME_FLAG_EXT) {
+				frame->response.ext.error = -EINVAL;
+			}
+		}
+
+		if (!pb_get_encoded_size(&response_size, ingestion_response_fields(tx->flags),
+					 &frame->response)) {
+			return -EMSGSIZE;
+		}
+
+		/* Send what we have when the next response, plus its varint prefix, won't fit */
+		if (tx->ostream.max_size - tx->ostream.bytes_written <
+		    response_size + sizeof(uint16_t)) {
+			rc = ingestion_tx_close(tx);
+			if (rc < 0) {
+				return rc;
+			}
+
+			rc = ingestion_tx_open(ingestion, tx);
+			if (rc < 0) {
+				return rc;
+			}
+		}
+
+		AMPOULE_TRACE_ENTER(encode, ingestion, tx->ostream.bytes_written);
+		bool encoded = pb_encode_ex(&tx->ostream, ingestion_response_fields(tx->flags),
+					    &frame->response, PB_ENCODE_DELIMITED);
+		AMPOULE_TRACE_EXIT(encode, ingestion, tx->ostream.bytes_written);
+		if (!encoded) {
+			return -EMSGSIZE;
+		}
+	}
 
-			ring_buf_get_finish(&ingestion->rb, ingestion->expected_size);
+	return ingestion_tx_close(tx);
+}
+
+/* Encodes the frame response or, for a batch, dispatches istream and encodes all its responses */
+static int ingestion_respond(struct ingestion_frame *frame, struct ingestion_tx *tx,
+			     pb_istream_t *istream)
+{
+	bool malformed = false;
+	int rc;
+
+	rc = ingestion_tx_open(frame->ingestion, tx);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (tx->flags & INGESTION_FRAME_FLAG_BATCH) {
+		rc = ingestion_dispatch_batch(frame, istream, tx, &malformed);
+	} else {
+		AMPOULE_TRACE_ENTER(encode, frame->ingestion, tx->ostream.bytes_written);
+		bool encoded = pb_encode(&tx->ostream, ingestion_response_fields(tx->flags),
+					 &frame->response);
+		AMPOULE_TRACE_EXIT(encode, frame->ingestion, tx->ostream.bytes_written);
+
+		rc = encoded ? ingestion_tx_close(tx) : -EMSGSIZE;
+	}
+
+	if (rc < 0) {
+		ingestion_tx_abort(tx);
+		return rc;
+	}
+
+	return malformed ? -EINVAL : rc;
+}
+
+static int ingestion_send(struct ingestion_frame *frame, pb_istream_t *istream)
+{
+	struct ingestion *ingestion = frame->ingestion;
+	struct ingestion_tx tx = {
+		.flags = frame->flags,
+		.id = frame->id,
+		.address_size = ingestion_address_size(ingestion),
+	};
+	/* COBS frames are encoded in place once complete, that needs a linear buffer */
+	bool linear = ingestion->transport->claim == NULL ||
+		      ingestion->framing != INGESTION_FRAMING_LENGTH;
+	int rc;
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	if (tx.address_size > 0 && ingestion_bus_multicast(frame->address)) {
+		/* Every member would answer at once, the host asks for answers with an id */
+		if (!(frame->flags & INGESTION_FRAME_FLAG_ID)) {
+			tx.silent = true;
+			linear = true;
+		} else {
+			uint64_t slot_us = (uint64_t)ingestion->bus.address *
+					   ingestion->bus.slot_us;
+
+			/* Only holds this instance, bus instances have a workqueue of their own */
+
+			k_sleep(K_TIMEOUT_ABS_TICKS(frame->ticks + k_us_to_ticks_ceil64(slot_us)));
+		}
+	}
+#endif
+
+	if (linear) {
+		tx.buffer = frame->output;
+		tx.buffer_size = sizeof(frame->output);
+	}
+
+	/* Pipeline threads and the ingestion queue may all be responding at once */
+	k_mutex_lock(&ingestion->tx_lock, K_FOREVER);
+
+	rc = ingestion_respond(frame, &tx, istream);
+	if (rc == -EMSGSIZE || rc == -ENOMEM) {
+		INGESTION_STATS_INC(ingestion, encode_errors);
+	}
+
+	k_mutex_unlock(&ingestion->tx_lock);
+
+	return rc;
+}
+
+static int ingestion_complete(struct ingestion_frame *frame)
+{
+	memset(&frame->response, 0, sizeof(frame->response));
+	ingestion_handle(frame->ingestion, frame->flags, &frame->command, &frame->response);
+
+	return ingestion_send(frame, NULL);
+}
+
+/* Waits up to timeout while every frame is in use, which holds off reading further frames.
+ * Returns NULL once it expired.
+ */
+static struct ingestion_frame *ingestion_frame_alloc(struct ingestion *ingestion, uint16_t flags,
+						     uint16_t id, k_timeout_t timeout)
+{
+	struct ingestion_frame *frame;
+
+	if (k_mem_slab_alloc(&ingestion_frames, (void **)&frame, timeout) < 0) {
+		return NULL;
+	}
+
+	atomic_set(&frame->refs, 1);
+	frame->ingestion = ingestion;
+	frame->flags = flags;
+	frame->id = id;
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	frame->address = ingestion->frame_address;
+	frame->ticks = ingestion->frame_ticks;
+#endif
+
+	return frame;
+}
+
+static void ingestion_frame_ref(struct ingestion_frame *frame)
+{
+	atomic_inc(&frame->refs);
+}
+
+static void ingestion_frame_unref(struct ingestion_frame *frame)
+{
+	if (atomic_dec(&frame->refs) == 1) {
+		k_mem_slab_free(&ingestion_frames, frame);
+	}
+}
+
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+static void ingestion_pipeline_thread(void *p1, void *p2, void *p3)
+{
+	struct ingestion_frame *frame;
+	int rc;
+
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	while (true) {
+		k_msgq_get(&ingestion_request_q, &frame, K_FOREVER);
+
+		rc = ingestion_complete(frame);
+		if (rc < 0) {
+			LOG_WRN("Failed to answer request %u (%d)", frame->id, rc);
+		}
+
+		struct ingestion *ingestion = frame->ingestion;
+
+		ingestion_frame_unref(frame);
+		if (atomic_dec(&ingestion->pipelined) == 1) {
+			k_sem_give(&ingestion->pipeline_drained);
+		}
+	}
+}
+#endif
+
+static int ingestion_dispatch(struct ingestion_frame *frame, pb_istream_t *istream)
+{
+	if (frame->flags & INGESTION_FRAME_FLAG_BATCH) {
+		return ingestion_send(frame, istream);
+	}
+
+	AMPOULE_TRACE_ENTER(decode, frame->ingestion, istream->bytes_left);
+	bool decoded = pb_decode(istream, ingestion_command_fields(frame->flags), &frame->command);
+	AMPOULE_TRACE_EXIT(decode, frame->ingestion, decoded);
+	if (!decoded) {
+		return -EINVAL;
+	}
+
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+	/* Identified requests may complete out of order, hand them to the pipeline */
+	if (frame->flags & INGESTION_FRAME_FLAG_ID) {
+		ingestion_frame_ref(frame);
+		atomic_inc(&frame->ingestion->pipelined);
+		k_msgq_put(&ingestion_request_q, &frame, K_FOREVER);
+		return 0;
+	}
+#endif
+
+	return ingestion_complete(frame);
+}
+
+static int ingestion_parse(struct ingestion *ingestion, uint16_t flags, uint16_t len)
+{
+	struct ingestion_frame *frame;
+	uint8_t raw_id[INGESTION_FRAME_ID_SIZE];
+	uint16_t id = 0;
+	int rc;
+
+	/* Decode straight from the ring, a frame wrapping its end is read in two spans */
+	pb_istream_t istream = {
+		.callback = ingestion_ring_read,
+		.state = &ingestion->rb,
+		.bytes_left = len,
+	};
+
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+	bool streamed = ingestion_streamed(ingestion);
+
+	/* Too large for the ring, decoding waits for each byte it reads */
+	if (streamed) {
+		istream.callback = ingestion_stream_read;
+		istream.state = ingestion;
+		ingestion_stream_begin(ingestion);
+	}
+#endif
+
+	if (flags & ~INGESTION_FRAME_FLAGS_MASK) {
+		rc = -ENOTSUP;
+	} else if ((flags & INGESTION_FRAME_FLAG_ID) &&
+		   !pb_read(&istream, raw_id, sizeof(raw_id))) {
+		rc = -EINVAL;
+	} else {
+		if (flags & INGESTION_FRAME_FLAG_ID) {
+			id = sys_get_be16(raw_id);
+		}
+
+		/* Other instances hold every frame, possibly stuck sending, the frame is dropped */
+		frame = ingestion_frame_alloc(ingestion, flags, id,
+					      K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
+		if (frame == NULL) {
+			INGESTION_STATS_INC(ingestion, frames_dropped);
+			rc = -ENOMEM;
+		} else {
+			rc = ingestion_dispatch(frame, &istream);
+			ingestion_frame_unref(frame);
+		}
+	}
+
+	/* Drop whatever the decoder left behind so the next frame starts aligned */
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+	if (streamed) {
+		int end = ingestion_stream_end(ingestion);
+
+		return end < 0 ? end : rc;
+	}
+#endif
+	ring_buf_get(&ingestion->rb, NULL, istream.bytes_left);
+
+	return rc;
+}
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+static void ingestion_stats_frame(struct ingestion *ingestion, int rc, uint32_t start)
+{
+	uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+
+	/* Pipelined requests are counted once queued, their handling time is the pipeline's */
+	switch (rc) {
+	case 0:
+		INGESTION_STATS_INC(ingestion, frames_ok);
+		break;
+	case -EINVAL:
+	case -ENOTSUP:
+		INGESTION_STATS_INC(ingestion, decode_errors);
+		return;
+	default:
+		/* Encode and transport errors are counted on the way out */
+		return;
+	}
+
+	INGESTION_STATS_INC(ingestion,
+			    latency[MIN(find_msb_set(us), INGESTION_STATS_LATENCY_BUCKETS - 1)]);
+}
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+static uint8_t ingestion_peek_byte(struct ingestion_peek *peek)
+{
+	uint16_t index = peek->head - peek->ingestion->rx_buffer + peek->offset++;
+
+	return peek->ingestion->rx_buffer[index % sizeof(peek->ingestion->rx_buffer)];
+}
+
+static bool ingestion_peek_read(pb_istream_t *stream, pb_byte_t *buf, size_t count)
+{
+	struct ingestion_peek *peek = stream->state;
+
+	for (size_t i = 0; i < count; i++) {
+		uint8_t byte = ingestion_peek_byte(peek);
+
+		if (buf != NULL) {
+			buf[i] = byte;
+		}
+	}
+
+	return true;
+}
+
+/* Reads field 1, the opcode of both ampoule_Command and ampoule_ExtCommand, skipping the rest */
+static bool ingestion_peek_opcode(pb_istream_t *stream, uint32_t *opcode)
+{
+	pb_wire_type_t wire_type;
+	uint32_t tag;
+	bool eof;
+
+	while (pb_decode_tag(stream, &wire_type, &tag, &eof)) {
+		if (tag == 1 && wire_type == PB_WT_VARINT) {
+			return pb_decode_varint32(stream, opcode);
+		}
+
+		if (!pb_skip_field(stream, wire_type)) {
+			return false;
+		}
+	}
+
+	/* proto3 leaves an opcode of 0 out */
+	*opcode = 0;
+
+	return eof;
+}
+
+/* Answers the frame of size bytes at peek if it is an urgent request, returns true if so */
+static bool ingestion_overtake_frame(struct ingestion *ingestion, struct ingestion_peek *peek,
+				     uint16_t flags, uint16_t size)
+{
+	struct ingestion_peek opcode_peek;
+	struct ingestion_frame *frame;
+	uint8_t raw_id[INGESTION_FRAME_ID_SIZE];
+	uint32_t opcode;
+	int rc;
+
+	pb_istream_t istream = {
+		.callback = ingestion_peek_read,
+		.state = peek,
+		.bytes_left = size,
+	};
+
+	/* Only identified requests are matched by the host whatever order they are answered in */
+	if ((flags & ~INGESTION_FRAME_FLAGS_MASK) || (flags & INGESTION_FRAME_FLAG_BATCH) ||
+	    !(flags & INGESTION_FRAME_FLAG_ID) || !pb_read(&istream, raw_id, sizeof(raw_id))) {
+		return false;
+	}
+
+	opcode_peek = *peek;
+	pb_istream_t opcode_stream = istream;
+
+	opcode_stream.state = &opcode_peek;
+
+	if (!ingestion_peek_opcode(&opcode_stream, &opcode) ||
+	    !ingestion->rpc->is_urgent(flags & INGESTION_FRAME_FLAG_EXT, opcode)) {
+		return false;
+	}
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	uint32_t start = k_cycle_get_32();
+#endif
+
+	/* Without a frame at hand, it is left to be handled in its turn */
+	frame = ingestion_frame_alloc(ingestion, flags, sys_get_be16(raw_id), K_NO_WAIT);
+	if (frame == NULL) {
+		return false;
+	}
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+	/* Not the frame being received, only requests addressed to the device get here */
+	frame->address = ingestion->bus.address;
+#endif
+
+	/* A malformed one is left to be reported in its turn */
+	AMPOULE_TRACE_ENTER(decode, ingestion, istream.bytes_left);
+	bool decoded = pb_decode(&istream, ingestion_command_fields(flags), &frame->command);
+	AMPOULE_TRACE_EXIT(decode, ingestion, decoded);
+
+	rc = decoded ? ingestion_complete(frame) : -EINVAL;
+
+	ingestion_frame_unref(frame);
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	if (rc != -EINVAL) {
+		ingestion_stats_frame(ingestion, rc, start);
+	}
+#endif
+
+	return rc != -EINVAL;
+}
+
+/* Answers the urgent requests queued behind the frame about to be parsed, whose payload is at
+ * the read position of the ring
+ */
+static void ingestion_overtake(struct ingestion *ingestion)
+{
+	uint32_t queued = ring_buf_size_get(&ingestion->rb);
+	uint32_t offset = ingestion->expected_size;
+	uint8_t address_size = ingestion_address_size(ingestion);
+	struct ingestion_peek peek = {.ingestion = ingestion};
+
+	if (ingestion->rpc->is_urgent == NULL || queued <= offset) {
+		return;
+	}
+
+	/* Claiming nothing only locates the read position */
+	ring_buf_get_claim(&ingestion->rb, &peek.head, 1);
+	ring_buf_get_finish(&ingestion->rb, 0);
+
+	for (int n = 1; n <= CONFIG_AMPOULE_INGESTION_PRIORITY_LOOKAHEAD; n++) {
+		if (offset + address_size + sizeof(uint16_t) > queued) {
+			return;
+		}
+
+		peek.offset = offset;
+
+		bool addressed = true;
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+		/* Only requests to this very device overtake, broadcasts wait for their slot */
+		if (address_size > 0) {
+			addressed = ingestion_peek_byte(&peek) == ingestion->bus.address;
+		}
+#endif
+
+		uint16_t header = ingestion_peek_byte(&peek) << 8;
+
+		header |= ingestion_peek_byte(&peek);
+
+		uint16_t size = header & INGESTION_FRAME_SIZE_MASK;
+
+		/* Frames are only looked at once complete */
+		offset += address_size + sizeof(uint16_t) + size;
+		if (offset > queued) {
+			return;
+		}
+
+		if (ingestion->inspected & BIT64(n)) {
+			continue;
+		}
+
+		ingestion->inspected |= BIT64(n);
+
+		if (!addressed) {
+			continue;
+		}
+
+		if (ingestion_overtake_frame(ingestion, &peek, header & ~INGESTION_FRAME_SIZE_MASK,
+					     size)) {
+			ingestion->overtaken |= BIT64(n);
+		}
+	}
+}
+
+/* The frame being received is done with, the next queued one takes its place */
+static void ingestion_overtake_next(struct ingestion *ingestion)
+{
+	ingestion->overtaken >>= 1;
+	ingestion->inspected >>= 1;
+}
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS) || defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+/* Drops the payload of the frame being received without decoding it */
+static void ingestion_skip(struct ingestion *ingestion)
+{
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+	if (ingestion_streamed(ingestion)) {
+		ingestion_stream_begin(ingestion);
+		(void)ingestion_stream_end(ingestion);
+	} else
+#endif
+	ring_buf_get(&ingestion->rb, NULL, ingestion->expected_size);
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+	ingestion_overtake_next(ingestion);
+#endif
+	ingestion->state = ingestion_first_state(ingestion);
+	ingestion_rx_resume(ingestion);
+}
+#endif
+
+static void ingestion_process(struct k_work *work)
+{
+	struct ingestion *ingestion = CONTAINER_OF(work, struct ingestion, ingest_work);
+	int rc;
+
+	AMPOULE_TRACE_ENTER(process, ingestion, ring_buf_size_get(&ingestion->rb));
+
+	do {
+		AMPOULE_TRACE(state, ingestion, ingestion->state);
+
+		switch (ingestion->state) {
+		case RCV_ADDRESS: {
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+			rc = ring_buf_get(&ingestion->rb, &ingestion->frame_address,
+					  sizeof(uint8_t));
+			__ASSERT_NO_MSG(rc == 1);
 			ingestion->state = RCV_LENGTH_HIGH;
+			k_work_schedule_for_queue(ingestion->workq, &ingestion->timeout_work,
+						  K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
+#endif
 		} break;
+		case RCV_LENGTH_HIGH: {
+			uint8_t high;
+			rc = ring_buf_get(&ingestion->rb, &high, sizeof(uint8_t));
+			__ASSERT_NO_MSG(rc == 1);
+			ingestion->expected_size = high << 8;
+			ingestion->state = RCV_LENGTH_LOW;
+			k_work_schedule_for_queue(ingestion->workq, &ingestion->timeout_work,
+						  K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
+		} break;
+		case RCV_LENGTH_LOW: {
+			uint8_t low;
+			rc = ring_buf_get(&ingestion->rb, &low, sizeof(uint8_t));
+			__ASSERT_NO_MSG(rc == 1);
+			ingestion->expected_size += low;
+			ingestion->frame_flags = ingestion->expected_size & ~INGESTION_FRAME_SIZE_MASK;
+			ingestion->expected_size &= INGESTION_FRAME_SIZE_MASK;
+			ingestion->state = RCV_DATA;
 		}
-	} while (ring_buf_size_get(&ingestion->rb) != 0);
+
+		break;
+		case RCV_DATA: {
+			bool streamed = false;
+
+#if defined(CONFIG_AMPOULE_INGESTION_STREAM)
+			/* Never complete in the ring, it is decoded as it arrives */
+			streamed = ingestion_streamed(ingestion);
+#endif
+
+			/* Frame is incomplete, ingestion_feed() resubmits us once it is */
+			if (!streamed &&
+			    ring_buf_size_get(&ingestion->rb) < ingestion->expected_size) {
+				ingestion_rx_resume(ingestion);
+				AMPOULE_TRACE_EXIT(process, ingestion, ingestion->state);
+				return;
+			}
+
+			k_work_cancel_delayable(&ingestion->timeout_work);
+
+#if defined(CONFIG_AMPOULE_INGESTION_BUS)
+			/* Response slots count from here */
+			ingestion->frame_ticks = k_uptime_ticks();
+
+			/* For other devices, or their response, dropped before being decoded */
+			if (ingestion->bus_enabled &&
+			    !ingestion_bus_accepts(&ingestion->bus, ingestion->frame_address)) {
+				ingestion_skip(ingestion);
+				break;
+			}
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+			/* Already answered ahead of its turn, only its bytes are left */
+			if (ingestion->overtaken & BIT64(0)) {
+				ingestion_skip(ingestion);
+				break;
+			}
+
+			/* Frames behind a streamed one aren't received yet */
+			if (!streamed) {
+				ingestion_overtake(ingestion);
+			}
+#endif
+
+			ingestion->state = PARSING;
+		} break;
+		case PARSING: {
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+			uint32_t start = k_cycle_get_32();
+#endif
+			rc = ingestion_parse(ingestion, ingestion->frame_flags,
+					     ingestion->expected_size);
+			if (rc < 0) {
+				LOG_WRN("Failed to parse frame (%d)", rc);
+			}
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+			ingestion_stats_frame(ingestion, rc, start);
+#endif
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+			ingestion_overtake_next(ingestion);
+#endif
+
+			ingestion->state = ingestion_first_state(ingestion);
+			ingestion_rx_resume(ingestion);
+		} break;
+		}
+	} while (ring_buf_size_get(&ingestion->rb) != 0 || ingestion->state >= RCV_DATA);
+
+	ingestion_rx_resume(ingestion);
+	AMPOULE_TRACE_EXIT(process, ingestion, ingestion->state);
 }
+
+#if defined(CONFIG_AMPOULE_INGESTION_WORKQ)
+static int ingestion_workq_init(void)
+{
+	const struct k_work_queue_config config = {
+		.name = "ampoule_ingestion",
+	};
+
+	k_work_queue_start(&ingestion_workq, ingestion_workq_stack,
+			   K_THREAD_STACK_SIZEOF(ingestion_workq_stack),
+			   CONFIG_AMPOULE_INGESTION_WORKQ_PRIORITY, &config);
+
+	return 0;
+}
+
+SYS_INIT(ingestion_workq_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+#endif
+
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+static int ingestion_pipeline_init(void)
+{
+	for (int i = 0; i < CONFIG_AMPOULE_INGESTION_PIPELINE_THREADS; i++) {
+		k_thread_create(&ingestion_pipeline_threads[i], ingestion_pipeline_stacks[i],
+				K_THREAD_STACK_SIZEOF(ingestion_pipeline_stacks[i]),
+				ingestion_pipeline_thread, NULL, NULL, NULL,
+				CONFIG_AMPOULE_INGESTION_PIPELINE_PRIORITY, 0, K_NO_WAIT);
+		k_thread_name_set(&ingestion_pipeline_threads[i], "ampoule_pipeline");
+	}
+
+	return 0;
+}
+
+SYS_INIT(ingestion_pipeline_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+#endif
@@ -0,0 +1,174 @@
+/**
+ * @file pixel
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-01-11 09:47:53
+ * @brief Post-processing of the pixels handed to the strip: gamma, brightness and color order
+ *
+ * Gamma and brightness treat every byte alike, so they run on whole words whatever the pixel
+ * layout, with led_rgb being 3 or 4 bytes. Brightness splits a word in two halves of 16 bit lanes
+ * which a single multiply scales at once, a channel times at most 256 never carrying into the
+ * next lane.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <errno.h>
+#include <string.h>
+
+#include "ampoule/pixel.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+/* Bytes 0 and 2 of a word, each in a 16 bit lane */
+#define PIXEL_LANES_MASK 0x00FF00FFU
+
+/* Each pixel becomes {first, second, third} of its own channels */
+#define PIXEL_PERMUTE(pixels, count, first, second, third)                                         \
+	for (size_t i = 0; i < (count); i++) {                                                     \
+		struct led_rgb pixel = (pixels)[i];                                                \
+                                                                                                   \
+		(pixels)[i].r = pixel.first;                                                       \
+		(pixels)[i].g = pixel.second;                                                      \
+		(pixels)[i].b = pixel.third;                                                       \
+	}
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static inline uint32_t pixel_scale_word(uint32_t word, uint32_t scale);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+const uint8_t pixel_gamma_lut[PIXEL_LUT_SIZE] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6,
+	6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10, 11, 11, 11, 12,
+	12, 13, 13, 13, 14, 14, 15, 15, 16, 16, 17, 17, 18, 18, 19, 19,
+	20, 20, 21, 22, 22, 23, 23, 24, 25, 25, 26, 26, 27, 28, 28, 29,
+	30, 30, 31, 32, 33, 33, 34, 35, 35, 36, 37, 38, 39, 39, 40, 41,
+	42, 43, 43, 44, 45, 46, 47, 48, 49, 49, 50, 51, 52, 53, 54, 55,
+	56, 57, 58, 59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71,
+	73, 74, 75, 76, 77, 78, 79, 81, 82, 83, 84, 85, 87, 88, 89, 90,
+	91, 93, 94, 95, 97, 98, 99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+	113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+	137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+	163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+	192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+	223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void pixel_gamma(uint8_t *data, size_t len, const uint8_t lut[PIXEL_LUT_SIZE])
+{
+	size_t i = 0;
+
+	/* Byte order doesn't matter, every byte goes through the same table */
+	for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+		uint32_t word;
+
+		memcpy(&word, &data[i], sizeof(word));
+		word = (uint32_t)lut[word & 0xFF] | (uint32_t)lut[(word >> 8) & 0xFF] << 8 |
+		       (uint32_t)lut[(word >> 16) & 0xFF] << 16 | (uint32_t)lut[word >> 24] << 24;
+		memcpy(&data[i], &word, sizeof(word));
+	}
+
+	for (; i < len; i++) {
+		data[i] = lut[data[i]];
+	}
+}
+
+void pixel_brightness(uint8_t *data, size_t len, uint8_t brightness)
+{
+	uint32_t scale = (uint32_t)brightness + 1;
+	size_t i = 0;
+
+	for (; i + sizeof(uint32_t) <= len; i += sizeof(uint32_t)) {
+		uint32_t word;
+
+		memcpy(&word, &data[i], sizeof(word));
+		word = pixel_scale_word(word, scale);
+		memcpy(&data[i], &word, sizeof(word));
+	}
+
+	for (; i < len; i++) {
+		data[i] = (data[i] * scale) >> 8;
+	}
+}
+
+void pixel_reorder(struct led_rgb *pixels, size_t count, enum pixel_order order)
+{
+	switch (order) {
+	case PIXEL_ORDER_RGB:
+		break;
+	case PIXEL_ORDER_RBG:
+		PIXEL_PERMUTE(pixels, count, r, b, g);
+		break;
+	case PIXEL_ORDER_GRB:
+		PIXEL_PERMUTE(pixels, count, g, r, b);
+		break;
+	case PIXEL_ORDER_GBR:
+		PIXEL_PERMUTE(pixels, count, g, b, r);
+		break;
+	case PIXEL_ORDER_BRG:
+		PIXEL_PERMUTE(pixels, count, b, r, g);
+		break;
+	case PIXEL_ORDER_BGR:
+		PIXEL_PERMUTE(pixels, count, b, g, r);
+		break;
+	default:
+		break;
+	}
+}
+
+int pixel_pipeline_init(struct pixel_pipeline *pipeline, const struct pixel_config *config)
+{
+	if (config->order >= PIXEL_ORDER_COUNT) {
+		return -EINVAL;
+	}
+
+	pipeline->config = *config;
+
+	/* Both are per byte, brightness then costs nothing more on top of the gamma lookup */
+	if (config->gamma) {
+		memcpy(pipeline->lut, pixel_gamma_lut, sizeof(pipeline->lut));
+		pixel_brightness(pipeline->lut, sizeof(pipeline->lut), config->brightness);
+	}
+
+	return 0;
+}
+
+void pixel_pipeline_run(const struct pixel_pipeline *pipeline, struct led_rgb *pixels,
+			size_t count)
+{
+	const struct pixel_config *config = &pipeline->config;
+	uint8_t *data = (uint8_t *)pixels;
+	size_t len = count * sizeof(struct led_rgb);
+
+	if (config->gamma) {
+		pixel_gamma(data, len, pipeline->lut);
+	} else if (config->brightness != PIXEL_BRIGHTNESS_MAX) {
+		pixel_brightness(data, len, config->brightness);
+	}
+
+	pixel_reorder(pixels, count, config->order);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Scales the 4 bytes of word by scale / 256, scale being at most 256. Two bytes per multiply,
+ * each in a 16 bit lane the product can't overflow.
+ */
+static inline uint32_t pixel_scale_word(uint32_t word, uint32_t scale)
+{
+	uint32_t even = (word & PIXEL_LANES_MASK) * scale;
+	uint32_t odd = ((word >> 8) & PIXEL_LANES_MASK) * scale;
+
+	return ((even >> 8) & PIXEL_LANES_MASK) | (odd & ~PIXEL_LANES_MASK);
+}
@@ -0,0 +1,370 @@
+/**
+ * @file schedule
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-12-21 09:11:58
+ * @brief Host clock sync and extension commands run at a host time
+ *
+ * The host clock is estimated from the last CONFIG_AMPOULE_SCHEDULE_SYNC_SAMPLES CLOCK_SYNC
+ * exchanges. Transport delays only ever make a sample late, so the estimate follows the lower
+ * envelope of the samples instead of their mean.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "ampoule/command.h"
+#include "ampoule/schedule.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+LOG_MODULE_REGISTER(schedule, CONFIG_AMPOULE_LOG_LEVEL);
+
+#define SCHEDULE_SAMPLES CONFIG_AMPOULE_SCHEDULE_SYNC_SAMPLES
+
+/* Crystals stay well within 100 ppm, anything past this is a bad estimate */
+#define SCHEDULE_DRIFT_MAX_PPB 1000000
+/* Samples closer in host time than this say more about jitter than about drift */
+#define SCHEDULE_DRIFT_SPAN_US (100 * USEC_PER_MSEC)
+/* A sample this far off the estimate means the host clock was set or restarted */
+#define SCHEDULE_RESYNC_US     USEC_PER_SEC
+/* Commands further than this from the latest sample are refused, it bounds the drift term */
+#define SCHEDULE_HORIZON_US    (24ULL * 3600 * USEC_PER_SEC)
+
+struct schedule_sample {
+	uint64_t host_us;
+	int64_t device_us;
+};
+
+/* Only what the schedulable operations need is kept, not a whole ampoule_ExtCommand */
+struct schedule_entry {
+	int64_t device_us;
+	ampoule_ExtOpcode opcode;
+	pb_size_t which_operation;
+	ampoule_Effect effect;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void schedule_thread(void *p1, void *p2, void *p3);
+static void schedule_estimate(void);
+static int schedule_convert(uint64_t host_us, int64_t *device_us);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+/* Samples in host time order, oldest first, guarded by schedule_lock like everything below */
+static struct schedule_sample samples[SCHEDULE_SAMPLES];
+static uint32_t samples_count;
+static struct schedule_clock host_clock;
+
+/* Waiting commands, sorted by device time, ties kept in arrival order */
+static struct schedule_entry queue[CONFIG_AMPOULE_SCHEDULE_SIZE];
+static uint32_t queued;
+
+static K_MUTEX_DEFINE(schedule_lock);
+/* Given when the head of the queue may have changed */
+static K_SEM_DEFINE(schedule_sem, 0, 1);
+
+K_THREAD_DEFINE(schedule_tid, CONFIG_AMPOULE_SCHEDULE_STACK_SIZE, schedule_thread, NULL, NULL,
+		NULL, CONFIG_AMPOULE_SCHEDULE_PRIORITY, 0, 0);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+int64_t schedule_now_us(void)
+{
+	/* In ticks, the unit deadlines are waited in */
+	return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+int schedule_sync(uint64_t host_us, int64_t device_us, struct schedule_clock *estimate)
+{
+	k_mutex_lock(&schedule_lock, K_FOREVER);
+
+	if (samples_count > 0) {
+		int64_t expected_us;
+		bool behind = host_us <= samples[samples_count - 1].host_us;
+
+		if (behind || schedule_convert(host_us, &expected_us) < 0 ||
+		    llabs(device_us - expected_us) > SCHEDULE_RESYNC_US) {
+			LOG_INF("Host clock jumped, resyncing");
+			samples_count = 0;
+		}
+	}
+
+	if (samples_count == ARRAY_SIZE(samples)) {
+		memmove(&samples[0], &samples[1], (ARRAY_SIZE(samples) - 1) * sizeof(samples[0]));
+		samples_count--;
+	}
+
+	samples[samples_count++] = (struct schedule_sample){
+		.host_us = host_us,
+		.device_us = device_us,
+	};
+
+	schedule_estimate();
+
+	if (estimate != NULL) {
+		*estimate = host_clock;
+	}
+
+	k_mutex_unlock(&schedule_lock);
+
+	return 0;
+}
+
+int schedule_to_device_us(uint64_t host_us, int64_t *device_us)
+{
+	k_mutex_lock(&schedule_lock, K_FOREVER);
+
+	int rc = schedule_convert(host_us, device_us);
+
+	k_mutex_unlock(&schedule_lock);
+
+	return rc;
+}
+
+int schedule_command(const ampoule_ExtCommand *command)
+{
+	int64_t device_us;
+	int rc;
+
+	/* Only commands whose effect is on the strip, the answer of any other would be lost. Pixels
+	 * are written when received, their STRIP_PRESENT is what gets scheduled.
+	 */
+	switch (command->opcode) {
+	case ampoule_ExtOpcode_STRIP_PRESENT:
+	case ampoule_ExtOpcode_EFFECT_START:
+	case ampoule_ExtOpcode_EFFECT_STOP:
+	case ampoule_ExtOpcode_EFFECT_TUNE:
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	if (command->which_operation != 0 &&
+	    command->which_operation != ampoule_ExtCommand_effect_tag) {
+		return -ENOTSUP;
+	}
+
+	k_mutex_lock(&schedule_lock, K_FOREVER);
+
+	rc = schedule_convert(command->at_us, &device_us);
+	if (rc == 0 && queued == ARRAY_SIZE(queue)) {
+		rc = -ENOMEM;
+	}
+
+	if (rc < 0) {
+		k_mutex_unlock(&schedule_lock);
+		return rc;
+	}
+
+	uint32_t i = queued++;
+
+	for (; i > 0 && queue[i - 1].device_us > device_us; i--) {
+		queue[i] = queue[i - 1];
+	}
+
+	queue[i] = (struct schedule_entry){
+		.device_us = device_us,
+		.opcode = command->opcode,
+		.which_operation = command->which_operation,
+	};
+
+	if (command->which_operation == ampoule_ExtCommand_effect_tag) {
+		queue[i].effect = command->operation.effect;
+	}
+
+	k_mutex_unlock(&schedule_lock);
+
+	/* The thread may be waiting for a later deadline */
+	k_sem_give(&schedule_sem);
+
+	return 0;
+}
+
+void schedule_reset(void)
+{
+	k_mutex_lock(&schedule_lock, K_FOREVER);
+
+	samples_count = 0;
+	queued = 0;
+	host_clock = (struct schedule_clock){0};
+
+	k_mutex_unlock(&schedule_lock);
+
+	k_sem_give(&schedule_sem);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int schedule_convert(uint64_t host_us, int64_t *device_us)
+{
+	if (host_clock.samples == 0) {
+		return -EAGAIN;
+	}
+
+	int64_t elapsed_us = (int64_t)(host_us - host_clock.host_ref_us);
+
+	if (elapsed_us > (int64_t)SCHEDULE_HORIZON_US ||
+	    elapsed_us < -(int64_t)SCHEDULE_HORIZON_US) {
+		return -ERANGE;
+	}
+
+	*device_us = (int64_t)host_us + host_clock.offset_us +
+		     elapsed_us * host_clock.drift_ppb / NSEC_PER_SEC;
+
+	return 0;
+}
+
+/* How much later than the estimate says the sample was received */
+static int64_t schedule_residual(const struct schedule_sample *sample, int32_t drift_ppb,
+				 uint64_t host_ref_us)
+{
+	int64_t elapsed_us = (int64_t)(sample->host_us - host_ref_us);
+
+	return sample->device_us - (int64_t)sample->host_us -
+	       elapsed_us * drift_ppb / NSEC_PER_SEC;
+}
+
+/* Least squares slope of the device - host difference, in ms so sums can't overflow */
+static int32_t schedule_fit_drift(uint64_t host_ref_us)
+{
+	int64_t mean_x = 0;
+	int64_t mean_y = 0;
+	int64_t num = 0;
+	int64_t den = 0;
+
+	for (uint32_t i = 0; i < samples_count; i++) {
+		mean_x += (int64_t)(samples[i].host_us - host_ref_us) / USEC_PER_MSEC;
+		mean_y += samples[i].device_us - (int64_t)samples[i].host_us;
+	}
+
+	mean_x /= samples_count;
+	mean_y /= samples_count;
+
+	for (uint32_t i = 0; i < samples_count; i++) {
+		int64_t x = (int64_t)(samples[i].host_us - host_ref_us) / USEC_PER_MSEC - mean_x;
+		int64_t y = samples[i].device_us - (int64_t)samples[i].host_us - mean_y;
+
+		num += x * y;
+		den += x * x;
+	}
+
+	/* us per ms to ppb, too short a span to tell */
+	if (den < USEC_PER_SEC) {
+		return 0;
+	}
+
+	return CLAMP(num / (den / USEC_PER_SEC), -SCHEDULE_DRIFT_MAX_PPB, SCHEDULE_DRIFT_MAX_PPB);
+}
+
+static uint32_t schedule_least_late(uint32_t from, uint32_t to, int32_t drift_ppb,
+				    uint64_t host_ref_us)
+{
+	uint32_t best = from;
+
+	for (uint32_t i = from + 1; i < to; i++) {
+		if (schedule_residual(&samples[i], drift_ppb, host_ref_us) <
+		    schedule_residual(&samples[best], drift_ppb, host_ref_us)) {
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/* The least squares fit is skewed by late samples, it only picks the least late sample of each
+ * half of the window, the drift is the slope between those two.
+ */
+static void schedule_estimate(void)
+{
+	uint64_t host_ref_us = samples[samples_count - 1].host_us;
+	int32_t drift_ppb = schedule_fit_drift(host_ref_us);
+
+	if (samples_count >= 2) {
+		uint32_t half = samples_count / 2;
+		uint32_t a = schedule_least_late(0, half, drift_ppb, host_ref_us);
+		uint32_t b = schedule_least_late(half, samples_count, drift_ppb, host_ref_us);
+		int64_t span_us = (int64_t)(samples[b].host_us - samples[a].host_us);
+
+		if (span_us >= SCHEDULE_DRIFT_SPAN_US) {
+			int64_t rise_us = (samples[b].device_us - (int64_t)samples[b].host_us) -
+					  (samples[a].device_us - (int64_t)samples[a].host_us);
+
+			drift_ppb = CLAMP(rise_us * NSEC_PER_SEC / span_us, -SCHEDULE_DRIFT_MAX_PPB,
+					  SCHEDULE_DRIFT_MAX_PPB);
+		}
+	}
+
+	uint32_t least_late = schedule_least_late(0, samples_count, drift_ppb, host_ref_us);
+
+	host_clock = (struct schedule_clock){
+		.offset_us = schedule_residual(&samples[least_late], drift_ppb, host_ref_us),
+		.drift_ppb = drift_ppb,
+		.host_ref_us = host_ref_us,
+		.samples = samples_count,
+	};
+}
+
+static void schedule_run(const struct schedule_entry *entry)
+{
+	/* Too large for the stack, only this thread uses them */
+	static ampoule_ExtCommand command;
+	static ampoule_ExtResponse response;
+
+	command = (ampoule_ExtCommand){
+		.opcode = entry->opcode,
+		.which_operation = entry->which_operation,
+	};
+
+	if (entry->which_operation == ampoule_ExtCommand_effect_tag) {
+		command.operation.effect = entry->effect;
+	}
+
+	response = (ampoule_ExtResponse){0};
+
+	/* at_us is 0, the command runs instead of being queued again */
+	int rc = command_ext_process(&command, &response);
+	if (rc < 0) {
+		LOG_WRN("Scheduled extension opcode %d failed (%d)", entry->opcode, rc);
+	}
+}
+
+static void schedule_thread(void *p1, void *p2, void *p3)
+{
+	struct schedule_entry entry;
+
+	while (true) {
+		k_timeout_t timeout = K_FOREVER;
+		bool due = false;
+
+		k_mutex_lock(&schedule_lock, K_FOREVER);
+
+		if (queued > 0 && queue[0].device_us <= schedule_now_us()) {
+			entry = queue[0];
+			queued--;
+			memmove(&queue[0], &queue[1], queued * sizeof(queue[0]));
+			due = true;
+		} else if (queued > 0) {
+			/* First tick at or after the deadline, a command never runs early */
+			timeout = K_TIMEOUT_ABS_TICKS(k_us_to_ticks_ceil64(queue[0].device_us));
+		}
+
+		k_mutex_unlock(&schedule_lock);
+
+		if (due) {
+			schedule_run(&entry);
+		} else {
+			k_sem_take(&schedule_sem, timeout);
+		}
+	}
+}
@@ -0,0 +1,214 @@
+/**
+ * @file strip
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-09 15:20:41
+ * @brief Double buffered framebuffer of the ampoule LED strip
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/drivers/led_strip.h>
+
+#include "ampoule/pixel.h"
+#include "ampoule/strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+LOG_MODULE_REGISTER(strip, CONFIG_AMPOULE_LOG_LEVEL);
+
+#define STRIP_NODE   DT_CHOSEN(ampoule_led_strip)
+#define STRIP_LENGTH DT_PROP(STRIP_NODE, chain_length)
+
+/* How pixels handed to strip_update() are applied to the back buffer */
+enum strip_op {
+	STRIP_OP_WRITE,
+	STRIP_OP_FILL,
+	STRIP_OP_XOR,
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int strip_update(uint16_t offset, const uint8_t *rgb, uint16_t count, enum strip_op op);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static const struct device *strip_dev = DEVICE_DT_GET(STRIP_NODE);
+
+/* Commands write the back buffer, the front one is handed to the driver which may
+ * convert it in place.
+ */
+static struct led_rgb back[STRIP_LENGTH];
+static struct led_rgb front[STRIP_LENGTH];
+
+/* Pixels written since the last present are all below dirty_end */
+static uint16_t dirty_end;
+
+#if defined(CONFIG_AMPOULE_PIXEL)
+/* Run over front on every present */
+static struct pixel_pipeline pipeline;
+#endif
+
+static K_MUTEX_DEFINE(strip_lock);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+uint16_t strip_length(void)
+{
+	return STRIP_LENGTH;
+}
+
+int strip_write(uint16_t offset, const uint8_t *rgb, uint16_t count)
+{
+	return strip_update(offset, rgb, count, STRIP_OP_WRITE);
+}
+
+int strip_fill(uint16_t offset, const uint8_t *rgb, uint16_t count)
+{
+	return strip_update(offset, rgb, count, STRIP_OP_FILL);
+}
+
+int strip_xor(uint16_t offset, const uint8_t *rgb, uint16_t count)
+{
+	return strip_update(offset, rgb, count, STRIP_OP_XOR);
+}
+
+int strip_present(void)
+{
+	int rc = 0;
+
+	k_mutex_lock(&strip_lock, K_FOREVER);
+
+	if (dirty_end == 0) {
+		goto out;
+	}
+
+	/* Strips are clocked from their first pixel, the update stops after the last dirty one
+	 * and leaves the following pixels latched. The driver may have mangled front, so it is
+	 * refreshed up to there too.
+	 */
+	memcpy(front, back, dirty_end * sizeof(struct led_rgb));
+
+#if defined(CONFIG_AMPOULE_PIXEL)
+	pixel_pipeline_run(&pipeline, front, dirty_end);
+#endif
+
+	rc = led_strip_update_rgb(strip_dev, front, dirty_end);
+	if (rc < 0) {
+		LOG_ERR("Failed to update strip (%d)", rc);
+		goto out;
+	}
+
+	dirty_end = 0;
+
+out:
+	k_mutex_unlock(&strip_lock);
+
+	return rc;
+}
+
+#if defined(CONFIG_AMPOULE_PIXEL)
+int strip_configure(const struct pixel_config *config)
+{
+	int rc;
+
+	k_mutex_lock(&strip_lock, K_FOREVER);
+
+	rc = pixel_pipeline_init(&pipeline, config);
+
+	/* Pixels already on the strip went through the previous config */
+	if (rc == 0) {
+		dirty_end = STRIP_LENGTH;
+	}
+
+	k_mutex_unlock(&strip_lock);
+
+	return rc;
+}
+
+void strip_config_get(struct pixel_config *config)
+{
+	k_mutex_lock(&strip_lock, K_FOREVER);
+	*config = pipeline.config;
+	k_mutex_unlock(&strip_lock);
+}
+#endif
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int strip_update(uint16_t offset, const uint8_t *rgb, uint16_t count, enum strip_op op)
+{
+	struct led_rgb *pixel;
+
+	if (offset + count > STRIP_LENGTH) {
+		return -EINVAL;
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+	pixel = &back[offset];
+
+	k_mutex_lock(&strip_lock, K_FOREVER);
+
+	switch (op) {
+	case STRIP_OP_WRITE:
+		for (uint16_t i = 0; i < count; i++, rgb += STRIP_PIXEL_SIZE) {
+			pixel[i].r = rgb[0];
+			pixel[i].g = rgb[1];
+			pixel[i].b = rgb[2];
+		}
+		break;
+	case STRIP_OP_FILL:
+		for (uint16_t i = 0; i < count; i++) {
+			pixel[i].r = rgb[0];
+			pixel[i].g = rgb[1];
+			pixel[i].b = rgb[2];
+		}
+		break;
+	case STRIP_OP_XOR:
+		for (uint16_t i = 0; i < count; i++, rgb += STRIP_PIXEL_SIZE) {
+			pixel[i].r ^= rgb[0];
+			pixel[i].g ^= rgb[1];
+			pixel[i].b ^= rgb[2];
+		}
+		break;
+	}
+
+	dirty_end = MAX(dirty_end, offset + count);
+
+	k_mutex_unlock(&strip_lock);
+
+	return 0;
+}
+
+static int strip_init(void)
+{
+#if defined(CONFIG_AMPOULE_PIXEL)
+	struct pixel_config config = {
+		.brightness = CONFIG_AMPOULE_PIXEL_BRIGHTNESS,
+		.gamma = IS_ENABLED(CONFIG_AMPOULE_PIXEL_GAMMA),
+		.order = PIXEL_ORDER_RGB,
+	};
+
+	(void)pixel_pipeline_init(&pipeline, &config);
+#endif
+
+	if (!device_is_ready(strip_dev)) {
+		LOG_ERR("Strip device not ready");
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+SYS_INIT(strip_init, APPLICATION, 0);
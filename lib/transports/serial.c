@@ -2,7 +2,7 @@
  * @file serial
  * @author Lucas Denefle - ldenefle@gmail.com
  * @date 2023-12-16 12:57:17
- * @brief Implement the serial transport for ampoule library
+ * @brief Implement the serial transport for ampoule library on the interrupt driven UART API
  *
  */
 
@@ -12,23 +12,19 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/uart.h>
 #include "zephyr/sys/ring_buffer.h"
-#include "pb_decode.h"
-#include "pb_encode.h"
 
-#include "ampoule/command.h"
 #include "ampoule/ingestion.h"
+#include "ampoule/trace.h"
+#include "serial_common.h"
 
 /******************************************************************************/
 /* Local Constant, Macro and Type Definitions                                 */
 /******************************************************************************/
-#define SERIAL_DEVICE DT_CHOSEN(ampoule_transport_serial)
-
-static const struct device *uart_dev = DEVICE_DT_GET(SERIAL_DEVICE);
 
 /******************************************************************************/
 /* Local Function Prototypes                                                  */
 /******************************************************************************/
-int send_tx(void *context, uint8_t *data, uint16_t len);
+static void serial_cb(const struct device *dev, void *user_data);
 
 /******************************************************************************/
 /* Local Variable Definitions                                                 */
@@ -37,82 +33,80 @@ int send_tx(void *context, uint8_t *data, uint16_t len);
 /******************************************************************************/
 /* Global Function Definitions                                                */
 /******************************************************************************/
-RING_BUF_DECLARE(tx_ring, 1024);
-
-static struct ingestion ingestion;
-static struct ingestion_transport transport = {
-	.write = send_tx,
-};
-
-static struct ingestion_rpc rpc = {
-	.on_command = command_process,
-};
-
-/******************************************************************************/
-/* Local Function Definitions                                                 */
-/******************************************************************************/
-int send_tx(void *context, uint8_t *data, uint16_t len)
+void serial_backend_tx_start(struct serial_transport *serial)
 {
-	uint8_t *output;
-	uint16_t bytes_written;
-
-	bytes_written = ring_buf_put_claim(&tx_ring, &output, len);
-	if (bytes_written < 0) {
-		return -ENOMEM;
-	}
+	uart_irq_tx_enable(serial->uart_dev);
+}
 
-	memcpy(output, data, bytes_written);
+void serial_backend_rx_resume(struct serial_transport *serial)
+{
+	uart_irq_rx_enable(serial->uart_dev);
+}
 
-	int rc = ring_buf_put_finish(&tx_ring, bytes_written);
+int serial_backend_start(struct serial_transport *serial)
+{
+	int rc = uart_irq_callback_user_data_set(serial->uart_dev, serial_cb, serial);
 	if (rc < 0) {
 		return rc;
 	}
 
-	uart_irq_tx_enable(uart_dev);
+	uart_irq_rx_enable(serial->uart_dev);
 
-	return bytes_written;
+	return 0;
 }
 
-void serial_cb(const struct device *dev, void *user_data)
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void serial_cb(const struct device *dev, void *user_data)
 {
+	struct serial_transport *serial = user_data;
 	uint8_t buffer[64];
-	ARG_UNUSED(user_data);
 
 	while (uart_irq_update(dev) && uart_irq_is_pending(dev)) {
 		if (uart_irq_rx_ready(dev)) {
-			int recv_len = uart_fifo_read(dev, buffer, sizeof(buffer));
+			uint32_t space = ingestion_rx_space(&serial->ingestion);
+
+			/* Leave bytes in the FIFO rather than dropping them, the ingestion queue
+			 * resumes reading as soon as it consumed anything, so a frame filling the
+			 * whole ring still completes.
+			 */
+			if (space == 0) {
+				uart_irq_rx_disable(dev);
+				if (!ingestion_rx_pause(&serial->ingestion, 1)) {
+					uart_irq_rx_enable(dev);
+				}
+				continue;
+			}
+
+			int recv_len = uart_fifo_read(dev, buffer, MIN(sizeof(buffer), space));
 			if (recv_len < 0) {
 				recv_len = 0;
 			};
 
-			ingestion_feed(&ingestion, buffer, recv_len);
+			ingestion_feed(&serial->ingestion, buffer, recv_len);
 		}
 
 		if (uart_irq_tx_ready(dev)) {
+			uint8_t *data;
 			int rb_len;
-			rb_len = ring_buf_get(&tx_ring, buffer, sizeof(buffer));
+
+			/* Fill the FIFO in place from the ring, only what it took is released */
+			rb_len = ring_buf_get_claim(&serial->tx_ring, &data,
+						    ring_buf_capacity_get(&serial->tx_ring));
 			if (!rb_len) {
 				uart_irq_tx_disable(dev);
 				continue;
-			} else {
-				uart_fifo_fill(dev, buffer, rb_len);
 			}
-		}
-	}
-}
 
-int ampoule_serial_init(void)
-{
-	if (!device_is_ready(uart_dev)) {
-		printk("Serial device not ready!");
-		return -ENODEV;
-	}
+			AMPOULE_TRACE_ENTER(tx_drain, &serial->ingestion, rb_len);
+			int filled = uart_fifo_fill(dev, data, rb_len);
+			ring_buf_get_finish(&serial->tx_ring, MAX(filled, 0));
+			AMPOULE_TRACE_EXIT(tx_drain, &serial->ingestion, filled);
 
-	ingestion_init(&ingestion, &transport, &rpc, NULL);
-
-	uart_irq_callback_user_data_set(uart_dev, serial_cb, NULL);
-	uart_irq_rx_enable(uart_dev);
-	return 0;
+			if (filled > 0) {
+				k_sem_give(&serial->tx_space);
+			}
+		}
+	}
 }
-
-SYS_INIT(ampoule_serial_init, APPLICATION, 0);
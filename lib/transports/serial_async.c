@@ -0,0 +1,186 @@
+/**
+ * @file serial_async
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-02 10:12:41
+ * @brief Implement the serial transport for ampoule library on the UART async API
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/device.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/logging/log.h>
+#include "zephyr/sys/ring_buffer.h"
+
+#include "ampoule/ingestion.h"
+#include "serial_common.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+LOG_MODULE_DECLARE(serial, CONFIG_AMPOULE_LOG_LEVEL);
+
+#define RX_BUF_SIZE   CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC_RX_BUF_SIZE
+#define RX_TIMEOUT_US CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC_RX_TIMEOUT_US
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static void serial_tx_start(struct serial_transport *serial);
+static void serial_rx_start(struct serial_transport *serial);
+static void serial_async_cb(const struct device *dev, struct uart_event *evt, void *user_data);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void serial_backend_tx_start(struct serial_transport *serial)
+{
+	serial_tx_start(serial);
+}
+
+void serial_backend_rx_resume(struct serial_transport *serial)
+{
+	serial_rx_start(serial);
+}
+
+int serial_backend_start(struct serial_transport *serial)
+{
+	int rc = uart_callback_set(serial->uart_dev, serial_async_cb, serial);
+	if (rc < 0) {
+		return rc;
+	}
+
+	serial->rx_next = 1;
+	serial->rx_pending = RX_BUF_SIZE;
+	return uart_rx_enable(serial->uart_dev, serial->rx_buffers[0], RX_BUF_SIZE, RX_TIMEOUT_US);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static void serial_tx_done(struct serial_transport *serial)
+{
+	k_spinlock_key_t key = k_spin_lock(&serial->tx_lock);
+
+	serial->tx_busy = false;
+	k_spin_unlock(&serial->tx_lock, key);
+}
+
+static void serial_tx_start(struct serial_transport *serial)
+{
+	uint8_t *data;
+	uint32_t len;
+	k_spinlock_key_t key = k_spin_lock(&serial->tx_lock);
+
+	if (serial->tx_busy) {
+		k_spin_unlock(&serial->tx_lock, key);
+		return;
+	}
+
+	/* Transmit in place from the ring, a wrapped ring is drained by the next TX_DONE */
+	len = ring_buf_get_claim(&serial->tx_ring, &data, ring_buf_capacity_get(&serial->tx_ring));
+	if (len == 0) {
+		k_spin_unlock(&serial->tx_lock, key);
+		return;
+	}
+
+	serial->tx_busy = true;
+	k_spin_unlock(&serial->tx_lock, key);
+
+	int rc = uart_tx(serial->uart_dev, data, len, SYS_FOREVER_US);
+	if (rc < 0) {
+		LOG_ERR("Failed to start transmission (%d)", rc);
+		ring_buf_get_finish(&serial->tx_ring, 0);
+		serial_tx_done(serial);
+	}
+}
+
+/* Size of the next RX buffer, what the ingestion ring takes once the pending bytes are fed */
+static uint32_t serial_rx_buf_len(struct serial_transport *serial)
+{
+	uint32_t space = ingestion_rx_space(&serial->ingestion);
+
+	if (space <= serial->rx_pending) {
+		return 0;
+	}
+
+	return MIN(space - serial->rx_pending, RX_BUF_SIZE);
+}
+
+/* Hands out no more than what the ring takes on top of the current buffer, smaller buffers as it
+ * fills up. Without room, reception stops with the current one, which keeps RTS deasserted, and
+ * UART_RX_DISABLED waits for the ring to drain.
+ */
+static void serial_rx_buf_provide(struct serial_transport *serial)
+{
+	uint32_t len = serial_rx_buf_len(serial);
+
+	if (len == 0) {
+		return;
+	}
+
+	serial->rx_pending += len;
+	uart_rx_buf_rsp(serial->uart_dev, serial->rx_buffers[serial->rx_next], len);
+	serial->rx_next ^= 1;
+}
+
+static void serial_rx_start(struct serial_transport *serial)
+{
+	uint32_t len = serial_rx_buf_len(serial);
+
+	/* The ring is full, the ingestion queue resumes reception as soon as it consumed anything,
+	 * so a frame filling the whole ring still completes
+	 */
+	if (len == 0) {
+		if (ingestion_rx_pause(&serial->ingestion, 1)) {
+			return;
+		}
+
+		len = serial_rx_buf_len(serial);
+	}
+
+	serial->rx_next = 1;
+	serial->rx_pending = len;
+
+	int rc = uart_rx_enable(serial->uart_dev, serial->rx_buffers[0], len, RX_TIMEOUT_US);
+	if (rc < 0) {
+		serial->rx_pending = 0;
+		LOG_ERR("Failed to start reception (%d)", rc);
+	}
+}
+
+static void serial_async_cb(const struct device *dev, struct uart_event *evt, void *user_data)
+{
+	struct serial_transport *serial = user_data;
+
+	switch (evt->type) {
+	case UART_RX_RDY:
+		ingestion_feed(&serial->ingestion, &evt->data.rx.buf[evt->data.rx.offset],
+			       evt->data.rx.len);
+		serial->rx_pending -= MIN(evt->data.rx.len, serial->rx_pending);
+		break;
+	case UART_RX_BUF_REQUEST:
+		serial_rx_buf_provide(serial);
+		break;
+	case UART_RX_DISABLED:
+		/* Reception stops on errors or when running out of buffers, start over */
+		serial->rx_pending = 0;
+		serial_rx_start(serial);
+		break;
+	case UART_TX_DONE:
+	case UART_TX_ABORTED:
+		ring_buf_get_finish(&serial->tx_ring, evt->data.tx.len);
+		serial_tx_done(serial);
+		k_sem_give(&serial->tx_space);
+		serial_tx_start(serial);
+		break;
+	default:
+		break;
+	}
+}
@@ -0,0 +1,238 @@
+/**
+ * @file serial_common
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-02-01 09:41:17
+ * @brief Bring up the serial transport instances and buffer their responses
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/device.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/logging/log.h>
+#include "zephyr/sys/ring_buffer.h"
+
+#include "ampoule/command.h"
+#include "ampoule/ingestion.h"
+#include "serial_common.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+LOG_MODULE_REGISTER(serial, CONFIG_AMPOULE_LOG_LEVEL);
+
+#define DT_DRV_COMPAT ampoule_transport_serial
+
+#define SERIAL_CHOSEN DT_CHOSEN(ampoule_transport_serial)
+
+/* Framing enum of the binding follows enum ingestion_framing */
+#define SERIAL_TRANSPORT_DEFINE(inst)                                                              \
+	{                                                                                          \
+		.uart_dev = DEVICE_DT_GET(DT_INST_PHANDLE(inst, uart)),                            \
+		.framing = DT_INST_ENUM_IDX(inst, framing),                                        \
+		.on_bus = DT_INST_NODE_HAS_PROP(inst, bus_address),                                \
+		.bus =                                                                             \
+			{                                                                          \
+				.address = DT_INST_PROP_OR(inst, bus_address, 0),                  \
+				.groups = DT_INST_PROP(inst, bus_groups),                          \
+				.slot_us = DT_INST_PROP(inst, bus_slot_us),                        \
+			},                                                                         \
+	},
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int serial_transport_init(struct serial_transport *serial);
+static int send_tx(void *context, uint8_t *data, uint16_t len);
+static int claim_tx(void *context, uint8_t **data, uint16_t len);
+static int commit_tx(void *context, uint16_t len);
+static void resume_rx(void *context);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static struct serial_transport serial_transports[] = {
+#if DT_HAS_CHOSEN(ampoule_transport_serial)
+	{.uart_dev = DEVICE_DT_GET(SERIAL_CHOSEN)},
+#endif
+	DT_INST_FOREACH_STATUS_OKAY(SERIAL_TRANSPORT_DEFINE)};
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static struct ingestion_transport transport = {
+	.write = send_tx,
+	.claim = claim_tx,
+	.commit = commit_tx,
+	.resume = resume_rx,
+};
+
+static struct ingestion_rpc rpc = {
+	.on_command = command_process,
+	.on_ext_command = command_ext_process,
+	.is_urgent = command_is_urgent,
+};
+
+int ampoule_serial_init(void)
+{
+	int rc = 0;
+
+	/* Bring up every instance, one missing UART doesn't take the others down */
+	for (size_t i = 0; i < ARRAY_SIZE(serial_transports); i++) {
+		int ret = serial_transport_init(&serial_transports[i]);
+		if (ret < 0) {
+			rc = ret;
+		}
+	}
+
+	return rc;
+}
+
+SYS_INIT(ampoule_serial_init, APPLICATION, 0);
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Waits for the UART to drain tx_ring, responses are produced faster than the link sends them */
+static int serial_tx_wait(struct serial_transport *serial)
+{
+	if (k_sem_take(&serial->tx_space,
+		       K_MSEC(CONFIG_AMPOULE_TRANSPORT_SERIAL_TX_TIMEOUT_MS)) < 0) {
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+static int send_tx(void *context, uint8_t *data, uint16_t len)
+{
+	struct serial_transport *serial = context;
+	uint32_t bytes_written;
+	int rc;
+
+	while ((bytes_written = ring_buf_put(&serial->tx_ring, data, len)) == 0) {
+		rc = serial_tx_wait(serial);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	serial_backend_tx_start(serial);
+
+	return bytes_written;
+}
+
+static int claim_tx(void *context, uint8_t **data, uint16_t len)
+{
+	struct serial_transport *serial = context;
+	uint32_t claimed;
+	int rc;
+
+	while ((claimed = ring_buf_put_claim(&serial->tx_ring, data, len)) == 0) {
+		rc = serial_tx_wait(serial);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return claimed;
+}
+
+static int commit_tx(void *context, uint16_t len)
+{
+	struct serial_transport *serial = context;
+
+	int rc = ring_buf_put_finish(&serial->tx_ring, len);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (len > 0) {
+		serial_backend_tx_start(serial);
+	}
+
+	return 0;
+}
+
+static void resume_rx(void *context)
+{
+	serial_backend_rx_resume(context);
+}
+
+#if defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_FLOW_CONTROL)
+static int serial_flow_control_enable(const struct device *dev)
+{
+	struct uart_config config;
+
+	int rc = uart_config_get(dev, &config);
+	if (rc < 0) {
+		return rc;
+	}
+
+	config.flow_ctrl = UART_CFG_FLOW_CTRL_RTS_CTS;
+
+	return uart_configure(dev, &config);
+}
+#endif
+
+static int serial_transport_init(struct serial_transport *serial)
+{
+	int rc;
+
+	if (!device_is_ready(serial->uart_dev)) {
+		LOG_ERR("Serial device %s not ready", serial->uart_dev->name);
+		return -ENODEV;
+	}
+
+	ring_buf_init(&serial->tx_ring, sizeof(serial->tx_buffer), serial->tx_buffer);
+	k_sem_init(&serial->tx_space, 0, 1);
+
+#if defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_FLOW_CONTROL)
+	rc = serial_flow_control_enable(serial->uart_dev);
+	if (rc < 0) {
+		LOG_ERR("Serial device %s has no RTS/CTS (%d)", serial->uart_dev->name, rc);
+		return rc;
+	}
+#endif
+
+	ingestion_init(&serial->ingestion, &transport, &rpc, serial);
+
+	rc = ingestion_set_framing(&serial->ingestion, serial->framing);
+	if (rc < 0) {
+		LOG_ERR("Serial device %s framing unsupported (%d)", serial->uart_dev->name, rc);
+		return rc;
+	}
+
+	if (serial->on_bus) {
+		rc = ingestion_set_bus(&serial->ingestion, &serial->bus);
+		if (rc < 0) {
+			LOG_ERR("Serial device %s bus unsupported (%d)", serial->uart_dev->name,
+				rc);
+			return rc;
+		}
+	}
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	ingestion_stats_register(&serial->ingestion, serial->uart_dev->name);
+#endif
+
+#if defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_WORKQ_PER_INSTANCE)
+	const struct k_work_queue_config config = {
+		.name = serial->uart_dev->name,
+	};
+
+	k_work_queue_start(&serial->workq, serial->workq_stack,
+			   K_KERNEL_STACK_SIZEOF(serial->workq_stack),
+			   CONFIG_AMPOULE_TRANSPORT_SERIAL_WORKQ_PRIORITY, &config);
+	ingestion_set_workq(&serial->ingestion, &serial->workq);
+#endif
+
+	rc = serial_backend_start(serial);
+	if (rc < 0) {
+		LOG_ERR("Serial device %s failed to start (%d)", serial->uart_dev->name, rc);
+		return rc;
+	}
+
+	return 0;
+}
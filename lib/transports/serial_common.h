@@ -0,0 +1,93 @@
+/**
+ * @file serial_common
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-02-01 09:41:17
+ * @brief Serial transport instances shared by the interrupt driven and async UART backends
+ *
+ * serial_common.c brings up every instance and buffers responses in its TX ring, the backend
+ * compiled with it moves bytes through the UART.
+ */
+
+#ifndef SERIAL_COMMON_H_
+#define SERIAL_COMMON_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include "zephyr/sys/ring_buffer.h"
+
+#include "ampoule/ingestion.h"
+
+/******************************************************************************/
+/* Global Definitions/Macros                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* External Typedefs                                                          */
+/******************************************************************************/
+struct serial_transport {
+	const struct device *uart_dev;
+	enum ingestion_framing framing;
+	/* Set by a bus-address property, the UART is then shared with other devices */
+	bool on_bus;
+	struct ingestion_bus bus;
+
+	struct ingestion ingestion;
+
+#if defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC)
+	uint8_t rx_buffers[2][CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC_RX_BUF_SIZE];
+	uint8_t rx_next;
+	/* Bytes of the buffers handed to the UART that weren't fed yet */
+	uint32_t rx_pending;
+
+	/* Protects tx_busy, a transfer is started from the workqueue or from TX_DONE */
+	struct k_spinlock tx_lock;
+	bool tx_busy;
+#endif
+
+	struct ring_buf tx_ring;
+	uint8_t tx_buffer[CONFIG_AMPOULE_TRANSPORT_SERIAL_TX_BUF_SIZE];
+	/* Given by the backend each time the UART drains tx_ring */
+	struct k_sem tx_space;
+
+#if defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_WORKQ_PER_INSTANCE)
+	struct k_work_q workq;
+	K_KERNEL_STACK_MEMBER(workq_stack, CONFIG_AMPOULE_TRANSPORT_SERIAL_WORKQ_STACK_SIZE);
+#endif
+};
+
+/******************************************************************************/
+/* External Variables                                                         */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Implemented by the backend, starts sending what was committed to tx_ring
+ */
+void serial_backend_tx_start(struct serial_transport *serial);
+
+/**
+ * @brief Implemented by the backend, resumes reception paused while the RX ring was full
+ */
+void serial_backend_rx_resume(struct serial_transport *serial);
+
+/**
+ * @brief Implemented by the backend, registers its UART callback and starts reception once the
+ *        instance is initialized
+ * @return 0 on success, a negative UART API error otherwise
+ */
+int serial_backend_start(struct serial_transport *serial);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERIAL_COMMON */
@@ -0,0 +1,295 @@
+/**
+ * @file tcp
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-12-14 10:21:08
+ * @brief Implement the TCP socket transport for ampoule library
+ *
+ * A listener accepts up to CONFIG_AMPOULE_TRANSPORT_TCP_MAX_CONNECTIONS hosts. Each connection
+ * reads on its own thread into its own ingestion instance, which handles frames and sends
+ * responses on its own workqueue, so a host that stops reading only blocks itself. On native_sim
+ * with offloaded sockets, the port is opened on the host.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdio.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+
+#include "ampoule/command.h"
+#include "ampoule/ingestion.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define TCP_CONNECTIONS CONFIG_AMPOULE_TRANSPORT_TCP_MAX_CONNECTIONS
+/* Bytes read from the socket at once */
+#define TCP_RX_CHUNK    256
+
+struct tcp_connection {
+	/* -1 while the slot waits for a host */
+	int sock;
+
+	struct ingestion ingestion;
+
+	/* Given by the listener when it hands a socket over */
+	struct k_sem connected;
+	/* Given by the ingestion queue once RX space is free again */
+	struct k_sem rx_space;
+
+	struct k_thread thread;
+	/* Responses block while the host window is full, only this connection waits for them */
+	struct k_work_q workq;
+	char name[sizeof("tcp") + 3];
+	uint8_t rx_buffer[TCP_RX_CHUNK];
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int send_tx(void *context, uint8_t *data, uint16_t len);
+static void resume_rx(void *context);
+static void tcp_listener(void *p1, void *p2, void *p3);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static struct tcp_connection tcp_connections[TCP_CONNECTIONS];
+
+/* Connections free to take a host, the listener only accepts while one is */
+static K_SEM_DEFINE(tcp_free, TCP_CONNECTIONS, TCP_CONNECTIONS);
+
+K_THREAD_STACK_ARRAY_DEFINE(tcp_stacks, TCP_CONNECTIONS, CONFIG_AMPOULE_TRANSPORT_TCP_STACK_SIZE);
+K_THREAD_STACK_ARRAY_DEFINE(tcp_workq_stacks, TCP_CONNECTIONS,
+			    CONFIG_AMPOULE_TRANSPORT_TCP_WORKQ_STACK_SIZE);
+
+K_THREAD_DEFINE(tcp_listener_thread, CONFIG_AMPOULE_TRANSPORT_TCP_STACK_SIZE, tcp_listener, NULL,
+		NULL, NULL, CONFIG_AMPOULE_TRANSPORT_TCP_PRIORITY, 0, 0);
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static struct ingestion_transport transport = {
+	.write = send_tx,
+	.resume = resume_rx,
+};
+
+static struct ingestion_rpc rpc = {
+	.on_command = command_process,
+	.on_ext_command = command_ext_process,
+	.is_urgent = command_is_urgent,
+};
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+/* Blocks while the host window is full, up to the socket send timeout */
+static int send_tx(void *context, uint8_t *data, uint16_t len)
+{
+	struct tcp_connection *connection = context;
+
+	/* Requests of a host that left are still handled, their responses go nowhere */
+	if (connection->sock < 0) {
+		return -ENOTCONN;
+	}
+
+	ssize_t sent = zsock_send(connection->sock, data, len, 0);
+	if (sent < 0) {
+		return -errno;
+	}
+
+	return sent;
+}
+
+static void resume_rx(void *context)
+{
+	struct tcp_connection *connection = context;
+
+	k_sem_give(&connection->rx_space);
+}
+
+static void tcp_configure(int sock)
+{
+	const uint32_t timeout_ms = CONFIG_AMPOULE_TRANSPORT_TCP_TX_TIMEOUT_MS;
+	struct zsock_timeval timeout = {
+		.tv_sec = timeout_ms / MSEC_PER_SEC,
+		.tv_usec = (timeout_ms % MSEC_PER_SEC) * USEC_PER_MSEC,
+	};
+	int nodelay = 1;
+
+	/* Responses are small and each one is awaited, don't hold them back for coalescing */
+	if (zsock_setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) < 0) {
+		printk("TCP_NODELAY unsupported (%d)\n", errno);
+	}
+
+	/* Like the serial TX timeout, a host that stopped reading can't hold the queue forever */
+	if (zsock_setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+		printk("SO_SNDTIMEO unsupported (%d)\n", errno);
+	}
+}
+
+/* Feeds the ingestion until the host closes, reading only what its RX ring takes */
+static void tcp_serve(struct tcp_connection *connection)
+{
+	struct ingestion *ingestion = &connection->ingestion;
+
+	while (true) {
+		uint32_t space = ingestion_rx_space(ingestion);
+
+		/* Bytes stay in the socket, the TCP window holds the host off */
+		if (space == 0) {
+			if (ingestion_rx_pause(ingestion, 1) &&
+			    k_sem_take(&connection->rx_space,
+				       K_MSEC(CONFIG_AMPOULE_TRANSPORT_TCP_RX_TIMEOUT_MS)) < 0) {
+				printk("%s RX buffer stuck full, dropping the host\n",
+				       connection->name);
+				return;
+			}
+			continue;
+		}
+
+		ssize_t len = zsock_recv(connection->sock, connection->rx_buffer,
+					 MIN(sizeof(connection->rx_buffer), space), 0);
+		if (len <= 0) {
+			return;
+		}
+
+		ingestion_feed(ingestion, connection->rx_buffer, len);
+	}
+}
+
+static void tcp_connection_thread(void *p1, void *p2, void *p3)
+{
+	struct tcp_connection *connection = p1;
+
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	while (true) {
+		k_sem_take(&connection->connected, K_FOREVER);
+
+		tcp_serve(connection);
+
+		/* A host half closing its side still gets the responses to what it sent */
+		ingestion_reset(&connection->ingestion);
+
+		zsock_close(connection->sock);
+		connection->sock = -1;
+		k_sem_reset(&connection->rx_space);
+
+		k_sem_give(&tcp_free);
+	}
+}
+
+static int tcp_connection_init(struct tcp_connection *connection, size_t index)
+{
+	int rc;
+
+	connection->sock = -1;
+	k_sem_init(&connection->connected, 0, 1);
+	k_sem_init(&connection->rx_space, 0, 1);
+	snprintf(connection->name, sizeof(connection->name), "tcp%u", (unsigned int)index);
+
+	ingestion_init(&connection->ingestion, &transport, &rpc, connection);
+
+	rc = ingestion_set_framing(&connection->ingestion,
+				   IS_ENABLED(CONFIG_AMPOULE_TRANSPORT_TCP_COBS)
+					   ? INGESTION_FRAMING_COBS
+					   : INGESTION_FRAMING_LENGTH);
+	if (rc < 0) {
+		return rc;
+	}
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	ingestion_stats_register(&connection->ingestion, connection->name);
+#endif
+
+	const struct k_work_queue_config config = {
+		.name = connection->name,
+	};
+
+	k_work_queue_start(&connection->workq, tcp_workq_stacks[index],
+			   K_THREAD_STACK_SIZEOF(tcp_workq_stacks[index]),
+			   CONFIG_AMPOULE_TRANSPORT_TCP_PRIORITY, &config);
+	ingestion_set_workq(&connection->ingestion, &connection->workq);
+
+	k_thread_create(&connection->thread, tcp_stacks[index],
+			K_THREAD_STACK_SIZEOF(tcp_stacks[index]), tcp_connection_thread, connection,
+			NULL, NULL, CONFIG_AMPOULE_TRANSPORT_TCP_PRIORITY, 0, K_NO_WAIT);
+	k_thread_name_set(&connection->thread, connection->name);
+
+	return 0;
+}
+
+static int tcp_listen(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(CONFIG_AMPOULE_TRANSPORT_TCP_PORT),
+		.sin_addr = INADDR_ANY_INIT,
+	};
+	int reuse = 1;
+
+	int sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock < 0) {
+		return -errno;
+	}
+
+	/* Restarting native_sim would otherwise wait for the previous port to time out */
+	(void)zsock_setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	if (zsock_bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    zsock_listen(sock, TCP_CONNECTIONS) < 0) {
+		int rc = -errno;
+
+		zsock_close(sock);
+		return rc;
+	}
+
+	return sock;
+}
+
+static void tcp_listener(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	for (size_t i = 0; i < ARRAY_SIZE(tcp_connections); i++) {
+		int rc = tcp_connection_init(&tcp_connections[i], i);
+		if (rc < 0) {
+			printk("TCP transport framing unsupported (%d)\n", rc);
+			return;
+		}
+	}
+
+	int listener = tcp_listen();
+	if (listener < 0) {
+		printk("TCP transport can't listen on port %d (%d)\n",
+		       CONFIG_AMPOULE_TRANSPORT_TCP_PORT, listener);
+		return;
+	}
+
+	while (true) {
+		/* Further hosts wait in the listen backlog until a connection is free */
+		k_sem_take(&tcp_free, K_FOREVER);
+
+		int sock = zsock_accept(listener, NULL, NULL);
+		if (sock < 0) {
+			printk("TCP transport accept failed (%d)\n", errno);
+			k_sem_give(&tcp_free);
+			k_msleep(100);
+			continue;
+		}
+
+		tcp_configure(sock);
+
+		ARRAY_FOR_EACH_PTR(tcp_connections, connection) {
+			if (connection->sock < 0) {
+				connection->sock = sock;
+				k_sem_give(&connection->connected);
+				break;
+			}
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Compare the BENCH lines of two tests/benchmarks runs.
+
+Usage: bench_compare.py BASELINE_LOG CURRENT_LOG [--threshold PERCENT]
+
+Logs are twister handler.log files, or any output holding "BENCH {json}" lines.
+Exits with 1 if a rate dropped or a latency rose by more than the threshold.
+"""
+
+import argparse
+import json
+import sys
+
+RATES = ("frames_per_s", "commands_per_s", "bytes_per_s", "ops_per_s", "pixels_per_s")
+LATENCIES = ("p50_cycles", "p99_cycles")
+PARAMETERS = ("suite", "case", "frame_bytes", "chunk", "batch", "bytes", "baud", "burst", "gap_us",
+              "hosts", "pixels")
+
+
+def load(path):
+    results = {}
+
+    with open(path, encoding="utf-8", errors="replace") as log:
+        for line in log:
+            _, found, payload = line.partition("BENCH ")
+            if not found:
+                continue
+
+            result = json.loads(payload)
+            key = tuple((name, result[name]) for name in PARAMETERS if name in result)
+            results[key] = result
+
+    return results
+
+
+def describe(key):
+    return " ".join(f"{name}={value}" for name, value in key)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="allowed regression in percent (default 10)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    regressions = 0
+
+    for key, before in sorted(baseline.items()):
+        after = current.get(key)
+        if after is None:
+            print(f"missing: {describe(key)}")
+            regressions += 1
+            continue
+
+        for metric in RATES + LATENCIES:
+            if metric not in before or before[metric] == 0:
+                continue
+
+            change = (after[metric] - before[metric]) * 100.0 / before[metric]
+            worse = change < -args.threshold if metric in RATES else change > args.threshold
+
+            if worse:
+                print(f"regression: {describe(key)} {metric} "
+                      f"{before[metric]} -> {after[metric]} ({change:+.1f}%)")
+                regressions += 1
+
+    print(f"{len(baseline)} results compared, {regressions} regression(s)")
+
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,454 @@
+/**
+ * @file main
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-23 10:05:18
+ * @brief Throughput and latency benchmarks of the ingestion engine, nanopb and the pixel kernels
+ *
+ * Every result is printed on its own line as "BENCH {json}", see scripts/bench_compare.py.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdlib.h>
+#include <zephyr/ztest.h>
+#include <zephyr/sys/byteorder.h>
+#include "ampoule/command.h"
+#include "ampoule/ingestion.h"
+#include "ampoule/pixel.h"
+#include "pb_encode.h"
+#include "pb_decode.h"
+#include "host_clock.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+/* Frames fed per run, responses are expected for all of them */
+#define BENCH_FRAMES     256
+/* Iterations of the nanopb benchmarks */
+#define BENCH_ITERATIONS 1024
+
+/* Largest frame of the sweep, a STRIP_WRITE of 200 pixels */
+#define BENCH_RGB_MAX_SIZE 600
+#define BENCH_FRAME_SIZE   (BENCH_RGB_MAX_SIZE + 16)
+
+/* Longest strip of the pixel kernel sweep */
+#define BENCH_PIXELS_MAX 1024
+/* Brightness of the pixel benchmarks, anything but the maximum which is skipped */
+#define BENCH_BRIGHTNESS 100
+
+#if defined(CONFIG_ARCH_POSIX)
+/* native_sim time stands still while code runs, measure host time instead. Cycles are then
+ * nanoseconds.
+ */
+#define BENCH_HZ NSEC_PER_SEC
+#define bench_now() ((uint32_t)bench_host_clock_ns())
+#else
+#define BENCH_HZ sys_clock_hw_cycles_per_sec()
+#define bench_now() k_cycle_get_32()
+#endif
+
+struct bench_stats {
+	uint32_t p50;
+	uint32_t p99;
+};
+
+enum bench_pixel_kernel {
+	BENCH_PIXEL_GAMMA,
+	BENCH_PIXEL_BRIGHTNESS,
+	BENCH_PIXEL_REORDER,
+	BENCH_PIXEL_PIPELINE,
+	BENCH_PIXEL_PER_PIXEL,
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int on_write(void *context, uint8_t *data, uint16_t len);
+static int on_ext_command(ampoule_ExtCommand *command, ampoule_ExtResponse *response);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static struct ingestion ingestion;
+static struct ingestion_transport bench_transport = {.write = on_write};
+
+/* Upstream commands go through the real dispatch, extension ones are only acknowledged so
+ * large frames measure decoding rather than a peripheral.
+ */
+static struct ingestion_rpc bench_rpc = {
+	.on_command = command_process,
+	.on_ext_command = on_ext_command,
+};
+
+static uint8_t stream[BENCH_FRAMES * BENCH_FRAME_SIZE];
+
+/* Start of the feed call in progress, responses are written before it returns */
+static uint32_t feed_start;
+static uint32_t responses;
+static uint32_t response_bytes;
+static uint32_t latencies[MAX(BENCH_FRAMES, BENCH_ITERATIONS)];
+
+static struct led_rgb bench_pixels[BENCH_PIXELS_MAX];
+static struct pixel_pipeline bench_pipeline;
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static int on_write(void *context, uint8_t *data, uint16_t len)
+{
+	if (responses < BENCH_FRAMES) {
+		latencies[responses] = bench_now() - feed_start;
+	}
+
+	responses++;
+	response_bytes += len;
+
+	return len;
+}
+
+static int on_ext_command(ampoule_ExtCommand *command, ampoule_ExtResponse *response)
+{
+	response->opcode = command->opcode;
+	response->success = true;
+
+	return 0;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static struct bench_stats bench_stats(uint32_t count)
+{
+	qsort(latencies, count, sizeof(latencies[0]), compare_u32);
+
+	return (struct bench_stats){
+		.p50 = latencies[count / 2],
+		.p99 = latencies[count * 99 / 100],
+	};
+}
+
+static uint32_t bench_rate(uint32_t count, uint32_t cycles)
+{
+	return cycles == 0 ? 0 : (uint64_t)count * BENCH_HZ / cycles;
+}
+
+/* Appends a frame holding batch delimited PING, or a single PING if batch is 0 */
+static uint32_t bench_ping_frame(uint8_t *frame, uint32_t batch)
+{
+	ampoule_Command ping = {.opcode = ampoule_Opcode_PING};
+	pb_ostream_t ostream =
+		pb_ostream_from_buffer(&frame[sizeof(uint16_t)], BENCH_FRAME_SIZE - sizeof(uint16_t));
+	uint16_t flags = 0;
+
+	if (batch == 0) {
+		zassert_true(pb_encode(&ostream, ampoule_Command_fields, &ping));
+	} else {
+		for (uint32_t i = 0; i < batch; i++) {
+			zassert_true(pb_encode_ex(&ostream, ampoule_Command_fields, &ping,
+						  PB_ENCODE_DELIMITED));
+		}
+		flags = INGESTION_FRAME_FLAG_BATCH;
+	}
+
+	sys_put_be16(ostream.bytes_written | flags, &frame[0]);
+
+	return ostream.bytes_written + sizeof(uint16_t);
+}
+
+static void bench_strip_write(ampoule_ExtCommand *command, uint16_t rgb_size)
+{
+	*command = (ampoule_ExtCommand){
+		.opcode = ampoule_ExtOpcode_STRIP_WRITE,
+		.which_operation = ampoule_ExtCommand_strip_write_tag,
+		.operation.strip_write.rgb.size = rgb_size,
+	};
+
+	for (uint16_t i = 0; i < rgb_size; i++) {
+		command->operation.strip_write.rgb.bytes[i] = i;
+	}
+}
+
+/* Appends an extension frame writing rgb_size bytes of pixels */
+static uint32_t bench_strip_frame(uint8_t *frame, uint16_t rgb_size)
+{
+	static ampoule_ExtCommand command;
+	pb_ostream_t ostream =
+		pb_ostream_from_buffer(&frame[sizeof(uint16_t)], BENCH_FRAME_SIZE - sizeof(uint16_t));
+
+	bench_strip_write(&command, rgb_size);
+	zassert_true(pb_encode(&ostream, ampoule_ExtCommand_fields, &command));
+
+	sys_put_be16(ostream.bytes_written | INGESTION_FRAME_FLAG_EXT, &frame[0]);
+
+	return ostream.bytes_written + sizeof(uint16_t);
+}
+
+/* Feeds the stream by chunks of chunk bytes, returns the cycles spent */
+static uint32_t bench_feed(uint32_t stream_len, uint16_t chunk)
+{
+	uint32_t start = bench_now();
+
+	responses = 0;
+	response_bytes = 0;
+
+	/* The test thread runs below the ingestion workqueue, see prj.conf, every complete frame
+	 * is answered before ingestion_feed() returns. The RX ring only ever holds a partial
+	 * frame and a chunk.
+	 */
+	for (uint32_t offset = 0; offset < stream_len; offset += chunk) {
+		feed_start = bench_now();
+		ingestion_feed(&ingestion, &stream[offset], MIN(chunk, stream_len - offset));
+	}
+
+	return bench_now() - start;
+}
+
+static void bench_report(const char *name, uint32_t frame_len, uint16_t chunk, uint32_t batch,
+			 uint32_t stream_len, uint32_t cycles)
+{
+	struct bench_stats stats = bench_stats(BENCH_FRAMES);
+
+	zassert_equal(responses, BENCH_FRAMES, "%s: %u responses", name, responses);
+
+	TC_PRINT("BENCH {\"suite\":\"ingestion\",\"case\":\"%s\",\"frame_bytes\":%u,"
+		 "\"chunk\":%u,\"batch\":%u,\"frames\":%u,\"bytes\":%u,\"frames_per_s\":%u,"
+		 "\"commands_per_s\":%u,\"bytes_per_s\":%u,\"p50_cycles\":%u,\"p99_cycles\":%u,"
+		 "\"hz\":%u}\n",
+		 name, frame_len, chunk, batch, BENCH_FRAMES, stream_len,
+		 bench_rate(BENCH_FRAMES, cycles), bench_rate(BENCH_FRAMES * MAX(batch, 1), cycles),
+		 bench_rate(stream_len + response_bytes, cycles), stats.p50, stats.p99,
+		 (uint32_t)BENCH_HZ);
+}
+
+static void before(void *fixture)
+{
+	zassert_ok(ingestion_init(&ingestion, &bench_transport, &bench_rpc, NULL));
+}
+
+ZTEST(benchmarks, test_bench_chunk_sizes)
+{
+	const uint16_t chunks[] = {1, 8, 64, 512};
+	uint32_t frame_len = bench_ping_frame(stream, 0);
+
+	for (uint32_t i = 1; i < BENCH_FRAMES; i++) {
+		memcpy(&stream[i * frame_len], stream, frame_len);
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(chunks); i++) {
+		uint32_t stream_len = BENCH_FRAMES * frame_len;
+		uint32_t cycles = bench_feed(stream_len, chunks[i]);
+
+		bench_report("ping", frame_len, chunks[i], 0, stream_len, cycles);
+	}
+}
+
+ZTEST(benchmarks, test_bench_frame_sizes)
+{
+	const uint16_t rgb_sizes[] = {0, 60, 240, BENCH_RGB_MAX_SIZE};
+	const uint16_t chunks[] = {64, 256};
+
+	BUILD_ASSERT(BENCH_FRAME_SIZE + 256 <= INGESTION_PACKET_MAX_SIZE);
+
+	for (size_t i = 0; i < ARRAY_SIZE(rgb_sizes); i++) {
+		uint32_t frame_len = bench_strip_frame(stream, rgb_sizes[i]);
+		uint32_t stream_len = BENCH_FRAMES * frame_len;
+
+		for (uint32_t j = 1; j < BENCH_FRAMES; j++) {
+			memcpy(&stream[j * frame_len], stream, frame_len);
+		}
+
+		for (size_t j = 0; j < ARRAY_SIZE(chunks); j++) {
+			uint32_t cycles = bench_feed(stream_len, chunks[j]);
+
+			bench_report("strip_write", frame_len, chunks[j], 0, stream_len, cycles);
+		}
+	}
+}
+
+ZTEST(benchmarks, test_bench_batch_patterns)
+{
+	const uint32_t batches[] = {1, 4, 16, 64};
+
+	for (size_t i = 0; i < ARRAY_SIZE(batches); i++) {
+		uint32_t frame_len = bench_ping_frame(stream, batches[i]);
+		uint32_t stream_len = BENCH_FRAMES * frame_len;
+
+		for (uint32_t j = 1; j < BENCH_FRAMES; j++) {
+			memcpy(&stream[j * frame_len], stream, frame_len);
+		}
+
+		uint32_t cycles = bench_feed(stream_len, 64);
+
+		bench_report("ping_batch", frame_len, 64, batches[i], stream_len, cycles);
+	}
+}
+
+static void bench_codec_report(const char *name, uint32_t bytes)
+{
+	uint32_t total = 0;
+
+	for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+		total += latencies[i];
+	}
+
+	struct bench_stats stats = bench_stats(BENCH_ITERATIONS);
+
+	TC_PRINT("BENCH {\"suite\":\"nanopb\",\"case\":\"%s\",\"bytes\":%u,\"ops_per_s\":%u,"
+		 "\"bytes_per_s\":%u,\"p50_cycles\":%u,\"p99_cycles\":%u,\"hz\":%u}\n",
+		 name, bytes, bench_rate(BENCH_ITERATIONS, total),
+		 bench_rate(BENCH_ITERATIONS * bytes, total), stats.p50, stats.p99,
+		 (uint32_t)BENCH_HZ);
+}
+
+ZTEST(benchmarks, test_bench_nanopb)
+{
+	static ampoule_ExtCommand ext_command;
+	uint8_t buffer[BENCH_FRAME_SIZE];
+	ampoule_Command command = {.opcode = ampoule_Opcode_PING};
+	ampoule_Response response = {.opcode = ampoule_Opcode_PONG, .success = true};
+	size_t size;
+
+	/* Upstream command and response, the per frame floor */
+	for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+		pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+		uint32_t start = bench_now();
+
+		zassert_true(pb_encode(&ostream, ampoule_Response_fields, &response));
+		latencies[i] = bench_now() - start;
+		size = ostream.bytes_written;
+	}
+	bench_codec_report("encode_response", size);
+
+	for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+		pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+
+		zassert_true(pb_encode(&ostream, ampoule_Command_fields, &command));
+		size = ostream.bytes_written;
+
+		pb_istream_t istream = pb_istream_from_buffer(buffer, size);
+		uint32_t start = bench_now();
+
+		zassert_true(pb_decode(&istream, ampoule_Command_fields, &command));
+		latencies[i] = bench_now() - start;
+	}
+	bench_codec_report("decode_command", size);
+
+	/* Largest extension payload, dominated by the bytes field */
+	bench_strip_write(&ext_command, BENCH_RGB_MAX_SIZE);
+
+	for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+		pb_ostream_t ostream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+		uint32_t start = bench_now();
+
+		zassert_true(pb_encode(&ostream, ampoule_ExtCommand_fields, &ext_command));
+		latencies[i] = bench_now() - start;
+		size = ostream.bytes_written;
+	}
+	bench_codec_report("encode_strip_write", size);
+
+	for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+		pb_istream_t istream = pb_istream_from_buffer(buffer, size);
+		uint32_t start = bench_now();
+
+		zassert_true(pb_decode(&istream, ampoule_ExtCommand_fields, &ext_command));
+		latencies[i] = bench_now() - start;
+	}
+	bench_codec_report("decode_strip_write", size);
+}
+
+/* What the pipeline replaces: each channel of each pixel looked up, scaled and reordered in turn */
+static void bench_per_pixel(struct led_rgb *pixels, size_t count, uint8_t brightness)
+{
+	for (size_t i = 0; i < count; i++) {
+		uint8_t r = pixel_gamma_lut[pixels[i].r] * (brightness + 1) / 256;
+		uint8_t g = pixel_gamma_lut[pixels[i].g] * (brightness + 1) / 256;
+		uint8_t b = pixel_gamma_lut[pixels[i].b] * (brightness + 1) / 256;
+
+		pixels[i].r = g;
+		pixels[i].g = r;
+		pixels[i].b = b;
+	}
+}
+
+static void bench_pixel_run(enum bench_pixel_kernel kernel, uint32_t count)
+{
+	uint8_t *data = (uint8_t *)bench_pixels;
+	size_t len = count * sizeof(struct led_rgb);
+
+	switch (kernel) {
+	case BENCH_PIXEL_GAMMA:
+		pixel_gamma(data, len, pixel_gamma_lut);
+		break;
+	case BENCH_PIXEL_BRIGHTNESS:
+		pixel_brightness(data, len, BENCH_BRIGHTNESS);
+		break;
+	case BENCH_PIXEL_REORDER:
+		pixel_reorder(bench_pixels, count, PIXEL_ORDER_GRB);
+		break;
+	case BENCH_PIXEL_PIPELINE:
+		pixel_pipeline_run(&bench_pipeline, bench_pixels, count);
+		break;
+	case BENCH_PIXEL_PER_PIXEL:
+		bench_per_pixel(bench_pixels, count, BENCH_BRIGHTNESS);
+		break;
+	}
+}
+
+ZTEST(benchmarks, test_bench_pixel_kernels)
+{
+	static const char *const names[] = {
+		[BENCH_PIXEL_GAMMA] = "gamma",
+		[BENCH_PIXEL_BRIGHTNESS] = "brightness",
+		[BENCH_PIXEL_REORDER] = "reorder",
+		[BENCH_PIXEL_PIPELINE] = "pipeline",
+		[BENCH_PIXEL_PER_PIXEL] = "per_pixel",
+	};
+	const uint32_t counts[] = {60, 300, BENCH_PIXELS_MAX};
+	const struct pixel_config config = {
+		.brightness = BENCH_BRIGHTNESS,
+		.gamma = true,
+		.order = PIXEL_ORDER_GRB,
+	};
+
+	zassert_ok(pixel_pipeline_init(&bench_pipeline, &config));
+
+	for (uint32_t i = 0; i < ARRAY_SIZE(counts); i++) {
+		for (uint32_t kernel = 0; kernel < ARRAY_SIZE(names); kernel++) {
+			uint32_t total = 0;
+
+			/* Kernels take as long whatever the pixels, processed over and over */
+			memset(bench_pixels, 0x5A, sizeof(bench_pixels));
+
+			for (uint32_t j = 0; j < BENCH_ITERATIONS; j++) {
+				uint32_t start = bench_now();
+
+				bench_pixel_run(kernel, counts[i]);
+				latencies[j] = bench_now() - start;
+				total += latencies[j];
+			}
+
+			struct bench_stats stats = bench_stats(BENCH_ITERATIONS);
+			/* In hundredths, printf may not do floats */
+			uint32_t per_pixel = (uint64_t)stats.p50 * 100 / counts[i];
+
+			TC_PRINT("BENCH {\"suite\":\"pixel\",\"case\":\"%s\",\"pixels\":%u,"
+				 "\"pixels_per_s\":%u,\"p50_cycles\":%u,\"p99_cycles\":%u,"
+				 "\"cycles_per_pixel\":%u.%02u,\"hz\":%u}\n",
+				 names[kernel], counts[i],
+				 bench_rate(BENCH_ITERATIONS * counts[i], total), stats.p50,
+				 stats.p99, per_pixel / 100, per_pixel % 100, (uint32_t)BENCH_HZ);
+		}
+	}
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(benchmarks, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,345 @@
+/**
+ * @file main
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-12-28 10:42:17
+ * @brief Exercise the serial transport with several devices sharing one emulated bus
+ *
+ * The test plays the bus: what the host sends reaches every device, and what a device sends
+ * reaches every other one. The emulated UARTs move bytes at once, wire time is accounted for
+ * from the baud rate to tell whether responses would have collided.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/drivers/serial/uart_emul.h>
+#include "ampoule/ingestion.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define DEVICES  4
+#define BAUDRATE 115200
+#define SLOT_US  2000
+
+/* Start, 8 data and stop bits */
+#define WIRE_US(len) ((uint32_t)(len) * 10 * USEC_PER_SEC / BAUDRATE)
+
+#define REQUEST_ID 0x1234
+
+/* Longest the test waits for the last slot to be answered */
+#define ANSWER_US ((DEVICES + 1) * SLOT_US)
+
+struct bus_response {
+	uint8_t data[32];
+	uint32_t len;
+	/* Time since the request the first byte was seen at, in us */
+	int64_t at_us;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static const struct device *uart_devs[DEVICES] = {
+	DEVICE_DT_GET(DT_NODELABEL(euart0)),
+	DEVICE_DT_GET(DT_NODELABEL(euart1)),
+	DEVICE_DT_GET(DT_NODELABEL(euart2)),
+	DEVICE_DT_GET(DT_NODELABEL(euart3)),
+};
+
+/* Groups of the devices, as in the overlay */
+static const uint16_t groups[DEVICES] = {BIT(0), BIT(0) | BIT(1), BIT(1), 0};
+
+static const uint8_t ping[] = {0, 2, 8, 1};
+static const uint8_t pong[] = {0, 4, 8, 2, 16, 1};
+
+static struct bus_response responses[DEVICES];
+static uint32_t frames_ok[DEVICES];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static int64_t now_us(void)
+{
+	return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+static uint32_t frames_decoded(const struct device *dev)
+{
+	struct ingestion_stats stats;
+	const char *name;
+
+	for (uint32_t i = 0; ingestion_stats_get(i, &name, &stats) == 0; i++) {
+		if (strcmp(name, dev->name) == 0) {
+			return stats.frames_ok;
+		}
+	}
+
+	ztest_test_fail();
+	return 0;
+}
+
+/* PING to an address, with a request id if id isn't 0 */
+static uint32_t build_ping(uint8_t *frame, uint8_t address, uint16_t id)
+{
+	uint32_t len = 0;
+
+	frame[len++] = address;
+
+	if (id == 0) {
+		memcpy(&frame[len], ping, sizeof(ping));
+		return len + sizeof(ping);
+	}
+
+	sys_put_be16((sizeof(ping) - sizeof(uint16_t) + INGESTION_FRAME_ID_SIZE) |
+			     INGESTION_FRAME_FLAG_ID,
+		     &frame[len]);
+	len += sizeof(uint16_t);
+	sys_put_be16(id, &frame[len]);
+	len += INGESTION_FRAME_ID_SIZE;
+	memcpy(&frame[len], &ping[sizeof(uint16_t)], sizeof(ping) - sizeof(uint16_t));
+
+	return len + sizeof(ping) - sizeof(uint16_t);
+}
+
+/* The PONG device address answers a build_ping() with */
+static uint32_t build_pong(uint8_t *frame, uint8_t address, uint16_t id)
+{
+	uint32_t len = 0;
+
+	frame[len++] = INGESTION_BUS_RESPONSE | address;
+
+	if (id == 0) {
+		memcpy(&frame[len], pong, sizeof(pong));
+		return len + sizeof(pong);
+	}
+
+	sys_put_be16((sizeof(pong) - sizeof(uint16_t) + INGESTION_FRAME_ID_SIZE) |
+			     INGESTION_FRAME_FLAG_ID,
+		     &frame[len]);
+	len += sizeof(uint16_t);
+	sys_put_be16(id, &frame[len]);
+	len += INGESTION_FRAME_ID_SIZE;
+	memcpy(&frame[len], &pong[sizeof(uint16_t)], sizeof(pong) - sizeof(uint16_t));
+
+	return len + sizeof(pong) - sizeof(uint16_t);
+}
+
+/* Puts a host frame on the bus, then relays what the devices send for duration_us */
+static void bus_exchange(const uint8_t *frame, uint32_t len, int64_t duration_us)
+{
+	uint8_t chunk[sizeof(responses[0].data)];
+
+	memset(responses, 0, sizeof(responses));
+
+	for (uint32_t i = 0; i < DEVICES; i++) {
+		frames_ok[i] = frames_decoded(uart_devs[i]);
+		uart_emul_put_rx_data(uart_devs[i], frame, len);
+	}
+
+	int64_t start_us = now_us();
+
+	while (now_us() - start_us < duration_us) {
+		k_sleep(K_USEC(20));
+
+		for (uint32_t i = 0; i < DEVICES; i++) {
+			struct bus_response *response = &responses[i];
+			uint32_t got = uart_emul_get_tx_data(uart_devs[i], chunk, sizeof(chunk));
+
+			if (got == 0) {
+				continue;
+			}
+
+			if (response->len == 0) {
+				response->at_us = now_us() - start_us;
+			}
+
+			zassert_true(response->len + got <= sizeof(response->data),
+				     "Device %u sent too much", i);
+			memcpy(&response->data[response->len], chunk, got);
+			response->len += got;
+
+			/* Every other device hears it too and must ignore it */
+			for (uint32_t other = 0; other < DEVICES; other++) {
+				if (other != i) {
+					uart_emul_put_rx_data(uart_devs[other], chunk, got);
+				}
+			}
+		}
+	}
+}
+
+/* Checks the devices that answered are those in expected, with pong, each in its own slot */
+static void assert_answers(uint32_t expected, uint16_t id)
+{
+	uint8_t frame[sizeof(responses[0].data)];
+	int64_t wire_end_us = 0;
+
+	for (uint32_t i = 0; i < DEVICES; i++) {
+		const struct bus_response *response = &responses[i];
+
+		if (!(expected & BIT(i))) {
+			zassert_equal(response->len, 0, "Device %u answered", i);
+			continue;
+		}
+
+		uint32_t len = build_pong(frame, i, id);
+
+		zassert_equal(response->len, len, "Device %u sent %u bytes", i, response->len);
+		zassert_mem_equal(response->data, frame, len);
+
+		if (id == 0) {
+			continue;
+		}
+
+		/* Devices are in address order, slots must be too and never overlap on the wire */
+		TC_PRINT("Device %u answered after %lld us\n", i, (long long)response->at_us);
+		zassert_true(response->at_us >= i * SLOT_US, "Device %u early", i);
+		zassert_true(response->at_us < i * SLOT_US + SLOT_US / 2, "Device %u late", i);
+		zassert_true(response->at_us >= wire_end_us, "Device %u collided", i);
+
+		wire_end_us = response->at_us + WIRE_US(len);
+	}
+}
+
+static void before(void *fixture)
+{
+	for (uint32_t i = 0; i < DEVICES; i++) {
+		uart_emul_flush_rx_data(uart_devs[i]);
+		uart_emul_flush_tx_data(uart_devs[i]);
+	}
+}
+
+ZTEST(bus_tests, test_bus_unicast_only_addressee_answers)
+{
+	uint8_t frame[16];
+
+	for (uint8_t address = 0; address < DEVICES; address++) {
+		uint32_t len = build_ping(frame, address, 0);
+
+		bus_exchange(frame, len, 2 * SLOT_US);
+		assert_answers(BIT(address), 0);
+
+		/* Others dropped it before decoding */
+		for (uint32_t i = 0; i < DEVICES; i++) {
+			zassert_equal(frames_decoded(uart_devs[i]) - frames_ok[i], i == address);
+		}
+	}
+}
+
+ZTEST(bus_tests, test_bus_unknown_address_is_ignored)
+{
+	uint8_t frame[16];
+	uint32_t len = build_ping(frame, INGESTION_BUS_ADDRESS_MAX, REQUEST_ID);
+
+	bus_exchange(frame, len, 2 * SLOT_US);
+	assert_answers(0, REQUEST_ID);
+
+	for (uint32_t i = 0; i < DEVICES; i++) {
+		zassert_equal(frames_decoded(uart_devs[i]), frames_ok[i]);
+	}
+
+	/* A response on the bus, with the address of a device, is never taken for a request */
+	len = build_ping(frame, INGESTION_BUS_RESPONSE | 1, REQUEST_ID);
+
+	bus_exchange(frame, len, 2 * SLOT_US);
+	assert_answers(0, REQUEST_ID);
+
+	for (uint32_t i = 0; i < DEVICES; i++) {
+		zassert_equal(frames_decoded(uart_devs[i]), frames_ok[i]);
+	}
+
+	/* Nothing was left half read */
+	len = build_ping(frame, 2, 0);
+
+	bus_exchange(frame, len, 2 * SLOT_US);
+	assert_answers(BIT(2), 0);
+}
+
+ZTEST(bus_tests, test_bus_broadcast_without_id_is_silent)
+{
+	uint8_t frame[16];
+	uint32_t len = build_ping(frame, INGESTION_BUS_BROADCAST, 0);
+
+	bus_exchange(frame, len, ANSWER_US);
+	assert_answers(0, 0);
+
+	/* Handled by every device all the same */
+	for (uint32_t i = 0; i < DEVICES; i++) {
+		zassert_equal(frames_decoded(uart_devs[i]) - frames_ok[i], 1);
+	}
+}
+
+ZTEST(bus_tests, test_bus_broadcast_with_id_answers_in_slots)
+{
+	uint8_t frame[16];
+	uint32_t len = build_ping(frame, INGESTION_BUS_BROADCAST, REQUEST_ID);
+
+	bus_exchange(frame, len, ANSWER_US);
+	assert_answers(BIT_MASK(DEVICES), REQUEST_ID);
+}
+
+ZTEST(bus_tests, test_bus_group_members_answer)
+{
+	uint8_t frame[16];
+
+	for (uint8_t group = 0; group < 2; group++) {
+		uint32_t len = build_ping(frame, INGESTION_BUS_GROUP(group), REQUEST_ID);
+		uint32_t members = 0;
+
+		for (uint32_t i = 0; i < DEVICES; i++) {
+			if (groups[i] & BIT(group)) {
+				members |= BIT(i);
+			}
+		}
+
+		bus_exchange(frame, len, ANSWER_US);
+		assert_answers(members, REQUEST_ID);
+	}
+
+	/* No device is in the last group */
+	uint32_t len = build_ping(frame, INGESTION_BUS_GROUP(INGESTION_BUS_GROUPS - 1), REQUEST_ID);
+
+	bus_exchange(frame, len, ANSWER_US);
+	assert_answers(0, REQUEST_ID);
+}
+
+ZTEST(bus_tests, test_bus_back_to_back_requests)
+{
+	uint8_t frames[64];
+	uint8_t expected[2 * 16];
+	uint32_t len = 0;
+
+	/* Each device skips the frames in between its own, a silent broadcast included */
+	len += build_ping(&frames[len], 3, 0);
+	len += build_ping(&frames[len], 1, 0);
+	len += build_ping(&frames[len], INGESTION_BUS_BROADCAST, 0);
+	len += build_ping(&frames[len], 1, 0);
+
+	bus_exchange(frames, len, 2 * SLOT_US);
+
+	uint32_t pong_len = build_pong(expected, 1, 0);
+
+	memcpy(&expected[pong_len], expected, pong_len);
+	zassert_equal(responses[1].len, 2 * pong_len);
+	zassert_mem_equal(responses[1].data, expected, 2 * pong_len);
+
+	pong_len = build_pong(expected, 3, 0);
+	zassert_equal(responses[3].len, pong_len);
+	zassert_mem_equal(responses[3].data, expected, pong_len);
+
+	zassert_equal(responses[0].len, 0);
+	zassert_equal(responses[2].len, 0);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(bus_tests, NULL, NULL, before, NULL, NULL);
@@ -42,6 +42,15 @@ ZTEST(command_tests, test_command_ping_shall_pong)
 	zassert_true(response.success == true);
 }
 
+ZTEST(command_tests, test_command_unknown_opcode_fails)
+{
+	ampoule_Command command = {.opcode = (ampoule_Opcode)42};
+	ampoule_Response response;
+
+	zassert_equal(command_process(&command, &response), -ENOSYS);
+	zassert_false(response.success);
+}
+
 #if DT_NODE_EXISTS(LED0_NODE)
 static const struct gpio_dt_spec dev = GPIO_DT_SPEC_GET(LED0_NODE, gpios);
 
@@ -88,6 +97,37 @@ ZTEST(command_tests, test_command_off_led_should_set_led_off)
 	/* Make sure gpio is high  */
 	zassert_equal(gpio_emul_output_get(dev.port, dev.pin), 0);
 }
+
+ZTEST(command_tests, test_command_led_pin_configured_once)
+{
+	ampoule_Command command = {
+		.opcode = ampoule_Opcode_SET_LED,
+		.which_operation = ampoule_Command_led_tag,
+	};
+	ampoule_Response response;
+	gpio_flags_t flags;
+
+	/* Configured at boot, before any command */
+	gpio_emul_flags_get(dev.port, dev.pin, &flags);
+	zassert_equal(flags & GPIO_DIR_MASK, GPIO_OUTPUT);
+
+	/* Mark the pin with different flags, they would be overwritten by a handler reconfiguring
+	 * it
+	 */
+	zassert_ok(gpio_pin_configure_dt(&dev, GPIO_OUTPUT_ACTIVE));
+
+	for (int i = 0; i < 100; i++) {
+		int on = i % 2;
+
+		command.operation.led.color = on ? ampoule_Led_Color_WHITE : ampoule_Led_Color_OFF;
+		zassert_ok(command_process(&command, &response));
+		zassert_true(response.success);
+		zassert_equal(gpio_emul_output_get(dev.port, dev.pin), on);
+	}
+
+	gpio_emul_flags_get(dev.port, dev.pin, &flags);
+	zassert_equal(flags & (GPIO_OUTPUT_INIT_HIGH | GPIO_OUTPUT_INIT_LOW), GPIO_OUTPUT_INIT_HIGH);
+}
 #else
 ZTEST(command_tests, test_command_led_should_fail)
 {
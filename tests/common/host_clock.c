@@ -0,0 +1,23 @@
+/**
+ * @file host_clock
+ * @brief Host monotonic clock, built in the native simulator runner
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdint.h>
+#include <time.h>
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+uint64_t bench_host_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,6 @@
+# Simulated time doesn't advance while code runs, the clock is read on the host side
+if(CONFIG_ARCH_POSIX)
+  target_sources(native_simulator INTERFACE ${CMAKE_CURRENT_LIST_DIR}/host_clock.c)
+endif()
+
+target_include_directories(app PRIVATE ${CMAKE_CURRENT_LIST_DIR})
@@ -0,0 +1,24 @@
+/**
+ * @file host_clock
+ * @brief Host monotonic clock shared by the suites measuring time on native_sim
+ *
+ */
+
+#ifndef HOST_CLOCK_H_
+#define HOST_CLOCK_H_
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdint.h>
+
+/******************************************************************************/
+/* Global Function Prototypes                                                 */
+/******************************************************************************/
+/**
+ * @brief Reads the host monotonic clock, which keeps running while simulated time stands still
+ * @return nanoseconds
+ */
+uint64_t bench_host_clock_ns(void);
+
+#endif /* HOST_CLOCK */
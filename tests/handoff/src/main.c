@@ -0,0 +1,282 @@
+/**
+ * @file main
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-01-25 11:08:19
+ * @brief Feed the ingestion from a timer ISR while its frames time out
+ *
+ * The host leaves a frame unfinished then resumes sending around the moment it times out, a few
+ * ticks early, on time or late, so feeds land before, during and after the timeout is handled.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include <zephyr/sys/byteorder.h>
+#include "pb_decode.h"
+#include "pb_encode.h"
+#include "ampoule/ingestion.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define ROUNDS       200
+#define BURST_FRAMES 8
+/* Ticks the host resumes sending early or late by, around the timeout */
+#define JITTER_TICKS 3
+#define MAX_CHUNK    16
+
+#define TIMEOUT_TICKS k_ms_to_ticks_ceil32(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS)
+
+enum host_phase {
+	/* Sends the start of a frame and nothing more */
+	HOST_STALE,
+	/* Waits for about the timeout */
+	HOST_SILENCE,
+	/* Sends BURST_FRAMES frames in random chunks, one per tick */
+	HOST_BURST,
+	/* Waits for whatever the burst left unfinished to time out */
+	HOST_GAP,
+	HOST_DONE,
+};
+
+struct host {
+	enum host_phase phase;
+	uint32_t round;
+	uint32_t ticks_left;
+	uint32_t offset;
+	uint32_t seed;
+	/* Timeouts counted when the round started */
+	uint32_t timeouts;
+	uint32_t frames_sent;
+	/* Rounds whose burst started once the timeout was handled, their frames must be answered */
+	uint32_t clean_rounds;
+	uint32_t clean_frames;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int on_command(ampoule_Command *command, ampoule_Response *response);
+static int on_write(void *context, uint8_t *data, uint16_t len);
+static void on_resume(void *context);
+static void host_tick(struct k_timer *timer);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static struct ingestion ingestion;
+static struct ingestion_transport transport = {
+	.write = on_write,
+	.resume = on_resume,
+};
+static struct ingestion_rpc rpc = {
+	.on_command = on_command,
+};
+
+static K_TIMER_DEFINE(host_timer, host_tick, NULL);
+static K_SEM_DEFINE(host_done, 0, 1);
+static struct host host;
+
+/* Announces 8 bytes and sends 3 of them */
+static uint8_t stale[] = {0x00, 0x08, 0xA5, 0xA5, 0xA5};
+static uint8_t burst[BURST_FRAMES * 8];
+static uint32_t burst_len;
+
+static uint32_t answered;
+static uint32_t bad_responses;
+/* Frame the transport feeds as soon as it is resumed, as a UART ISR would */
+static bool feed_on_resume;
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static int on_command(ampoule_Command *command, ampoule_Response *response)
+{
+	/* Leaves room for the host ISR to fire in the middle of a frame */
+	k_busy_wait(20);
+
+	response->opcode = ampoule_Opcode_PONG;
+
+	return 0;
+}
+
+static int on_write(void *context, uint8_t *data, uint16_t len)
+{
+	ampoule_Response response = {0};
+	pb_istream_t istream =
+		pb_istream_from_buffer(&data[sizeof(uint16_t)], len - sizeof(uint16_t));
+
+	/* Responses are never cut nor mixed up, whatever happened to the requests */
+	if (!pb_decode(&istream, ampoule_Response_fields, &response) ||
+	    response.opcode != ampoule_Opcode_PONG) {
+		bad_responses++;
+	}
+
+	answered++;
+
+	return len;
+}
+
+static void on_resume(void *context)
+{
+	if (feed_on_resume) {
+		feed_on_resume = false;
+		ingestion_feed(&ingestion, burst, burst_len / BURST_FRAMES);
+	}
+}
+
+static uint32_t host_random(void)
+{
+	host.seed = host.seed * 1103515245 + 12345;
+
+	return host.seed >> 16;
+}
+
+static void host_burst(void)
+{
+	uint32_t chunk = MIN(1 + host_random() % MAX_CHUNK, burst_len - host.offset);
+
+	ingestion_feed(&ingestion, &burst[host.offset], chunk);
+	host.offset += chunk;
+
+	if (host.offset == burst_len) {
+		host.frames_sent += BURST_FRAMES;
+		host.ticks_left = 2 * TIMEOUT_TICKS;
+		host.phase = HOST_GAP;
+	}
+}
+
+static void host_tick(struct k_timer *timer)
+{
+	switch (host.phase) {
+	case HOST_STALE:
+		host.timeouts = ingestion.stats.timeouts;
+		ingestion_feed(&ingestion, stale, sizeof(stale));
+		host.ticks_left =
+			TIMEOUT_TICKS - JITTER_TICKS + host_random() % (2 * JITTER_TICKS + 1);
+		host.phase = HOST_SILENCE;
+		break;
+	case HOST_SILENCE:
+		if (--host.ticks_left > 0) {
+			break;
+		}
+
+		/* Sent any earlier, the burst runs into the stale frame and is only resynced on
+		 * in the gap
+		 */
+		if (ingestion.stats.timeouts != host.timeouts) {
+			host.clean_rounds++;
+			host.clean_frames += BURST_FRAMES;
+		}
+
+		host.offset = 0;
+		host.phase = HOST_BURST;
+		host_burst();
+		break;
+	case HOST_BURST:
+		host_burst();
+		break;
+	case HOST_GAP:
+		if (--host.ticks_left > 0) {
+			break;
+		}
+
+		if (++host.round < ROUNDS) {
+			host.phase = HOST_STALE;
+			break;
+		}
+
+		host.phase = HOST_DONE;
+		k_sem_give(&host_done);
+		break;
+	case HOST_DONE:
+		break;
+	}
+}
+
+static void *setup(void)
+{
+	ampoule_Command ping = {.opcode = ampoule_Opcode_PING};
+
+	for (uint32_t i = 0; i < BURST_FRAMES; i++) {
+		pb_ostream_t ostream = pb_ostream_from_buffer(
+			&burst[burst_len + sizeof(uint16_t)],
+			sizeof(burst) / BURST_FRAMES - sizeof(uint16_t));
+
+		zassert_true(pb_encode(&ostream, ampoule_Command_fields, &ping));
+		sys_put_be16(ostream.bytes_written, &burst[burst_len]);
+		burst_len += ostream.bytes_written + sizeof(uint16_t);
+	}
+
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	answered = 0;
+	bad_responses = 0;
+	feed_on_resume = false;
+	host = (struct host){.seed = 0x0FF5E7};
+	k_sem_reset(&host_done);
+
+	zassert_ok(ingestion_init(&ingestion, &transport, &rpc, NULL));
+}
+
+ZTEST(handoff_tests, test_handoff_isr_feeds_across_timeouts)
+{
+	k_timer_start(&host_timer, K_TICKS(1), K_TICKS(1));
+	zassert_ok(k_sem_take(&host_done, K_SECONDS(30)));
+	k_timer_stop(&host_timer);
+
+	k_sleep(K_MSEC(2 * CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
+
+	TC_PRINT("%u rounds, %u clean, %u of %u frames answered\n", ROUNDS, host.clean_rounds,
+		 answered, host.frames_sent);
+
+	/* Both sides of the race were hit */
+	zassert_true(host.clean_rounds > 0 && host.clean_rounds < ROUNDS);
+
+	zassert_equal(bad_responses, 0, "%u malformed responses", bad_responses);
+	zassert_true(answered >= host.clean_frames, "Lost frames sent after a timeout");
+	zassert_true(answered <= host.frames_sent);
+
+	/* Nothing left behind, and the indices of both sides still agree */
+	zassert_equal(ring_buf_size_get(&ingestion.rb), 0);
+	zassert_equal(ingestion_rx_space(&ingestion), sizeof(ingestion.rx_buffer));
+
+	/* Back on frame boundaries */
+	answered = 0;
+	ingestion_feed(&ingestion, burst, burst_len);
+	k_sleep(K_MSEC(1));
+	zassert_equal(answered, BURST_FRAMES);
+}
+
+ZTEST(handoff_tests, test_handoff_feed_resumed_by_timeout_is_answered)
+{
+	/* ingestion_init() keeps the counters */
+	uint32_t timeouts = ingestion.stats.timeouts;
+
+	ingestion_feed(&ingestion, stale, sizeof(stale));
+	k_sleep(K_MSEC(1));
+
+	/* The transport waits for an empty ring, which only the timeout gets back to */
+	zassert_true(ingestion_rx_pause(&ingestion, sizeof(ingestion.rx_buffer)));
+	feed_on_resume = true;
+
+	/* Fed from within the timeout, once the stale bytes are dropped */
+	k_sleep(K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS + 1));
+	zassert_false(feed_on_resume);
+	zassert_equal(ingestion.stats.timeouts - timeouts, 1);
+
+	k_sleep(K_MSEC(1));
+	zassert_equal(answered, 1);
+	zassert_equal(bad_responses, 0);
+	zassert_equal(ring_buf_size_get(&ingestion.rb), 0);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(handoff_tests, NULL, setup, before, NULL, NULL);
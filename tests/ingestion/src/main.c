@@ -10,31 +10,69 @@
 /* Includes                                                                   */
 /******************************************************************************/
 #include <zephyr/ztest.h>
+#include "ampoule/command.h"
 #include "ampoule/ingestion.h"
 #include "pb_encode.h"
+#include "pb_decode.h"
 #include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
 
 /******************************************************************************/
 /* Local Constant, Macro and Type Definitions                                 */
 /******************************************************************************/
+/* Request id of the urgent PING sent behind slow requests */
+#define URGENT_ID 0xFFFF
 
 /******************************************************************************/
 /* Local Function Prototypes                                                  */
 /******************************************************************************/
 static int on_command(ampoule_Command *command, ampoule_Response *response);
+static bool on_is_urgent(bool ext, uint32_t opcode);
 static int on_write(void *context, uint8_t *data, uint16_t len);
+static int on_stuck_write(void *context, uint8_t *data, uint16_t len);
+static int on_claim(void *context, uint8_t **data, uint16_t len);
+static int on_commit(void *context, uint16_t len);
+static void on_resume(void *context);
 
 /******************************************************************************/
 /* Local Variable Definitions                                                 */
 /******************************************************************************/
 static struct ingestion ingestion;
 static bool cb_called = false;
-static uint8_t cb_data[512];
+static uint8_t cb_data[1024];
 static uint16_t cb_data_len;
 static bool rpc_received = false;
+static K_SEM_DEFINE(rpc_sem, 0, 1);
+static uint32_t rpc_count;
+static uint32_t write_count;
 static struct ingestion_transport fake_transport = {.write = on_write};
+static struct ingestion_transport fake_claim_transport = {
+	.write = on_write,
+	.claim = on_claim,
+	.commit = on_commit,
+};
+RING_BUF_DECLARE(claim_ring, 64);
+static uint32_t commit_count;
+static K_SEM_DEFINE(resume_sem, 0, 1);
+static struct ingestion_transport fake_resume_transport = {
+	.write = on_write,
+	.resume = on_resume,
+};
+/* Never done writing until stuck_sem is given, as a host that stopped reading */
+static struct ingestion_transport stuck_transport = {.write = on_stuck_write};
+static K_SEM_DEFINE(stuck_sem, 0, 1);
+static K_THREAD_STACK_DEFINE(stuck_workq_stack, 2048);
+static struct k_work_q stuck_workq;
+static uint8_t tx_log[2048];
+static uint32_t tx_log_len;
+static bool slow_handlers;
 
-static struct ingestion_rpc fake_rpc = {.on_command = on_command};
+static struct ingestion_rpc fake_rpc = {
+	.on_command = on_command,
+	.is_urgent = on_is_urgent,
+};
+/* Time in us the response to URGENT_ID was written at */
+static uint32_t urgent_answered_us;
 
 static ampoule_Command received;
 
@@ -51,24 +89,72 @@ static int on_write(void *context, uint8_t *data, uint16_t len)
 
 	memcpy(cb_data, data, len);
 	cb_data_len = len;
+	write_count++;
+
+	if (len >= sizeof(uint16_t) + INGESTION_FRAME_ID_SIZE &&
+	    (sys_get_be16(data) & INGESTION_FRAME_FLAG_ID) &&
+	    sys_get_be16(&data[sizeof(uint16_t)]) == URGENT_ID) {
+		urgent_answered_us = k_cyc_to_us_floor32(k_cycle_get_32());
+	}
+
+	/* Keep every write, pipelined responses are checked as a whole */
+	len = MIN(len, sizeof(tx_log) - tx_log_len);
+	memcpy(&tx_log[tx_log_len], data, len);
+	tx_log_len += len;
+
+	return len;
+}
+
+static int on_stuck_write(void *context, uint8_t *data, uint16_t len)
+{
+	k_sem_take(&stuck_sem, K_FOREVER);
 
 	return len;
 }
 
+static int on_claim(void *context, uint8_t **data, uint16_t len)
+{
+	return ring_buf_put_claim(&claim_ring, data, len);
+}
+
+static int on_commit(void *context, uint16_t len)
+{
+	commit_count++;
+
+	return ring_buf_put_finish(&claim_ring, len);
+}
+
+static void on_resume(void *context)
+{
+	k_sem_give(&resume_sem);
+}
+
 static int on_command(ampoule_Command *command, ampoule_Response *response)
 {
 	/* Buffers command received */
-	memcpy(command, &received, sizeof(ampoule_Command));
+	memcpy(&received, command, sizeof(ampoule_Command));
+	rpc_count++;
+
+	/* Emulate a handler driving a slow peripheral */
+	if (slow_handlers && command->opcode == ampoule_Opcode_SET_LED) {
+		k_sleep(K_MSEC(10));
+	}
 
 	/* Only responds pong */
 	response->opcode = ampoule_Opcode_PONG;
 
 	/* Cache our reception */
 	rpc_received = true;
+	k_sem_give(&rpc_sem);
 
 	return 0;
 }
 
+static bool on_is_urgent(bool ext, uint32_t opcode)
+{
+	return !ext && opcode == ampoule_Opcode_PING;
+}
+
 static void before(void *fixture)
 {
 	/* Reset the transport stubs */
@@ -79,6 +165,15 @@ static void before(void *fixture)
 	/* Reset the rpc stubs */
 	memset(&received, 0, sizeof(ampoule_Command));
 	rpc_received = true;
+	k_sem_reset(&rpc_sem);
+	rpc_count = 0;
+	write_count = 0;
+	commit_count = 0;
+	k_sem_reset(&resume_sem);
+	ring_buf_reset(&claim_ring);
+	tx_log_len = 0;
+	slow_handlers = false;
+	urgent_answered_us = 0;
 
 	/* Initialise the ingestion */
 	zassert_ok(ingestion_init(&ingestion, &fake_transport, &fake_rpc, NULL));
@@ -170,8 +265,1061 @@ ZTEST(in_tests, test_ingestion_timeout_allow_for_resending)
 	zassert_true(rpc_received);
 }
 
+ZTEST(in_tests, test_complete_packet_adds_no_latency)
+{
+	uint32_t start = k_cycle_get_32();
+
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+
+	uint32_t elapsed = k_cycle_get_32() - start;
+
+	/* Frame dispatch used to be delayed by a 1 ms sleep while waiting for the payload */
+	zassert_true(k_cyc_to_us_ceil32(elapsed) < USEC_PER_MSEC, "Frame took %u us",
+		     k_cyc_to_us_ceil32(elapsed));
+}
+
+ZTEST(in_tests, test_last_chunk_completes_packet_without_latency)
+{
+	for (uint32_t i = 0; i < valid_packet_len - 1; i++) {
+		ingestion_feed(&ingestion, &valid_packet[i], 1);
+		zassert_equal(k_sem_take(&rpc_sem, K_USEC(100)), -EAGAIN);
+	}
+
+	uint32_t start = k_cycle_get_32();
+
+	ingestion_feed(&ingestion, &valid_packet[valid_packet_len - 1], 1);
+
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+
+	uint32_t elapsed = k_cycle_get_32() - start;
+
+	zassert_true(k_cyc_to_us_ceil32(elapsed) < USEC_PER_MSEC, "Frame took %u us",
+		     k_cyc_to_us_ceil32(elapsed));
+}
+
+ZTEST(in_tests, test_back_to_back_packets_add_no_latency)
+{
+	const int count = 50;
+	uint32_t start = k_cycle_get_32();
+
+	for (int i = 0; i < count; i++) {
+		ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+		zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+	}
+
+	uint32_t elapsed = k_cycle_get_32() - start;
+
+	/* A per frame sleep would add at least count ms */
+	zassert_true(k_cyc_to_ms_ceil32(elapsed) < count, "%d frames took %u ms", count,
+		     k_cyc_to_ms_ceil32(elapsed));
+}
+
+ZTEST(in_tests, test_stress_back_to_back_packets_random_chunks)
+{
+	static uint8_t stream[256];
+	const uint32_t frames = 4000;
+	uint32_t frames_fed = 0;
+	uint32_t seed = 0xA5A5A5A5;
+
+	/* Alternate PING and SET_LED so frames have different sizes */
+	ampoule_Command commands[] = {
+		{.opcode = ampoule_Opcode_PING},
+		{.opcode = ampoule_Opcode_SET_LED,
+		 .which_operation = ampoule_Command_led_tag,
+		 .operation.led.color = ampoule_Led_Color_WHITE},
+	};
+
+	while (frames_fed < frames) {
+		uint32_t stream_len = 0;
+
+		/* Pack a handful of frames back to back */
+		while (frames_fed < frames && stream_len < sizeof(stream) - 32) {
+			ampoule_Command *command = &commands[frames_fed % ARRAY_SIZE(commands)];
+			pb_ostream_t ostream = pb_ostream_from_buffer(
+				&stream[stream_len + sizeof(uint16_t)],
+				sizeof(stream) - stream_len - sizeof(uint16_t));
+
+			zassert_true(pb_encode(&ostream, ampoule_Command_fields, command));
+			sys_put_be16(ostream.bytes_written, &stream[stream_len]);
+
+			stream_len += ostream.bytes_written + sizeof(uint16_t);
+			frames_fed++;
+		}
+
+		/* Feed it at random chunk boundaries */
+		for (uint32_t offset = 0; offset < stream_len;) {
+			seed = seed * 1103515245 + 12345;
+
+			uint32_t chunk = MIN(1 + (seed >> 16) % 64, stream_len - offset);
+
+			ingestion_feed(&ingestion, &stream[offset], chunk);
+			offset += chunk;
+
+			k_sleep(K_TICKS(1));
+		}
+	}
+
+	k_sleep(K_MSEC(1));
+
+	/* Every frame decoded, including the ones wrapping the end of the ring */
+	zassert_equal(rpc_count, frames, "Only %u frames out of %u", rpc_count, frames);
+	zassert_equal(write_count, frames);
+	zassert_equal(received.opcode, commands[(frames - 1) % ARRAY_SIZE(commands)].opcode);
+}
+
+static uint32_t build_batch(uint8_t *frame, size_t size, uint32_t count)
+{
+	ampoule_Command ping = {.opcode = ampoule_Opcode_PING};
+	pb_ostream_t ostream =
+		pb_ostream_from_buffer(&frame[sizeof(uint16_t)], size - sizeof(uint16_t));
+
+	for (uint32_t i = 0; i < count; i++) {
+		zassert_true(pb_encode_ex(&ostream, ampoule_Command_fields, &ping,
+					  PB_ENCODE_DELIMITED));
+	}
+
+	sys_put_be16(ostream.bytes_written | INGESTION_FRAME_FLAG_BATCH, &frame[0]);
+
+	return ostream.bytes_written + sizeof(uint16_t);
+}
+
+ZTEST(in_tests, test_batch_packet_dispatches_all_commands_with_one_write)
+{
+	uint8_t frame[128];
+	const uint32_t count = 16;
+	uint32_t frame_len = build_batch(frame, sizeof(frame), count);
+
+	ingestion_feed(&ingestion, frame, frame_len);
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(rpc_count, count);
+	zassert_equal(write_count, 1);
+
+	/* Response is one batch frame holding every response */
+	uint16_t header = sys_get_be16(cb_data);
+	zassert_true(header & INGESTION_FRAME_FLAG_BATCH);
+	zassert_equal(header & INGESTION_FRAME_SIZE_MASK, cb_data_len - sizeof(uint16_t));
+
+	pb_istream_t istream = pb_istream_from_buffer(&cb_data[sizeof(uint16_t)],
+						      cb_data_len - sizeof(uint16_t));
+	uint32_t responses = 0;
+
+	while (istream.bytes_left > 0) {
+		ampoule_Response response;
+
+		zassert_true(pb_decode_ex(&istream, ampoule_Response_fields, &response,
+					  PB_DECODE_DELIMITED));
+		zassert_equal(response.opcode, ampoule_Opcode_PONG);
+		responses++;
+	}
+
+	zassert_equal(responses, count);
+}
+
+ZTEST(in_tests, test_batch_malformed_command_answers_those_run)
+{
+	uint8_t frame[64];
+	const uint8_t malformed[] = {0x02, 0xFF, 0xFF};
+	uint8_t ping_len = valid_packet_len - sizeof(uint16_t);
+	uint32_t frame_len = build_batch(frame, sizeof(frame), 3);
+
+	/* A command failing to decode, then one that never runs */
+	memcpy(&frame[frame_len], malformed, sizeof(malformed));
+	frame_len += sizeof(malformed);
+	frame[frame_len++] = ping_len;
+	memcpy(&frame[frame_len], &valid_packet[sizeof(uint16_t)], ping_len);
+	frame_len += ping_len;
+	sys_put_be16((frame_len - sizeof(uint16_t)) | INGESTION_FRAME_FLAG_BATCH, frame);
+
+	ingestion_feed(&ingestion, frame, frame_len);
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(rpc_count, 3);
+	zassert_equal(write_count, 1);
+
+	/* Responses of the commands run, then an error standing for the malformed one */
+	pb_istream_t istream = pb_istream_from_buffer(&cb_data[sizeof(uint16_t)],
+						      cb_data_len - sizeof(uint16_t));
+	ampoule_Response responses[4];
+	uint32_t count = 0;
+
+	while (istream.bytes_left > 0 && count < ARRAY_SIZE(responses)) {
+		zassert_true(pb_decode_ex(&istream, ampoule_Response_fields, &responses[count],
+					  PB_DECODE_DELIMITED));
+		count++;
+	}
+
+	zassert_equal(count, 4);
+	zassert_equal(istream.bytes_left, 0);
+	zassert_equal(responses[2].opcode, ampoule_Opcode_PONG);
+	zassert_false(responses[3].success);
+	zassert_not_equal(responses[3].opcode, ampoule_Opcode_PONG);
+}
+
+ZTEST(in_tests, test_batch_packet_increases_commands_per_second)
+{
+	uint8_t frame[256];
+	const uint32_t count = 64;
+	const uint32_t baudrate = 115200;
+	uint32_t frame_len = build_batch(frame, sizeof(frame), count);
+
+	/* Single frames, host side cost is the bytes on the wire both ways */
+	uint32_t start = k_cycle_get_32();
+	uint32_t single_bytes = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+		zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+		single_bytes += valid_packet_len + cb_data_len;
+	}
+
+	uint32_t single_cycles = k_cycle_get_32() - start;
+	uint32_t single_writes = write_count;
+
+	zassert_equal(rpc_count, count);
+
+	/* Same commands in one batch frame */
+	rpc_count = 0;
+	write_count = 0;
+	start = k_cycle_get_32();
+
+	ingestion_feed(&ingestion, frame, frame_len);
+	k_sleep(K_MSEC(1));
+
+	uint32_t batch_cycles = k_cycle_get_32() - start;
+	uint32_t batch_bytes = frame_len + cb_data_len;
+
+	zassert_equal(rpc_count, count);
+
+	/* 10 bits per byte on an 8N1 link */
+	uint32_t single_cps = (uint64_t)count * baudrate / (single_bytes * 10);
+	uint32_t batch_cps = (uint64_t)count * baudrate / (batch_bytes * 10);
+
+	TC_PRINT("single: %u writes, %u bytes, %u cycles, %u commands/s at %u baud\n",
+		 single_writes, single_bytes, single_cycles, single_cps, baudrate);
+	TC_PRINT("batch: %u writes, %u bytes, %u cycles, %u commands/s at %u baud\n", write_count,
+		 batch_bytes, batch_cycles, batch_cps, baudrate);
+
+	/* Cycles are only meaningful on hardware, native_sim time stands still while running */
+	zassert_equal(write_count, 1);
+	zassert_true(batch_cps > single_cps);
+}
+
+ZTEST(in_tests, test_ingestion_claim_commit_must_be_paired)
+{
+	struct ingestion_transport claim_only = {.write = on_write, .claim = on_claim};
+
+	zassert_equal(ingestion_init(&ingestion, &claim_only, &fake_rpc, NULL), -EINVAL);
+}
+
+ZTEST(in_tests, test_response_encoded_in_place_in_transport)
+{
+	uint8_t response[sizeof(cb_data)];
+	uint8_t *data;
+
+	/* Reference response through the write fallback */
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+	k_sleep(K_MSEC(1));
+	zassert_true(cb_called);
+
+	/* Move the ring close to its end so the response wraps, header included */
+	zassert_equal(ring_buf_put_claim(&claim_ring, &data, ring_buf_capacity_get(&claim_ring) - 1),
+		      ring_buf_capacity_get(&claim_ring) - 1);
+	zassert_ok(ring_buf_put_finish(&claim_ring, ring_buf_capacity_get(&claim_ring) - 1));
+	ring_buf_get(&claim_ring, NULL, ring_buf_capacity_get(&claim_ring) - 1);
+
+	cb_called = false;
+	zassert_ok(ingestion_init(&ingestion, &fake_claim_transport, &fake_rpc, NULL));
+
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+	k_sleep(K_MSEC(1));
+
+	/* Response went through claim/commit only, in a single commit */
+	zassert_false(cb_called);
+	zassert_equal(commit_count, 1);
+	zassert_equal(ring_buf_get(&claim_ring, response, sizeof(response)), cb_data_len);
+	zassert_mem_equal(response, cb_data, cb_data_len);
+}
+
+/* Request carrying id, with flags on top of INGESTION_FRAME_FLAG_ID */
+static uint32_t build_request(uint8_t *frame, size_t size, uint16_t flags, uint16_t id,
+			      ampoule_Opcode opcode)
+{
+	ampoule_Command command = {.opcode = opcode};
+	uint32_t header_size = sizeof(uint16_t) + INGESTION_FRAME_ID_SIZE;
+	pb_ostream_t ostream = pb_ostream_from_buffer(&frame[header_size], size - header_size);
+
+	zassert_true(pb_encode(&ostream, ampoule_Command_fields, &command));
+
+	sys_put_be16((ostream.bytes_written + INGESTION_FRAME_ID_SIZE) | INGESTION_FRAME_FLAG_ID |
+			     flags,
+		     &frame[0]);
+	sys_put_be16(id, &frame[sizeof(uint16_t)]);
+
+	return ostream.bytes_written + header_size;
+}
+
+/* Walks the responses in tx_log, returns how many were found and their ids in order */
+static uint32_t parse_responses(uint16_t *ids, uint32_t max)
+{
+	uint32_t count = 0;
+
+	for (uint32_t offset = 0; offset < tx_log_len && count < max;) {
+		uint16_t header = sys_get_be16(&tx_log[offset]);
+		uint16_t size = header & INGESTION_FRAME_SIZE_MASK;
+		ampoule_Response response;
+
+		zassert_true(header & INGESTION_FRAME_FLAG_ID);
+		ids[count++] = sys_get_be16(&tx_log[offset + sizeof(uint16_t)]);
+
+		pb_istream_t istream = pb_istream_from_buffer(
+			&tx_log[offset + sizeof(uint16_t) + INGESTION_FRAME_ID_SIZE],
+			size - INGESTION_FRAME_ID_SIZE);
+		zassert_true(pb_decode(&istream, ampoule_Response_fields, &response));
+		zassert_equal(response.opcode, ampoule_Opcode_PONG);
+
+		offset += size + sizeof(uint16_t);
+	}
+
+	return count;
+}
+
+ZTEST(in_tests, test_request_id_is_echoed)
+{
+	uint8_t frame[32];
+	uint16_t id;
+
+	ingestion_feed(&ingestion, frame,
+		       build_request(frame, sizeof(frame), 0, 0xBEEF, ampoule_Opcode_PING));
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(parse_responses(&id, 1), 1);
+	zassert_equal(id, 0xBEEF);
+}
+
+ZTEST(in_tests, test_pipelined_requests_matched_by_id)
+{
+	static uint8_t stream[1024];
+	const uint16_t count = 48;
+	uint16_t ids[48];
+	uint32_t stream_len = 0;
+
+	slow_handlers = true;
+
+	/* Every eighth request hits a slow handler */
+	for (uint16_t id = 0; id < count; id++) {
+		ampoule_Opcode opcode = id % 8 == 0 ? ampoule_Opcode_SET_LED : ampoule_Opcode_PING;
+
+		stream_len += build_request(&stream[stream_len], sizeof(stream) - stream_len, 0,
+					    id, opcode);
+	}
+
+	/* Host pipelines them all without waiting for responses */
+	for (uint32_t offset = 0; offset < stream_len; offset += 64) {
+		ingestion_feed(&ingestion, &stream[offset], MIN(64, stream_len - offset));
+		k_sleep(K_TICKS(1));
+	}
+
+	k_sleep(K_MSEC(100));
+
+	zassert_equal(parse_responses(ids, count), count);
+
+	/* Every response matches exactly one request */
+	for (uint16_t id = 0; id < count; id++) {
+		uint32_t matches = 0;
+
+		for (uint16_t i = 0; i < count; i++) {
+			matches += ids[i] == id;
+		}
+
+		zassert_equal(matches, 1, "Request %u answered %u times", id, matches);
+	}
+
+#if defined(CONFIG_AMPOULE_INGESTION_PIPELINE)
+	/* Fast requests overtook the slow one they were queued behind */
+	zassert_not_equal(ids[0], 0, "PING was held behind a slow handler");
+#endif
+}
+
+ZTEST(in_tests, test_frames_return_to_pool)
+{
+	static uint8_t stream[256];
+	const uint8_t malformed[] = {0x00, 0x02, 0xFF, 0xFF, 0x40, 0x01, 0x00};
+	uint32_t stream_len = 0;
+
+	zassert_equal(ingestion_frames_free(), CONFIG_AMPOULE_INGESTION_FRAME_POOL_SIZE);
+
+	slow_handlers = true;
+
+	/* A slow request, a batch, then frames failing to decode */
+	stream_len += build_request(stream, sizeof(stream), 0, 1, ampoule_Opcode_SET_LED);
+	stream_len += build_batch(&stream[stream_len], sizeof(stream) - stream_len, 4);
+	memcpy(&stream[stream_len], malformed, sizeof(malformed));
+	stream_len += sizeof(malformed);
+
+	ingestion_feed(&ingestion, stream, stream_len);
+	k_sleep(K_MSEC(1));
+
+	/* The slow request holds its frame until it is answered */
+	zassert_true(ingestion_frames_free() < CONFIG_AMPOULE_INGESTION_FRAME_POOL_SIZE);
+
+	k_sleep(K_MSEC(50));
+
+	zassert_equal(rpc_count, 5);
+	zassert_equal(write_count, 2);
+	zassert_equal(ingestion_frames_free(), CONFIG_AMPOULE_INGESTION_FRAME_POOL_SIZE);
+}
+
+ZTEST(in_tests, test_urgent_request_overtakes_queued_frames)
+{
+	static uint8_t stream[128];
+	uint32_t stream_len = 0;
+	uint16_t ids[5];
+
+	if (!IS_ENABLED(CONFIG_AMPOULE_INGESTION_PRIORITY)) {
+		ztest_test_skip();
+	}
+
+	slow_handlers = true;
+
+	/* Slow requests, then a PING queued behind them, all in the ring at once */
+	for (uint16_t id = 0; id < 4; id++) {
+		stream_len += build_request(&stream[stream_len], sizeof(stream) - stream_len, 0,
+					    id, ampoule_Opcode_SET_LED);
+	}
+	stream_len += build_request(&stream[stream_len], sizeof(stream) - stream_len, 0,
+				    URGENT_ID, ampoule_Opcode_PING);
+
+	ingestion_feed(&ingestion, stream, stream_len);
+	k_sleep(K_MSEC(60));
+
+	/* The PING goes first, the others keep their order and are answered once */
+	zassert_equal(parse_responses(ids, ARRAY_SIZE(ids)), ARRAY_SIZE(ids));
+	zassert_equal(ids[0], URGENT_ID);
+	for (uint16_t id = 0; id < 4; id++) {
+		zassert_equal(ids[id + 1], id);
+	}
+	zassert_equal(rpc_count, 5);
+}
+
+ZTEST(in_tests, test_urgent_latency_under_bulk_load)
+{
+	static uint8_t stream[256];
+	const uint32_t queued = 16;
+	const uint32_t probes = 8;
+	uint32_t worst_us = 0;
+
+	slow_handlers = true;
+
+	for (uint32_t probe = 0; probe < probes; probe++) {
+		uint32_t stream_len = 0;
+
+		tx_log_len = 0;
+		urgent_answered_us = 0;
+
+		for (uint16_t id = 0; id < queued; id++) {
+			stream_len += build_request(&stream[stream_len],
+						    sizeof(stream) - stream_len, 0, id,
+						    ampoule_Opcode_SET_LED);
+		}
+
+		/* The handler is saturated, the PING lands at a different point of each drain */
+		ingestion_feed(&ingestion, stream, stream_len);
+		k_sleep(K_USEC(probe * 1500));
+
+		stream_len =
+			build_request(stream, sizeof(stream), 0, URGENT_ID, ampoule_Opcode_PING);
+		uint32_t sent_us = k_cyc_to_us_floor32(k_cycle_get_32());
+
+		ingestion_feed(&ingestion, stream, stream_len);
+
+		/* Everything drains before the next probe */
+		k_sleep(K_MSEC(10 * queued + 20));
+
+		zassert_not_equal(urgent_answered_us, 0, "Probe %u unanswered", probe);
+		worst_us = MAX(worst_us, urgent_answered_us - sent_us);
+	}
+
+	TC_PRINT("Urgent PING behind %u slow requests: worst latency %u us\n", queued, worst_us);
+
+#if defined(CONFIG_AMPOULE_INGESTION_PRIORITY)
+	/* At most the slow request in progress is ahead of it, not the queue */
+	zassert_true(worst_us < 2 * 10 * USEC_PER_MSEC, "Worst latency %u us", worst_us);
+#endif
+}
+
+ZTEST(in_tests, test_reset_answers_received_frames_and_drops_partial)
+{
+	static uint8_t stream[64];
+	uint32_t stream_len;
+	uint16_t id;
+
+	slow_handlers = true;
+
+	/* A slow request, then the start of a frame the peer never finishes */
+	stream_len = build_request(stream, sizeof(stream), 0, 7, ampoule_Opcode_SET_LED);
+	memcpy(&stream[stream_len], valid_packet, valid_packet_len - 1);
+	stream_len += valid_packet_len - 1;
+
+	ingestion_feed(&ingestion, stream, stream_len);
+
+	zassert_ok(ingestion_reset(&ingestion));
+
+	/* The slow request was answered before the reset returned */
+	zassert_equal(rpc_count, 1);
+	zassert_equal(parse_responses(&id, 1), 1);
+	zassert_equal(id, 7);
+	zassert_equal(ingestion_rx_space(&ingestion), INGESTION_PACKET_MAX_SIZE);
+
+	/* The next peer starts on a frame boundary, without waiting for the timeout */
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(rpc_count, 2);
+	zassert_equal(ingestion_frames_free(), CONFIG_AMPOULE_INGESTION_FRAME_POOL_SIZE);
+}
+
+ZTEST(in_tests, test_ext_frame_without_handler_is_not_supported)
+{
+	uint8_t frame[32];
+	ampoule_ExtCommand command = {.opcode = ampoule_ExtOpcode_STRIP_PRESENT};
+	ampoule_ExtResponse response;
+	pb_ostream_t ostream = pb_ostream_from_buffer(&frame[sizeof(uint16_t)],
+						      sizeof(frame) - sizeof(uint16_t));
+
+	zassert_true(pb_encode(&ostream, ampoule_ExtCommand_fields, &command));
+	sys_put_be16(ostream.bytes_written | INGESTION_FRAME_FLAG_EXT, &frame[0]);
+
+	ingestion_feed(&ingestion, frame, ostream.bytes_written + sizeof(uint16_t));
+	k_sleep(K_MSEC(1));
+
+	zassert_true(cb_called);
+	zassert_true(sys_get_be16(cb_data) & INGESTION_FRAME_FLAG_EXT);
+
+	pb_istream_t istream = pb_istream_from_buffer(&cb_data[sizeof(uint16_t)],
+						      cb_data_len - sizeof(uint16_t));
+	zassert_true(pb_decode(&istream, ampoule_ExtResponse_fields, &response));
+	zassert_equal(response.opcode, ampoule_ExtOpcode_STRIP_PRESENT);
+	zassert_false(response.success);
+	zassert_equal(response.error, -ENOTSUP);
+}
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+/* Counters live as long as the instance, tests look at what changed while they ran */
+static struct ingestion_stats stats_snapshot(void)
+{
+	struct ingestion_stats stats;
+	const char *name;
+
+	zassert_ok(ingestion_stats_get(0, &name, &stats));
+	zassert_str_equal(name, "in_tests");
+
+	return stats;
+}
+
+static uint32_t stats_latency_total(const struct ingestion_stats *stats)
+{
+	uint32_t total = 0;
+
+	for (size_t i = 0; i < INGESTION_STATS_LATENCY_BUCKETS; i++) {
+		total += stats->latency[i];
+	}
+
+	return total;
+}
+
+ZTEST(in_tests, test_stats_count_frames_and_latency)
+{
+	struct ingestion_stats before = stats_snapshot();
+
+	for (int i = 0; i < 10; i++) {
+		ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+		zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+	}
+	k_sleep(K_MSEC(1));
+
+	struct ingestion_stats after = stats_snapshot();
+
+	zassert_equal(after.frames_ok - before.frames_ok, 10);
+	/* Every decoded frame lands in exactly one latency bucket */
+	zassert_equal(stats_latency_total(&after) - stats_latency_total(&before), 10);
+	zassert_equal(after.decode_errors, before.decode_errors);
+	zassert_equal(after.bytes_dropped, before.bytes_dropped);
+}
+
+ZTEST(in_tests, test_stats_count_dropped_bytes)
+{
+	static uint8_t burst[INGESTION_PACKET_MAX_SIZE + 64];
+	struct ingestion_stats before = stats_snapshot();
+
+	/* Announces a frame larger than the ring, then overflows it */
+	memset(burst, 0, sizeof(burst));
+	sys_put_be16(INGESTION_FRAME_SIZE_MASK, burst);
+
+	ingestion_feed(&ingestion, burst, sizeof(burst));
+	k_sleep(K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS + 1));
+
+	struct ingestion_stats after = stats_snapshot();
+
+	zassert_equal(after.bytes_dropped - before.bytes_dropped,
+		      sizeof(burst) - sizeof(ingestion.rx_buffer));
+	zassert_equal(after.timeouts - before.timeouts, 1);
+	zassert_equal(after.frames_ok, before.frames_ok);
+}
+
+ZTEST(in_tests, test_stats_count_timeouts)
+{
+	struct ingestion_stats before = stats_snapshot();
+
+	ingestion_feed(&ingestion, valid_packet, sizeof(uint16_t));
+	k_sleep(K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS + 1));
+
+	struct ingestion_stats after = stats_snapshot();
+
+	zassert_equal(after.timeouts - before.timeouts, 1);
+	zassert_equal(after.frames_ok, before.frames_ok);
+}
+
+ZTEST(in_tests, test_stats_count_decode_errors)
+{
+	/* Truncated varint, then an identified frame too short for its id */
+	uint8_t malformed[] = {0x00, 0x02, 0xFF, 0xFF, 0x40, 0x01, 0x00};
+	struct ingestion_stats before = stats_snapshot();
+
+	ingestion_feed(&ingestion, malformed, sizeof(malformed));
+	k_sleep(K_MSEC(1));
+
+	struct ingestion_stats after = stats_snapshot();
+
+	zassert_equal(after.decode_errors - before.decode_errors, 2);
+	zassert_equal(after.frames_ok, before.frames_ok);
+	zassert_false(cb_called);
+
+	/* Following frames are still decoded */
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+}
+
+ZTEST(in_tests, test_stats_instance_registered_once)
+{
+	struct ingestion_stats stats;
+	const char *name;
+
+	zassert_equal(ingestion_stats_register(&ingestion, "in_tests"), -EALREADY);
+	zassert_equal(ingestion_stats_get(1, &name, &stats), -ENOENT);
+}
+
+ZTEST(in_tests, test_command_stats)
+{
+	ampoule_ExtCommand command = {
+		.opcode = ampoule_ExtOpcode_STATS,
+		.which_operation = ampoule_ExtCommand_stats_request_tag,
+		.operation.stats_request.instance = 0,
+	};
+	ampoule_ExtResponse response;
+
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+	k_sleep(K_MSEC(1));
+
+	struct ingestion_stats stats = stats_snapshot();
+
+	zassert_ok(command_ext_process(&command, &response));
+	zassert_true(response.success);
+	zassert_equal(response.which_result, ampoule_ExtResponse_stats_tag);
+	zassert_str_equal(response.result.stats.name, "in_tests");
+	zassert_equal(response.result.stats.frames_ok, stats.frames_ok);
+	zassert_equal(response.result.stats.timeouts, stats.timeouts);
+	zassert_equal(response.result.stats.latency_count, INGESTION_STATS_LATENCY_BUCKETS);
+	zassert_mem_equal(response.result.stats.latency, stats.latency, sizeof(stats.latency));
+
+	command.operation.stats_request.instance = 1;
+	zassert_equal(command_ext_process(&command, &response), -ENOENT);
+	zassert_false(response.success);
+}
+#endif
+
+ZTEST(in_tests, test_credit_advertises_rx_space)
+{
+	uint8_t frame[32];
+	uint8_t *response = &cb_data[sizeof(uint16_t) + INGESTION_FRAME_ID_SIZE];
+
+	ingestion_feed(&ingestion, frame,
+		       build_request(frame, sizeof(frame), INGESTION_FRAME_FLAG_CREDIT, 0x1234,
+				     ampoule_Opcode_PING));
+	k_sleep(K_MSEC(1));
+
+	uint16_t header = sys_get_be16(cb_data);
+
+	/* Flags are echoed, the credit follows the id */
+	zassert_equal(header & INGESTION_FRAME_FLAGS_MASK,
+		      INGESTION_FRAME_FLAG_ID | INGESTION_FRAME_FLAG_CREDIT);
+	zassert_equal(header & INGESTION_FRAME_SIZE_MASK, cb_data_len - sizeof(uint16_t));
+	zassert_equal(sys_get_be16(&cb_data[sizeof(uint16_t)]), 0x1234);
+	zassert_equal(sys_get_be16(response), INGESTION_PACKET_MAX_SIZE);
+
+	ampoule_Response pong;
+	pb_istream_t istream = pb_istream_from_buffer(
+		&response[INGESTION_FRAME_CREDIT_SIZE],
+		cb_data_len - (response - cb_data) - INGESTION_FRAME_CREDIT_SIZE);
+
+	zassert_true(pb_decode(&istream, ampoule_Response_fields, &pong));
+	zassert_equal(pong.opcode, ampoule_Opcode_PONG);
+}
+
+/* Every eighth frame hits a slow handler, long enough for a saturating feed to fill the ring */
+static uint32_t build_saturating_stream(uint8_t *stream, size_t size, uint16_t flags,
+					uint16_t frames)
+{
+	uint32_t len = 0;
+
+	for (uint16_t id = 0; id < frames; id++) {
+		ampoule_Opcode opcode = id % 8 == 7 ? ampoule_Opcode_SET_LED : ampoule_Opcode_PING;
+
+		len += build_request(&stream[len], size - len, flags, id, opcode);
+	}
+
+	return len;
+}
+
+ZTEST(in_tests, test_rx_pause_resumes_once_space_frees)
+{
+	static uint8_t stream[2 * INGESTION_PACKET_MAX_SIZE];
+	uint32_t len = build_saturating_stream(stream, sizeof(stream), 0, 320);
+	uint32_t offset = 0;
+
+	slow_handlers = true;
+	zassert_ok(ingestion_init(&ingestion, &fake_resume_transport, &fake_rpc, NULL));
+
+	/* Feed only what fits until the ring is full */
+	while (ingestion_rx_space(&ingestion) > 0) {
+		uint32_t chunk = MIN(ingestion_rx_space(&ingestion), len - offset);
+
+		ingestion_feed(&ingestion, &stream[offset], chunk);
+		offset += chunk;
+	}
+
+	zassert_true(offset < len, "Stream fit in the ring");
+	zassert_true(ingestion_rx_pause(&ingestion, 1));
+	zassert_equal(k_sem_take(&resume_sem, K_NO_WAIT), -EBUSY);
+
+	/* Resumed once the slow handler returns and frames are consumed */
+	zassert_ok(k_sem_take(&resume_sem, K_MSEC(50)));
+	zassert_true(ingestion_rx_space(&ingestion) > 0);
+
+	/* Space already free, nothing to wait for */
+	zassert_false(ingestion_rx_pause(&ingestion, 1));
+	k_sleep(K_MSEC(50));
+	zassert_equal(k_sem_take(&resume_sem, K_NO_WAIT), -EBUSY);
+}
+
+ZTEST(in_tests, test_saturating_feed_with_pause_loses_nothing)
+{
+	static uint8_t stream[2 * INGESTION_PACKET_MAX_SIZE];
+	static uint16_t ids[320];
+	const uint16_t frames = ARRAY_SIZE(ids);
+	uint32_t len = build_saturating_stream(stream, sizeof(stream), 0, frames);
+	uint32_t pauses = 0;
+
+	slow_handlers = true;
+	zassert_ok(ingestion_init(&ingestion, &fake_resume_transport, &fake_rpc, NULL));
+
+	/* Transport side of flow control, reads stop while the ring is full */
+	for (uint32_t offset = 0; offset < len;) {
+		uint32_t chunk = MIN(ingestion_rx_space(&ingestion), len - offset);
+
+		if (chunk == 0) {
+			if (ingestion_rx_pause(&ingestion, 1)) {
+				zassert_ok(k_sem_take(&resume_sem, K_MSEC(50)));
+				pauses++;
+			}
+			continue;
+		}
+
+		zassert_ok(ingestion_feed(&ingestion, &stream[offset], chunk));
+		offset += chunk;
+	}
+
+	k_sleep(K_MSEC(100));
+
+	TC_PRINT("%u frames, %u bytes, %u pauses\n", frames, len, pauses);
+
+	zassert_true(pauses > 0, "The feed never saturated the ring");
+	zassert_equal(rpc_count, frames);
+	zassert_equal(parse_responses(ids, frames), frames);
+}
+
+ZTEST(in_tests, test_saturating_host_following_credits_loses_nothing)
+{
+	static uint8_t stream[2 * INGESTION_PACKET_MAX_SIZE];
+	static uint32_t sent_at[224];
+	const uint16_t frames = ARRAY_SIZE(sent_at);
+	uint32_t len = build_saturating_stream(stream, sizeof(stream),
+					       INGESTION_FRAME_FLAG_CREDIT, frames);
+	uint32_t credit = INGESTION_PACKET_MAX_SIZE;
+	uint32_t credit_sent_at = 0;
+	uint32_t parsed = 0;
+	uint32_t stalls = 0;
+	uint16_t id = 0;
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	struct ingestion_stats before = stats_snapshot();
+#endif
+
+	slow_handlers = true;
+
+	/* Host side of flow control, a frame is only sent if the last advertised space, minus
+	 * what was sent since its request, holds it. Nothing ever reads the RX space directly.
+	 */
+	for (uint32_t offset = 0; offset < len;) {
+		uint16_t size = (sys_get_be16(&stream[offset]) & INGESTION_FRAME_SIZE_MASK) +
+				sizeof(uint16_t);
+
+		while (parsed < tx_log_len) {
+			uint16_t header = sys_get_be16(&tx_log[parsed]);
+			uint8_t *fields = &tx_log[parsed + sizeof(uint16_t)];
+
+			zassert_true(header & INGESTION_FRAME_FLAG_CREDIT);
+			credit = sys_get_be16(&fields[INGESTION_FRAME_ID_SIZE]);
+			credit_sent_at = sent_at[sys_get_be16(fields)];
+
+			parsed += (header & INGESTION_FRAME_SIZE_MASK) + sizeof(uint16_t);
+		}
+
+		if (credit < offset - credit_sent_at + size) {
+			stalls++;
+			k_sleep(K_MSEC(1));
+			continue;
+		}
+
+		zassert_ok(ingestion_feed(&ingestion, &stream[offset], size));
+		offset += size;
+		sent_at[id++] = offset;
+	}
+
+	k_sleep(K_MSEC(100));
+
+	TC_PRINT("%u frames, %u bytes, %u stalls\n", frames, len, stalls);
+
+	zassert_true(stalls > 0, "The host never ran out of credits");
+	zassert_equal(rpc_count, frames, "Only %u frames out of %u", rpc_count, frames);
+	zassert_true(tx_log_len < sizeof(tx_log));
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	zassert_equal(stats_snapshot().bytes_dropped, before.bytes_dropped);
+#endif
+}
+
+ZTEST(in_tests, test_exhausted_pool_drops_frames_in_bounded_time)
+{
+	static struct ingestion stuck;
+
+	/* Only a single frame is held by the stuck instance at once */
+	if (CONFIG_AMPOULE_INGESTION_FRAME_POOL_SIZE != 1) {
+		ztest_test_skip();
+	}
+
+	k_work_queue_start(&stuck_workq, stuck_workq_stack,
+			   K_THREAD_STACK_SIZEOF(stuck_workq_stack), K_PRIO_PREEMPT(1), NULL);
+	zassert_ok(ingestion_init(&stuck, &stuck_transport, &fake_rpc, NULL));
+	ingestion_set_workq(&stuck, &stuck_workq);
+
+	ingestion_feed(&stuck, valid_packet, valid_packet_len);
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(10)));
+	zassert_equal(ingestion_frames_free(), 0);
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	uint32_t dropped = stats_snapshot().frames_dropped;
+#endif
+
+	/* Its frame never returns, this instance gives up on its own rather than stalling */
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+	k_sleep(K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS + 10));
+
+	zassert_equal(rpc_count, 1);
+	zassert_equal(write_count, 0);
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	zassert_equal(stats_snapshot().frames_dropped - dropped, 1);
+#endif
+
+	/* Back to answering once the frame is returned */
+	k_sem_give(&stuck_sem);
+	k_sleep(K_MSEC(1));
+	zassert_equal(ingestion_frames_free(), 1);
+
+	ingestion_feed(&ingestion, valid_packet, valid_packet_len);
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(rpc_count, 2);
+	zassert_equal(write_count, 1);
+}
+
+/* Reference encoder, appends the CRC and the delimiter */
+static uint32_t cobs_encode(uint8_t *out, const uint8_t *frame, uint32_t len)
+{
+	uint8_t data[INGESTION_RESPONSE_MAX_SIZE];
+	uint32_t code_index = 0;
+	uint32_t size = 1;
+
+	memcpy(data, frame, len);
+	sys_put_be16(crc16_itu_t(0xFFFF, data, len), &data[len]);
+	len += INGESTION_COBS_CRC_SIZE;
+
+	for (uint32_t i = 0; i < len; i++) {
+		if (data[i] != 0) {
+			out[size++] = data[i];
+		}
+
+		if (data[i] == 0 || size - code_index == 0xFF) {
+			out[code_index] = size - code_index;
+			code_index = size++;
+		}
+	}
+
+	out[code_index] = size - code_index;
+	out[size++] = 0;
+
+	return size;
+}
+
+/* Reference decoder, checks and strips the CRC, returns the frame size */
+static uint32_t cobs_decode(uint8_t *frame, const uint8_t *data, uint32_t len)
+{
+	uint32_t size = 0;
+
+	zassert_equal(data[len - 1], 0, "Frame isn't delimited");
+
+	for (uint32_t i = 0; i < len - 1;) {
+		uint8_t code = data[i++];
+
+		zassert_not_equal(code, 0);
+		for (uint8_t j = 1; j < code; j++) {
+			frame[size++] = data[i++];
+		}
+
+		if (code != 0xFF && i < len - 1) {
+			frame[size++] = 0;
+		}
+	}
+
+	zassert_true(size > INGESTION_COBS_CRC_SIZE);
+	zassert_equal(crc16_itu_t(0xFFFF, frame, size), 0, "Bad CRC");
+
+	return size - INGESTION_COBS_CRC_SIZE;
+}
+
+ZTEST(in_tests, test_cobs_frame_is_answered_in_cobs)
+{
+	uint8_t encoded[32];
+	uint8_t response[32];
+
+	zassert_ok(ingestion_set_framing(&ingestion, INGESTION_FRAMING_COBS));
+
+	ingestion_feed(&ingestion, encoded, cobs_encode(encoded, valid_packet, valid_packet_len));
+	zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)));
+	k_sleep(K_MSEC(1));
+
+	uint32_t size = cobs_decode(response, cb_data, cb_data_len);
+
+	zassert_equal(sys_get_be16(response) & INGESTION_FRAME_SIZE_MASK, size - sizeof(uint16_t));
+
+	ampoule_Response pong;
+	pb_istream_t istream =
+		pb_istream_from_buffer(&response[sizeof(uint16_t)], size - sizeof(uint16_t));
+
+	zassert_true(pb_decode(&istream, ampoule_Response_fields, &pong));
+	zassert_equal(pong.opcode, ampoule_Opcode_PONG);
+}
+
+ZTEST(in_tests, test_cobs_resyncs_at_next_delimiter)
+{
+	uint8_t encoded[32];
+	uint8_t corrupted[32];
+	uint32_t len = cobs_encode(encoded, valid_packet, valid_packet_len);
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	struct ingestion_stats before = stats_snapshot();
+#endif
+
+	zassert_ok(ingestion_set_framing(&ingestion, INGESTION_FRAMING_COBS));
+
+	/* Every single byte corruption or loss, each followed right away by a valid frame */
+	for (uint32_t i = 0; i < len - 1; i++) {
+		memcpy(corrupted, encoded, len);
+		corrupted[i] ^= 0x5A;
+		ingestion_feed(&ingestion, corrupted, len);
+
+		memmove(&corrupted[i], &encoded[i + 1], len - i - 1);
+		ingestion_feed(&ingestion, corrupted, len - 1);
+
+		ingestion_feed(&ingestion, encoded, len);
+		zassert_ok(k_sem_take(&rpc_sem, K_MSEC(1)), "Lost the frame after byte %u", i);
+		zassert_equal(k_sem_take(&rpc_sem, K_USEC(100)), -EAGAIN,
+			      "Corrupted frame %u was handled", i);
+	}
+
+	zassert_equal(rpc_count, len - 1);
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	struct ingestion_stats after = stats_snapshot();
+
+	/* Rejected before reaching the decoder, and a corrupted zero ends a frame early */
+	zassert_true(after.crc_errors - before.crc_errors >= 2 * (len - 1));
+	zassert_equal(after.decode_errors, before.decode_errors);
+	zassert_equal(after.timeouts, before.timeouts);
+#endif
+}
+
+ZTEST(in_tests, test_cobs_frames_survive_random_chunks)
+{
+	static uint8_t stream[1024];
+	uint8_t frame[INGESTION_RESPONSE_MAX_SIZE];
+	uint32_t stream_len = 0;
+	uint32_t frames = 0;
+	uint32_t seed = 0x5EED;
+
+	zassert_ok(ingestion_set_framing(&ingestion, INGESTION_FRAMING_COBS));
+
+	/* Identified requests, their ids are full of zeros and 0xFF to encode */
+	while (stream_len < sizeof(stream) - 32) {
+		uint32_t len = build_request(frame, sizeof(frame), 0, frames << 8,
+					     ampoule_Opcode_PING);
+
+		stream_len += cobs_encode(&stream[stream_len], frame, len);
+		frames++;
+	}
+
+	for (uint32_t offset = 0; offset < stream_len;) {
+		seed = seed * 1103515245 + 12345;
+
+		uint32_t chunk = MIN(1 + (seed >> 16) % 16, stream_len - offset);
+
+		ingestion_feed(&ingestion, &stream[offset], chunk);
+		offset += chunk;
+	}
+
+	k_sleep(K_MSEC(10));
+
+	zassert_equal(rpc_count, frames);
+	zassert_equal(write_count, frames);
+}
+
 /******************************************************************************/
 /* Local Function Definitions                                                 */
 /******************************************************************************/
+static void *setup(void)
+{
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	/* Published once, ingestion_init() in before() keeps the counters */
+	zassert_ok(ingestion_init(&ingestion, &fake_transport, &fake_rpc, NULL));
+	zassert_ok(ingestion_stats_register(&ingestion, "in_tests"));
+#endif
+
+	return NULL;
+}
 
-ZTEST_SUITE(in_tests, NULL, NULL, before, NULL, NULL);
+ZTEST_SUITE(in_tests, NULL, setup, before, NULL, NULL);
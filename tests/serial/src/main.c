@@ -0,0 +1,348 @@
+/**
+ * @file main
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-02 11:03:12
+ * @brief Exercise the serial transport against an emulated UART
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/drivers/serial/uart_emul.h>
+#include <zephyr/sys/byteorder.h>
+#include "ampoule/ingestion.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define BURST_FRAMES 64
+#define ROUNDS       32
+
+/* Several times what the UART FIFO and the ingestion ring hold together */
+#define SATURATING_FRAMES 2048
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static const struct device *uart_dev = DEVICE_DT_GET(DT_NODELABEL(euart0));
+static const struct device *uart_devs[] = {
+	DEVICE_DT_GET(DT_NODELABEL(euart0)),
+	DEVICE_DT_GET(DT_NODELABEL(euart1)),
+};
+/* Served with COBS framing */
+static const struct device *cobs_uart_dev = DEVICE_DT_GET(DT_NODELABEL(euart2));
+
+static const uint8_t ping[] = {0, 2, 8, 1};
+static const uint8_t pong[] = {0, 4, 8, 2, 16, 1};
+/* The same, CRC appended and COBS encoded */
+static const uint8_t cobs_ping[] = {0x01, 0x06, 0x02, 0x08, 0x01, 0x73, 0x28, 0x00};
+static const uint8_t cobs_pong[] = {0x01, 0x08, 0x04, 0x08, 0x02, 0x10, 0x01, 0x7F, 0xE7, 0x00};
+
+static uint8_t burst[sizeof(ping) * BURST_FRAMES];
+/* PING padded with a field the decoder skips to fill the whole ingestion ring */
+static uint8_t large_ping[CONFIG_AMPOULE_INGESTION_RX_BUF_SIZE];
+static uint8_t saturating[sizeof(ping) * SATURATING_FRAMES];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static void *setup(void)
+{
+	for (size_t i = 0; i < sizeof(burst); i += sizeof(ping)) {
+		memcpy(&burst[i], ping, sizeof(ping));
+	}
+
+	for (size_t i = 0; i < sizeof(saturating); i += sizeof(ping)) {
+		memcpy(&saturating[i], ping, sizeof(ping));
+	}
+
+	/* Bytes of an unknown field 1000, its tag and length on two varint bytes each */
+	uint16_t tag = (1000 << 3) | 2;
+	uint16_t padding = sizeof(large_ping) - sizeof(ping) - 4;
+
+	memcpy(large_ping, ping, sizeof(ping));
+	sys_put_be16(sizeof(large_ping) - sizeof(uint16_t), large_ping);
+	large_ping[sizeof(ping)] = (tag & 0x7F) | 0x80;
+	large_ping[sizeof(ping) + 1] = tag >> 7;
+	large_ping[sizeof(ping) + 2] = (padding & 0x7F) | 0x80;
+	large_ping[sizeof(ping) + 3] = padding >> 7;
+	memset(&large_ping[sizeof(ping) + 4], 0xA5, padding);
+
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(uart_devs); i++) {
+		uart_emul_flush_rx_data(uart_devs[i]);
+		uart_emul_flush_tx_data(uart_devs[i]);
+	}
+
+	uart_emul_flush_rx_data(cobs_uart_dev);
+	uart_emul_flush_tx_data(cobs_uart_dev);
+}
+
+/* Pushes ROUNDS bursts of PING on the first links at once, returns frames/s */
+static uint32_t run_bursts(size_t links)
+{
+	static uint8_t responses[sizeof(pong) * BURST_FRAMES];
+	uint32_t received = 0;
+	uint32_t start = k_cycle_get_32();
+
+	for (uint32_t i = 0; i < ROUNDS; i++) {
+		uint32_t len[ARRAY_SIZE(uart_devs)] = {0};
+		uint32_t pending = links;
+
+		for (size_t link = 0; link < links; link++) {
+			uart_emul_put_rx_data(uart_devs[link], burst, sizeof(burst));
+		}
+
+		/* Wait for every burst to be answered */
+		for (int retries = 0; retries < 100 && pending > 0; retries++) {
+			k_sleep(K_USEC(100));
+
+			for (size_t link = 0; link < links; link++) {
+				if (len[link] == sizeof(responses)) {
+					continue;
+				}
+
+				len[link] += uart_emul_get_tx_data(uart_devs[link], responses,
+								   sizeof(responses) - len[link]);
+				if (len[link] == sizeof(responses)) {
+					pending--;
+				}
+			}
+		}
+
+		/* Every link is answered in full, not just the links taken together */
+		for (size_t link = 0; link < links; link++) {
+			zassert_equal(len[link], sizeof(responses),
+				      "Link %zu answered %u of %zu bytes", link, len[link],
+				      sizeof(responses));
+			received += len[link];
+		}
+	}
+
+	uint32_t elapsed_us = k_cyc_to_us_ceil32(k_cycle_get_32() - start);
+	uint32_t frames = received / sizeof(pong);
+
+	TC_PRINT("%s, %u link(s): %u frames, %u bytes in %u us, %u frames/s\n",
+		 IS_ENABLED(CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC) ? "async" : "irq", links, frames,
+		 received, elapsed_us, (uint32_t)((uint64_t)frames * USEC_PER_SEC / elapsed_us));
+
+	zassert_equal(frames, links * ROUNDS * BURST_FRAMES);
+
+	return (uint64_t)frames * USEC_PER_SEC / elapsed_us;
+}
+
+ZTEST(serial_tests, test_serial_ping_shall_pong)
+{
+	uint8_t response[sizeof(pong)];
+
+	uart_emul_put_rx_data(uart_dev, ping, sizeof(ping));
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(uart_emul_get_tx_data(uart_dev, response, sizeof(response)), sizeof(pong));
+	zassert_mem_equal(response, pong, sizeof(pong));
+}
+
+ZTEST(serial_tests, test_serial_partial_packets)
+{
+	uint8_t response[sizeof(pong)];
+
+	uart_emul_put_rx_data(uart_dev, ping, 2);
+	k_sleep(K_MSEC(1));
+	uart_emul_put_rx_data(uart_dev, &ping[2], sizeof(ping) - 2);
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(uart_emul_get_tx_data(uart_dev, response, sizeof(response)), sizeof(pong));
+	zassert_mem_equal(response, pong, sizeof(pong));
+}
+
+ZTEST(serial_tests, test_serial_frame_filling_the_ring)
+{
+	uint8_t response[sizeof(pong)];
+	uint32_t len = 0;
+
+	/* Only answered if reception keeps going while the ring fills up */
+	uart_emul_put_rx_data(uart_dev, large_ping, sizeof(large_ping));
+
+	for (int retries = 0; retries < 100 && len < sizeof(response); retries++) {
+		k_sleep(K_USEC(100));
+		len += uart_emul_get_tx_data(uart_dev, &response[len], sizeof(response) - len);
+	}
+
+	zassert_equal(len, sizeof(pong));
+	zassert_mem_equal(response, pong, sizeof(pong));
+
+	/* And the link is back to small frames */
+	uart_emul_put_rx_data(uart_dev, ping, sizeof(ping));
+	k_sleep(K_MSEC(1));
+
+	zassert_equal(uart_emul_get_tx_data(uart_dev, response, sizeof(response)), sizeof(pong));
+	zassert_mem_equal(response, pong, sizeof(pong));
+}
+
+ZTEST(serial_tests, test_serial_throughput)
+{
+	run_bursts(1);
+}
+
+ZTEST(serial_tests, test_serial_instances_answer_completely)
+{
+	run_bursts(ARRAY_SIZE(uart_devs));
+}
+
+#if defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_WORKQ_PER_INSTANCE)
+static void find_workq(const struct k_thread *thread, void *user_data)
+{
+	k_tid_t *workq = user_data;
+
+	/* Instance workqueues are named after their UART */
+	if (strcmp(k_thread_name_get((k_tid_t)thread), uart_devs[0]->name) == 0) {
+		*workq = (k_tid_t)thread;
+	}
+}
+#endif
+
+ZTEST(serial_tests, test_serial_stalled_instance_leaves_others_answering)
+{
+	Z_TEST_SKIP_IFNDEF(CONFIG_AMPOULE_TRANSPORT_SERIAL_WORKQ_PER_INSTANCE);
+
+#if defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_WORKQ_PER_INSTANCE)
+	static uint8_t responses[sizeof(pong) * BURST_FRAMES];
+	k_tid_t workq = NULL;
+	uint32_t len = 0;
+
+	k_thread_foreach(find_workq, &workq);
+	zassert_not_null(workq);
+
+	/* The first link stops processing, as if stuck in a slow handler */
+	k_thread_suspend(workq);
+
+	for (size_t link = 0; link < ARRAY_SIZE(uart_devs); link++) {
+		uart_emul_put_rx_data(uart_devs[link], burst, sizeof(burst));
+	}
+
+	for (int retries = 0; retries < 100 && len < sizeof(responses); retries++) {
+		k_sleep(K_USEC(100));
+		len += uart_emul_get_tx_data(uart_devs[1], &responses[len],
+					     sizeof(responses) - len);
+	}
+
+	zassert_equal(len, sizeof(responses), "Stalled link held off the other one");
+	zassert_equal(uart_emul_get_tx_data(uart_devs[0], responses, sizeof(responses)), 0);
+
+	/* Once resumed, the first link catches up on everything it was sent */
+	k_thread_resume(workq);
+
+	len = 0;
+	for (int retries = 0; retries < 100 && len < sizeof(responses); retries++) {
+		k_sleep(K_USEC(100));
+		len += uart_emul_get_tx_data(uart_devs[0], &responses[len],
+					     sizeof(responses) - len);
+	}
+
+	zassert_equal(len, sizeof(responses));
+#endif
+}
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+static uint32_t bytes_dropped(const struct device *dev)
+{
+	struct ingestion_stats stats;
+	const char *name;
+
+	for (uint32_t i = 0; ingestion_stats_get(i, &name, &stats) == 0; i++) {
+		if (strcmp(name, dev->name) == 0) {
+			return stats.bytes_dropped;
+		}
+	}
+
+	ztest_test_fail();
+	return 0;
+}
+#endif
+
+ZTEST(serial_tests, test_serial_cobs_oversize_frame_is_dropped)
+{
+	/* Each code byte adds a zero, so it decodes to more than the ring holds */
+	static uint8_t oversize[CONFIG_AMPOULE_INGESTION_RX_BUF_SIZE + 64];
+	uint8_t response[sizeof(cobs_pong)];
+	uint32_t len = 0;
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	uint32_t dropped = bytes_dropped(cobs_uart_dev);
+#endif
+
+	memset(oversize, 0x01, sizeof(oversize));
+	oversize[sizeof(oversize) - 1] = 0x00;
+
+	/* Nothing is complete in the ring meanwhile, reception mustn't wait for it to drain */
+	uart_emul_put_rx_data(cobs_uart_dev, oversize, sizeof(oversize));
+	uart_emul_put_rx_data(cobs_uart_dev, cobs_ping, sizeof(cobs_ping));
+
+	for (int retries = 0; retries < 100 && len < sizeof(response); retries++) {
+		k_sleep(K_USEC(100));
+		len += uart_emul_get_tx_data(cobs_uart_dev, &response[len], sizeof(response) - len);
+	}
+
+	zassert_equal(len, sizeof(cobs_pong), "PING after the oversize frame wasn't answered");
+	zassert_mem_equal(response, cobs_pong, sizeof(cobs_pong));
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	zassert_true(bytes_dropped(cobs_uart_dev) - dropped > CONFIG_AMPOULE_INGESTION_RX_BUF_SIZE);
+#endif
+}
+
+ZTEST(serial_tests, test_serial_saturating_feed_loses_nothing)
+{
+	static uint8_t responses[sizeof(pong) * 64];
+	uint32_t offset = 0;
+	uint32_t received = 0;
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	uint32_t dropped = bytes_dropped(uart_dev);
+#endif
+
+	/* The host keeps the UART FIFO full, only held back by what the device reads */
+	for (int retries = 0; retries < 1000 && received < sizeof(pong) * SATURATING_FRAMES;
+	     retries++) {
+		offset += uart_emul_put_rx_data(uart_dev, &saturating[offset],
+						sizeof(saturating) - offset);
+
+		k_sleep(K_USEC(100));
+
+		uint32_t len;
+
+		while ((len = uart_emul_get_tx_data(uart_dev, responses, sizeof(responses))) > 0) {
+			/* A read may end in the middle of a response */
+			for (uint32_t i = 0; i < len; i++) {
+				zassert_equal(responses[i], pong[(received + i) % sizeof(pong)]);
+			}
+			received += len;
+		}
+	}
+
+	TC_PRINT("%u of %u frames answered\n", received / sizeof(pong), SATURATING_FRAMES);
+
+	zassert_equal(offset, sizeof(saturating));
+	zassert_equal(received, sizeof(pong) * SATURATING_FRAMES);
+
+#if defined(CONFIG_AMPOULE_INGESTION_STATS)
+	zassert_equal(bytes_dropped(uart_dev), dropped);
+#endif
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(serial_tests, NULL, setup, before, NULL, NULL);
@@ -0,0 +1,304 @@
+/**
+ * @file traffic
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-12-07 09:32:45
+ * @brief Paced, bursty and stalled hosts driving the serial transport through the UART emulator
+ *
+ * Hosts put requests on the emulated line at a given baud rate, in bursts separated by silence,
+ * and time the responses in simulated time. Results are printed as "BENCH {json}" lines, see
+ * scripts/bench_compare.py.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdlib.h>
+#include <zephyr/ztest.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/drivers/serial/uart_emul.h>
+#include "ampoule/ingestion.h"
+#include "host_clock.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+/* Requests sent by every paced run */
+#define TRAFFIC_FRAMES  512
+/* Host polling period */
+#define TRAFFIC_STEP_US 100
+/* UART frames are 8N1 */
+#define TRAFFIC_BITS_PER_BYTE 10
+
+/* Requests pushed by the stalled host, far more than the device can buffer both ways */
+#define STALL_FRAMES 2048
+#define STALL_MS     50
+
+#if defined(CONFIG_ARCH_POSIX)
+/* native_sim time stands still while code runs, the device cost is measured in host time */
+#define FLOOD_HZ    NSEC_PER_SEC
+#define flood_now() ((uint32_t)bench_host_clock_ns())
+#else
+#define FLOOD_HZ    sys_clock_hw_cycles_per_sec()
+#define flood_now() k_cycle_get_32()
+#endif
+
+struct traffic {
+	uint32_t baudrate;
+	/* Requests sent back to back at line rate, then gap_us of silence */
+	uint32_t burst;
+	uint32_t gap_us;
+};
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static const struct device *uart_dev = DEVICE_DT_GET(DT_NODELABEL(euart0));
+
+static const uint8_t ping[] = {0, 2, 8, 1};
+static const uint8_t pong[] = {0, 4, 8, 2, 16, 1};
+
+static uint8_t stream[sizeof(ping) * STALL_FRAMES];
+
+/* Simulated time at which each request was fully on the line, then its round trip */
+static uint32_t sent_us[TRAFFIC_FRAMES];
+static uint32_t latencies[TRAFFIC_FRAMES];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static uint32_t now_us(void)
+{
+	return k_cyc_to_us_floor32(k_cycle_get_32());
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Reads what the device sent, checks it only holds PONG, returns the bytes read */
+static uint32_t read_responses(uint32_t received)
+{
+	uint8_t responses[sizeof(pong) * 32];
+	uint32_t total = 0;
+	uint32_t len;
+
+	while ((len = uart_emul_get_tx_data(uart_dev, responses, sizeof(responses))) > 0) {
+		/* A read may end in the middle of a response */
+		for (uint32_t i = 0; i < len; i++) {
+			zassert_equal(responses[i], pong[(received + total + i) % sizeof(pong)],
+				      "Response byte %u", received + total + i);
+		}
+
+		total += len;
+	}
+
+#if !defined(CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC)
+	/* A real UART raises TX ready once its FIFO drains, the emulator only re-evaluates it
+	 * when interrupts are enabled. Harmless if the device had nothing left to send.
+	 */
+	if (total > 0) {
+		uart_irq_tx_enable(uart_dev);
+	}
+#endif
+
+	return total;
+}
+
+/* Wire time in us of the whole traffic, what a device keeping up answers it in */
+static uint32_t traffic_wire_us(const struct traffic *traffic)
+{
+	uint32_t bursts = DIV_ROUND_UP(TRAFFIC_FRAMES, traffic->burst);
+
+	return (uint64_t)TRAFFIC_FRAMES * sizeof(ping) * TRAFFIC_BITS_PER_BYTE * USEC_PER_SEC /
+		       traffic->baudrate +
+	       (bursts - 1) * traffic->gap_us;
+}
+
+static void run_traffic(const struct traffic *traffic)
+{
+	const uint32_t burst_len = traffic->burst * sizeof(ping);
+	const uint32_t stream_len = TRAFFIC_FRAMES * sizeof(ping);
+	const uint32_t deadline_us = 2 * traffic_wire_us(traffic) + USEC_PER_SEC;
+	uint32_t start = now_us();
+	uint32_t burst_start = start;
+	uint32_t burst_sent = 0;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint32_t answered = 0;
+	uint32_t last_us = start;
+
+	while (answered < TRAFFIC_FRAMES && now_us() - start < deadline_us) {
+		uint32_t now = now_us();
+
+		/* Whatever the line carried since the burst started, bursts wait out their gap */
+		if (sent < stream_len && now >= burst_start) {
+			uint32_t wire = (uint64_t)(now - burst_start) * traffic->baudrate /
+					TRAFFIC_BITS_PER_BYTE / USEC_PER_SEC;
+			uint32_t len = MIN(MIN(wire, burst_len) - burst_sent, stream_len - sent);
+
+			len = uart_emul_put_rx_data(uart_dev, &stream[sent], len);
+
+			for (uint32_t frame = sent / sizeof(ping);
+			     frame < (sent + len) / sizeof(ping); frame++) {
+				sent_us[frame] = now;
+			}
+
+			sent += len;
+			burst_sent += len;
+
+			if (burst_sent == burst_len) {
+				burst_start = now + traffic->gap_us;
+				burst_sent = 0;
+			}
+		}
+
+		received += read_responses(received);
+
+		for (; answered < received / sizeof(pong); answered++) {
+			latencies[answered] = now - sent_us[answered];
+			last_us = now;
+		}
+
+		k_sleep(K_USEC(TRAFFIC_STEP_US));
+	}
+
+	zassert_equal(answered, TRAFFIC_FRAMES, "%u of %u requests answered", answered,
+		      TRAFFIC_FRAMES);
+
+	uint32_t elapsed_us = last_us - start;
+	uint32_t wire_us = traffic_wire_us(traffic);
+
+	qsort(latencies, TRAFFIC_FRAMES, sizeof(latencies[0]), compare_u32);
+
+	uint32_t p50 = latencies[TRAFFIC_FRAMES / 2];
+	uint32_t p99 = latencies[TRAFFIC_FRAMES * 99 / 100];
+
+	TC_PRINT("BENCH {\"suite\":\"serial\",\"case\":\"%s\",\"baud\":%u,\"burst\":%u,"
+		 "\"gap_us\":%u,\"frames\":%u,\"frames_per_s\":%u,\"wire_frames_per_s\":%u,"
+		 "\"p50_cycles\":%u,\"p99_cycles\":%u,\"hz\":%u}\n",
+		 IS_ENABLED(CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC) ? "paced_async" : "paced_irq",
+		 traffic->baudrate, traffic->burst, traffic->gap_us, TRAFFIC_FRAMES,
+		 (uint32_t)((uint64_t)TRAFFIC_FRAMES * USEC_PER_SEC / elapsed_us),
+		 (uint32_t)((uint64_t)TRAFFIC_FRAMES * USEC_PER_SEC / wire_us), p50, p99,
+		 USEC_PER_SEC);
+
+	/* No request waited for the ingestion timeout to be answered */
+	zassert_true(p99 < CONFIG_AMPOULE_INGESTION_TIMEOUT_MS * USEC_PER_MSEC / 2, "p99 %u us",
+		     p99);
+	/* The device keeps up with the line, the host is the bottleneck */
+	zassert_true(elapsed_us <= wire_us + wire_us / 4 + 20 * TRAFFIC_STEP_US,
+		     "%u us to answer %u us of traffic", elapsed_us, wire_us);
+}
+
+static void *setup(void)
+{
+	for (size_t i = 0; i < sizeof(stream); i += sizeof(ping)) {
+		memcpy(&stream[i], ping, sizeof(ping));
+	}
+
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	uart_emul_flush_rx_data(uart_dev);
+	uart_emul_flush_tx_data(uart_dev);
+}
+
+ZTEST(serial_traffic_tests, test_traffic_paced_stream)
+{
+	const uint32_t baudrates[] = {115200, 1000000};
+
+	ARRAY_FOR_EACH(baudrates, i) {
+		struct traffic traffic = {.baudrate = baudrates[i], .burst = TRAFFIC_FRAMES};
+
+		run_traffic(&traffic);
+	}
+}
+
+ZTEST(serial_traffic_tests, test_traffic_bursts)
+{
+	const struct traffic patterns[] = {
+		{.baudrate = 115200, .burst = 1, .gap_us = 2000},
+		{.baudrate = 115200, .burst = 16, .gap_us = 5000},
+		{.baudrate = 1000000, .burst = 64, .gap_us = 10000},
+		/* Each burst fills the UART FIFO */
+		{.baudrate = 1000000, .burst = 256, .gap_us = 1000},
+	};
+
+	ARRAY_FOR_EACH(patterns, i) {
+		run_traffic(&patterns[i]);
+	}
+}
+
+ZTEST(serial_traffic_tests, test_traffic_flood_device_cost)
+{
+	const uint32_t stream_len = TRAFFIC_FRAMES * sizeof(ping);
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint32_t start = flood_now();
+
+	/* No pacing, the host pushes as fast as the device takes bytes */
+	for (int retries = 0; retries < 1000 && received < TRAFFIC_FRAMES * sizeof(pong);
+	     retries++) {
+		sent += uart_emul_put_rx_data(uart_dev, &stream[sent], stream_len - sent);
+		k_sleep(K_USEC(TRAFFIC_STEP_US));
+		received += read_responses(received);
+	}
+
+	uint32_t cycles = flood_now() - start;
+
+	zassert_equal(received, TRAFFIC_FRAMES * sizeof(pong));
+
+	TC_PRINT("BENCH {\"suite\":\"serial\",\"case\":\"%s\",\"frames\":%u,\"bytes\":%u,"
+		 "\"frames_per_s\":%u,\"hz\":%u}\n",
+		 IS_ENABLED(CONFIG_AMPOULE_TRANSPORT_SERIAL_ASYNC) ? "flood_async" : "flood_irq",
+		 TRAFFIC_FRAMES, stream_len,
+		 (uint32_t)((uint64_t)TRAFFIC_FRAMES * FLOOD_HZ / MAX(cycles, 1)),
+		 (uint32_t)FLOOD_HZ);
+}
+
+ZTEST(serial_traffic_tests, test_traffic_tx_back_pressure)
+{
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	int64_t stall_end = k_uptime_get() + STALL_MS;
+
+	/* The host keeps sending but doesn't read, responses pile up in the device */
+	while (k_uptime_get() < stall_end) {
+		sent += uart_emul_put_rx_data(uart_dev, &stream[sent], sizeof(stream) - sent);
+		k_sleep(K_USEC(TRAFFIC_STEP_US));
+	}
+
+	/* The device stopped answering, then stopped reading: the host is held off */
+	zassert_true(sent < sizeof(stream), "Device took all %u bytes", sent);
+	zassert_equal(uart_emul_put_rx_data(uart_dev, &stream[sent], sizeof(stream) - sent), 0);
+
+	TC_PRINT("Stalled host: %u requests accepted\n", sent / sizeof(ping));
+
+	/* Reading again releases everything, in order, nothing lost */
+	for (int retries = 0; retries < 1000 && received < sizeof(pong) * STALL_FRAMES;
+	     retries++) {
+		sent += uart_emul_put_rx_data(uart_dev, &stream[sent], sizeof(stream) - sent);
+		k_sleep(K_USEC(TRAFFIC_STEP_US));
+		received += read_responses(received);
+	}
+
+	zassert_equal(sent, sizeof(stream));
+	zassert_equal(received, sizeof(pong) * STALL_FRAMES, "%u of %u requests answered",
+		      received / sizeof(pong), STALL_FRAMES);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(serial_traffic_tests, NULL, setup, before, NULL, NULL);
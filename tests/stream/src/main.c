@@ -0,0 +1,303 @@
+/**
+ * @file main
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-01-04 10:17:42
+ * @brief Stream STRIP_WRITE frames larger than the RX ring into the mock strip
+ *
+ * A host feeds the frames in small chunks, only as fast as the RX ring frees up like a transport
+ * holding it off would.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include <zephyr/sys/byteorder.h>
+#include "pb_decode.h"
+#include "pb_encode.h"
+#include "ampoule/command.h"
+#include "ampoule/ingestion.h"
+#include "ampoule/strip.h"
+#include "mock_strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define STRIP_SIZE (MOCK_STRIP_LENGTH * STRIP_PIXEL_SIZE)
+
+/* Opcode, offset and field headers around the pixels */
+#define FRAME_OVERHEAD 16
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+static int on_write(void *context, uint8_t *data, uint16_t len);
+static void on_resume(void *context);
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static struct ingestion ingestion;
+static struct ingestion_transport transport = {
+	.write = on_write,
+	.resume = on_resume,
+};
+static struct ingestion_rpc rpc = {
+	.on_command = command_process,
+	.on_ext_command = command_ext_process,
+};
+
+static K_SEM_DEFINE(resume_sem, 0, 1);
+/* Responses received so far, and the latest one */
+static uint32_t responses;
+static ampoule_ExtResponse response;
+
+static uint8_t scene[STRIP_SIZE];
+/* Room for the whole strip, in one frame or two */
+static uint8_t frames[STRIP_SIZE + 2 * FRAME_OVERHEAD];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static int on_write(void *context, uint8_t *data, uint16_t len)
+{
+	pb_istream_t istream =
+		pb_istream_from_buffer(&data[sizeof(uint16_t)], len - sizeof(uint16_t));
+
+	response = (ampoule_ExtResponse){0};
+	zassert_true(sys_get_be16(data) & INGESTION_FRAME_FLAG_EXT);
+	zassert_true(pb_decode(&istream, ampoule_ExtResponse_fields, &response));
+	responses++;
+
+	return len;
+}
+
+static void on_resume(void *context)
+{
+	k_sem_give(&resume_sem);
+}
+
+/* STRIP_WRITE of count pixels at offset, in the pixels field */
+static uint32_t build_write(uint8_t *frame, size_t size, uint32_t offset, const uint8_t *rgb,
+			    uint32_t count)
+{
+	uint8_t head[FRAME_OVERHEAD];
+	pb_ostream_t write = pb_ostream_from_buffer(head, sizeof(head));
+	pb_ostream_t ostream =
+		pb_ostream_from_buffer(&frame[sizeof(uint16_t)], size - sizeof(uint16_t));
+	uint32_t pixels_size = count * STRIP_PIXEL_SIZE;
+
+	/* The StripWrite up to its pixels, which are then sent as they are */
+	zassert_true(pb_encode_tag(&write, PB_WT_VARINT, ampoule_StripWrite_offset_tag));
+	zassert_true(pb_encode_varint(&write, offset));
+	zassert_true(pb_encode_tag(&write, PB_WT_STRING, ampoule_StripWrite_pixels_tag));
+	zassert_true(pb_encode_varint(&write, pixels_size));
+
+	zassert_true(pb_encode_tag(&ostream, PB_WT_VARINT, ampoule_ExtCommand_opcode_tag));
+	zassert_true(pb_encode_varint(&ostream, ampoule_ExtOpcode_STRIP_WRITE));
+	zassert_true(pb_encode_tag(&ostream, PB_WT_STRING, ampoule_ExtCommand_strip_write_tag));
+	zassert_true(pb_encode_varint(&ostream, write.bytes_written + pixels_size));
+	zassert_true(pb_write(&ostream, head, write.bytes_written));
+	zassert_true(pb_write(&ostream, rgb, pixels_size));
+
+	zassert_true(ostream.bytes_written <= INGESTION_FRAME_SIZE_MASK);
+	sys_put_be16(ostream.bytes_written | INGESTION_FRAME_FLAG_EXT, frame);
+
+	return ostream.bytes_written + sizeof(uint16_t);
+}
+
+static uint32_t build_present(uint8_t *buf)
+{
+	ampoule_ExtCommand command = {.opcode = ampoule_ExtOpcode_STRIP_PRESENT};
+	pb_ostream_t ostream = pb_ostream_from_buffer(&buf[sizeof(uint16_t)], 16);
+
+	zassert_true(pb_encode(&ostream, ampoule_ExtCommand_fields, &command));
+	sys_put_be16(ostream.bytes_written | INGESTION_FRAME_FLAG_EXT, buf);
+
+	return ostream.bytes_written + sizeof(uint16_t);
+}
+
+/* Feeds data in chunks of 1 to max_chunk bytes, waiting for the ring to free up when full */
+static void host_send(uint8_t *data, uint32_t len, uint32_t max_chunk, uint32_t *seed)
+{
+	for (uint32_t offset = 0; offset < len;) {
+		uint32_t space = ingestion_rx_space(&ingestion);
+
+		if (space == 0) {
+			if (ingestion_rx_pause(&ingestion, 1)) {
+				int rc = k_sem_take(&resume_sem,
+						    K_MSEC(CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
+
+				zassert_ok(rc, "Ring full at %u of %u bytes", offset, len);
+			}
+			continue;
+		}
+
+		*seed = *seed * 1103515245 + 12345;
+
+		uint32_t chunk = MIN(1 + (*seed >> 16) % max_chunk, MIN(space, len - offset));
+
+		ingestion_feed(&ingestion, &data[offset], chunk);
+		offset += chunk;
+	}
+}
+
+/* Waits for the count-th response since the test started */
+static void wait_responses(uint32_t count)
+{
+	for (int retries = 0; retries < 100 && responses < count; retries++) {
+		k_sleep(K_MSEC(1));
+	}
+
+	zassert_equal(responses, count, "%u responses out of %u", responses, count);
+}
+
+static void present(void)
+{
+	uint8_t buf[32];
+	uint32_t len = build_present(buf);
+	uint32_t count = responses;
+
+	ingestion_feed(&ingestion, buf, len);
+	wait_responses(count + 1);
+	zassert_true(response.success);
+}
+
+static void assert_strip(const uint8_t *rgb, uint32_t offset, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		const struct led_rgb *pixel = &mock_strip_data.pixels[offset + i];
+		const uint8_t *expected = &rgb[i * STRIP_PIXEL_SIZE];
+
+		zassert_true(pixel->r == expected[0] && pixel->g == expected[1] &&
+				     pixel->b == expected[2],
+			     "Pixel %u is wrong", offset + i);
+	}
+}
+
+static void *setup(void)
+{
+	for (uint32_t i = 0; i < sizeof(scene); i++) {
+		scene[i] = i * 7 + i / 256;
+	}
+
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	k_sem_reset(&resume_sem);
+	responses = 0;
+	zassert_ok(ingestion_init(&ingestion, &transport, &rpc, NULL));
+
+	strip_present();
+	mock_strip_reset();
+}
+
+ZTEST(stream_tests, test_stream_whole_strip_in_small_chunks)
+{
+	uint32_t seed = 0x5EED;
+	uint32_t len = build_write(frames, sizeof(frames), 0, scene, MOCK_STRIP_LENGTH);
+
+	/* The point is that it doesn't fit */
+	zassert_true(len > sizeof(ingestion.rx_buffer));
+	TC_PRINT("%u byte frame through a %zu byte ring\n", len, sizeof(ingestion.rx_buffer));
+
+	host_send(frames, len, 16, &seed);
+	wait_responses(1);
+
+	zassert_true(response.success, "Failed with %d", response.error);
+	zassert_equal(response.opcode, ampoule_ExtOpcode_STRIP_WRITE);
+
+	present();
+	zassert_equal(mock_strip_data.last_update_len, MOCK_STRIP_LENGTH);
+	assert_strip(scene, 0, MOCK_STRIP_LENGTH);
+}
+
+ZTEST(stream_tests, test_stream_frames_back_to_back)
+{
+	uint32_t seed = 0xC0FFEE;
+	const uint32_t half = MOCK_STRIP_LENGTH / 2;
+	uint32_t len;
+
+	/* The second frame starts in the chunk ending the first one */
+	len = build_write(frames, sizeof(frames), half, &scene[half * STRIP_PIXEL_SIZE],
+			  MOCK_STRIP_LENGTH - half);
+	len += build_write(&frames[len], sizeof(frames) - len, 0, scene, half);
+
+	host_send(frames, len, 64, &seed);
+	wait_responses(2);
+	zassert_true(response.success);
+
+	present();
+	assert_strip(scene, 0, MOCK_STRIP_LENGTH);
+}
+
+ZTEST(stream_tests, test_stream_past_strip_end_is_dropped)
+{
+	uint32_t seed = 0xBAD;
+	uint32_t len = build_write(frames, sizeof(frames), 1, scene, MOCK_STRIP_LENGTH);
+
+	/* Refused before anything is written, as a malformed frame, its remaining bytes skipped */
+	host_send(frames, len, 32, &seed);
+	k_sleep(K_MSEC(1));
+	zassert_equal(responses, 0);
+
+	/* Nothing written, the next frame is read from its header */
+	present();
+	zassert_equal(mock_strip_data.update_count, 0);
+}
+
+ZTEST(stream_tests, test_stream_pixels_before_offset_are_refused)
+{
+	uint8_t head[32];
+	pb_ostream_t write = pb_ostream_from_buffer(head, sizeof(head));
+	pb_ostream_t ostream = pb_ostream_from_buffer(&frames[sizeof(uint16_t)],
+						      sizeof(frames) - sizeof(uint16_t));
+	const uint32_t count = 4;
+
+	/* The offset only comes once the pixels were written, at 0 */
+	zassert_true(pb_encode_tag(&write, PB_WT_STRING, ampoule_StripWrite_pixels_tag));
+	zassert_true(pb_encode_varint(&write, count * STRIP_PIXEL_SIZE));
+	zassert_true(pb_write(&write, scene, count * STRIP_PIXEL_SIZE));
+	zassert_true(pb_encode_tag(&write, PB_WT_VARINT, ampoule_StripWrite_offset_tag));
+	zassert_true(pb_encode_varint(&write, 8));
+
+	zassert_true(pb_encode_tag(&ostream, PB_WT_VARINT, ampoule_ExtCommand_opcode_tag));
+	zassert_true(pb_encode_varint(&ostream, ampoule_ExtOpcode_STRIP_WRITE));
+	zassert_true(pb_encode_tag(&ostream, PB_WT_STRING, ampoule_ExtCommand_strip_write_tag));
+	zassert_true(pb_encode_varint(&ostream, write.bytes_written));
+	zassert_true(pb_write(&ostream, head, write.bytes_written));
+	sys_put_be16(ostream.bytes_written | INGESTION_FRAME_FLAG_EXT, frames);
+
+	ingestion_feed(&ingestion, frames, ostream.bytes_written + sizeof(uint16_t));
+	wait_responses(1);
+
+	zassert_false(response.success);
+	zassert_equal(response.error, -EINVAL);
+}
+
+ZTEST(stream_tests, test_stream_stalled_host_times_out)
+{
+	uint32_t seed = 0x57A11;
+	uint32_t len = build_write(frames, sizeof(frames), 0, scene, MOCK_STRIP_LENGTH);
+
+	/* The host goes away in the middle of the frame */
+	host_send(frames, len / 2, 16, &seed);
+	k_sleep(K_MSEC(2 * CONFIG_AMPOULE_INGESTION_TIMEOUT_MS));
+	zassert_equal(responses, 0);
+
+	/* Then starts over, the engine waits for a frame header again */
+	host_send(frames, len, 16, &seed);
+	wait_responses(1);
+	zassert_true(response.success);
+
+	present();
+	assert_strip(scene, 0, MOCK_STRIP_LENGTH);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(stream_tests, NULL, setup, before, NULL, NULL);
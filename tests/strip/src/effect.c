@@ -0,0 +1,308 @@
+/**
+ * @file effect
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-16 14:22:05
+ * @brief Exercise the effect engine against the mock strip
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include "ampoule/command.h"
+#include "ampoule/effect.h"
+#include "ampoule/strip.h"
+#include "mock_strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define FRAME_MS (EFFECT_FRAME_US / USEC_PER_MSEC)
+
+/* Chase crossing the strip by one pixel per frame */
+#define CHASE_PERIOD_MS (MOCK_STRIP_LENGTH * FRAME_MS)
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+/* Uptime when the effect under test was started */
+static int64_t started;
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static void assert_pixel_color(uint16_t index, uint32_t color)
+{
+	struct led_rgb *pixel = &mock_strip_data.pixels[index];
+	uint32_t shown = (pixel->r << 16) | (pixel->g << 8) | pixel->b;
+
+	zassert_equal(shown, color, "Pixel %u is %06x, expected %06x", index, shown, color);
+}
+
+static void start(const struct effect *effect)
+{
+	started = k_uptime_ticks();
+	zassert_ok(effect_start(effect));
+}
+
+/* Sleeps until the middle of the n-th frame since start, away from any frame boundary */
+static void wait_frame(uint32_t n)
+{
+	k_sleep(K_TIMEOUT_ABS_TICKS(started +
+				    k_us_to_ticks_ceil64(n * EFFECT_FRAME_US + EFFECT_FRAME_US / 2)));
+}
+
+static void before(void *fixture)
+{
+	effect_stop();
+	strip_present();
+	mock_strip_reset();
+}
+
+static void after(void *fixture)
+{
+	effect_stop();
+}
+
+ZTEST(effect_tests, test_effect_frame_jitter)
+{
+	struct effect fade = {
+		.type = EFFECT_FADE,
+		.color_a = 0x000000,
+		.color_b = 0xFFFFFF,
+		.period_ms = 1000,
+	};
+	uint32_t max_jitter_us = 0;
+	uint64_t total_us = 0;
+
+	start(&fade);
+	wait_frame(MOCK_STRIP_TIMESTAMPS_SIZE);
+	zassert_ok(effect_stop());
+
+	zassert_true(mock_strip_data.update_count >= MOCK_STRIP_TIMESTAMPS_SIZE, "%u frames",
+		     mock_strip_data.update_count);
+
+	for (size_t i = 1; i < MOCK_STRIP_TIMESTAMPS_SIZE; i++) {
+		uint32_t interval_us = k_cyc_to_us_near32(mock_strip_data.timestamps[i] -
+							  mock_strip_data.timestamps[i - 1]);
+		uint32_t jitter_us = interval_us > EFFECT_FRAME_US ? interval_us - EFFECT_FRAME_US
+								  : EFFECT_FRAME_US - interval_us;
+
+		max_jitter_us = MAX(max_jitter_us, jitter_us);
+		total_us += interval_us;
+	}
+
+	uint32_t mean_us = total_us / (MOCK_STRIP_TIMESTAMPS_SIZE - 1);
+
+	/* native_sim time only advances when every thread is idle, this measures the scheduling
+	 * of the frames against the timer, not the cost of rendering them.
+	 */
+	TC_PRINT("%u fps: frame period %u us, mean %u us, max jitter %u us\n",
+		 CONFIG_AMPOULE_EFFECT_FPS, EFFECT_FRAME_US, mean_us, max_jitter_us);
+
+	zassert_true(max_jitter_us <= EFFECT_FRAME_US / 20, "Max jitter %u us", max_jitter_us);
+	/* Frames don't drift, the timer period isn't restarted from each render */
+	zassert_within(mean_us, EFFECT_FRAME_US, EFFECT_FRAME_US / 100);
+}
+
+ZTEST(effect_tests, test_effect_fade_reaches_second_color)
+{
+	struct effect fade = {
+		.type = EFFECT_FADE,
+		.color_a = 0x102030,
+		.color_b = 0xF0E0D0,
+		.period_ms = 4 * FRAME_MS,
+	};
+
+	start(&fade);
+
+	wait_frame(0);
+	for (uint16_t i = 0; i < MOCK_STRIP_LENGTH; i++) {
+		assert_pixel_color(i, 0x102030);
+	}
+
+	/* Half the period */
+	wait_frame(2);
+	for (uint16_t i = 0; i < MOCK_STRIP_LENGTH; i++) {
+		assert_pixel_color(i, 0xF0E0D0);
+	}
+}
+
+ZTEST(effect_tests, test_effect_chase_moves_every_frame)
+{
+	struct effect chase = {
+		.type = EFFECT_CHASE,
+		.color_a = 0xFF0000,
+		.color_b = 0x000010,
+		.period_ms = CHASE_PERIOD_MS,
+		.length = 2,
+	};
+
+	start(&chase);
+
+	wait_frame(0);
+	assert_pixel_color(0, 0xFF0000);
+	assert_pixel_color(MOCK_STRIP_LENGTH - 1, 0xFF0000);
+	assert_pixel_color(1, 0x000010);
+
+	wait_frame(5);
+	assert_pixel_color(5, 0xFF0000);
+	assert_pixel_color(4, 0xFF0000);
+	assert_pixel_color(3, 0x000010);
+	assert_pixel_color(6, 0x000010);
+}
+
+ZTEST(effect_tests, test_effect_gradient_spans_the_strip)
+{
+	struct effect gradient = {
+		.type = EFFECT_GRADIENT,
+		.color_a = 0x000000,
+		.color_b = 0x0000FF,
+		.period_ms = 1000,
+	};
+
+	start(&gradient);
+	wait_frame(0);
+
+	/* Goes to color_b in the middle of the strip and back so it scrolls seamlessly */
+	assert_pixel_color(0, 0x000000);
+	assert_pixel_color(MOCK_STRIP_LENGTH / 2, 0x0000FF);
+	assert_pixel_color(MOCK_STRIP_LENGTH / 4, 0x00007F);
+}
+
+ZTEST(effect_tests, test_effect_stop_freezes_the_strip)
+{
+	struct effect chase = {
+		.type = EFFECT_CHASE,
+		.color_a = 0xFFFFFF,
+		.period_ms = CHASE_PERIOD_MS,
+		.length = 1,
+	};
+
+	start(&chase);
+	wait_frame(2);
+	zassert_ok(effect_stop());
+	zassert_false(effect_running());
+
+	uint32_t update_count = mock_strip_data.update_count;
+
+	wait_frame(5);
+	zassert_equal(mock_strip_data.update_count, update_count);
+	/* Last frame stays on the strip */
+	assert_pixel_color(2, 0xFFFFFF);
+
+	zassert_equal(effect_stop(), -EALREADY);
+}
+
+ZTEST(effect_tests, test_effect_tune_keeps_time_base)
+{
+	struct effect chase = {
+		.type = EFFECT_CHASE,
+		.color_a = 0xFF0000,
+		.period_ms = CHASE_PERIOD_MS,
+		.length = 1,
+	};
+
+	start(&chase);
+	wait_frame(3);
+	assert_pixel_color(3, 0xFF0000);
+
+	chase.color_a = 0x00FF00;
+	zassert_ok(effect_tune(&chase));
+
+	/* Picks up from the current frame instead of restarting at the first pixel */
+	wait_frame(4);
+	assert_pixel_color(4, 0x00FF00);
+	assert_pixel_color(0, 0x000000);
+}
+
+ZTEST(effect_tests, test_effect_invalid_parameters_fail)
+{
+	struct effect effect = {.type = EFFECT_FADE};
+
+	zassert_equal(effect_start(&effect), -EINVAL);
+
+	effect = (struct effect){
+		.type = EFFECT_KEYFRAMES,
+		.keyframes = {{.time_ms = 0}, {.time_ms = 100}, {.time_ms = 100}},
+		.keyframes_count = 3,
+	};
+	zassert_equal(effect_start(&effect), -EINVAL);
+
+	effect = (struct effect){.type = EFFECT_NONE};
+	zassert_equal(effect_start(&effect), -EINVAL);
+
+	/* A chase covers at least one pixel and at most the whole strip */
+	effect = (struct effect){.type = EFFECT_CHASE, .period_ms = CHASE_PERIOD_MS};
+	zassert_equal(effect_start(&effect), -EINVAL);
+
+	effect.length = MOCK_STRIP_LENGTH + 1;
+	zassert_equal(effect_start(&effect), -EINVAL);
+
+	zassert_false(effect_running());
+}
+
+ZTEST(effect_tests, test_command_effect_keyframes)
+{
+	ampoule_ExtCommand command = {
+		.opcode = ampoule_ExtOpcode_EFFECT_START,
+		.which_operation = ampoule_ExtCommand_effect_tag,
+		.operation.effect =
+			{
+				.type = ampoule_EffectType_KEYFRAMES,
+				.keyframes_count = 3,
+				.keyframes =
+					{
+						{.time_ms = 0, .color = 0x000000},
+						{.time_ms = 4 * FRAME_MS, .color = 0x0000FF},
+						{.time_ms = 8 * FRAME_MS, .color = 0x000000},
+					},
+			},
+	};
+	ampoule_ExtResponse response;
+
+	started = k_uptime_ticks();
+	zassert_ok(command_ext_process(&command, &response));
+	zassert_true(response.success);
+	zassert_equal(response.opcode, ampoule_ExtOpcode_EFFECT_START);
+
+	/* Halfway to the second keyframe */
+	wait_frame(2);
+	assert_pixel_color(0, 0x00007F);
+
+	/* Halfway back down, then looping to the first keyframe */
+	wait_frame(6);
+	assert_pixel_color(0, 0x000080);
+	wait_frame(8);
+	assert_pixel_color(0, 0x000000);
+
+	command = (ampoule_ExtCommand){.opcode = ampoule_ExtOpcode_EFFECT_STOP};
+	zassert_ok(command_ext_process(&command, &response));
+	zassert_true(response.success);
+	zassert_false(effect_running());
+}
+
+ZTEST(effect_tests, test_command_effect_tune_without_effect_fails)
+{
+	ampoule_ExtCommand command = {
+		.opcode = ampoule_ExtOpcode_EFFECT_TUNE,
+		.which_operation = ampoule_ExtCommand_effect_tag,
+		.operation.effect = {.type = ampoule_EffectType_FADE, .period_ms = 100},
+	};
+	ampoule_ExtResponse response;
+
+	zassert_equal(command_ext_process(&command, &response), -ESRCH);
+	zassert_false(response.success);
+	zassert_equal(response.error, -ESRCH);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(effect_tests, NULL, NULL, before, after, NULL);
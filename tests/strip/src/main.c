@@ -0,0 +1,183 @@
+/**
+ * @file main
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-09 16:04:51
+ * @brief
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include "ampoule/command.h"
+#include "ampoule/strip.h"
+#include "mock_strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static void assert_pixel(uint16_t index, uint8_t r, uint8_t g, uint8_t b)
+{
+	struct led_rgb *pixel = &mock_strip_data.pixels[index];
+
+	zassert_equal(pixel->r, r, "Pixel %u red is %u", index, pixel->r);
+	zassert_equal(pixel->g, g, "Pixel %u green is %u", index, pixel->g);
+	zassert_equal(pixel->b, b, "Pixel %u blue is %u", index, pixel->b);
+}
+
+static void before(void *fixture)
+{
+	/* Flush anything a previous test left pending */
+	strip_present();
+	mock_strip_reset();
+}
+
+ZTEST(strip_tests, test_strip_length_matches_devicetree)
+{
+	zassert_equal(strip_length(), MOCK_STRIP_LENGTH);
+}
+
+ZTEST(strip_tests, test_strip_write_is_shown_on_present)
+{
+	uint8_t rgb[] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+
+	zassert_ok(strip_write(2, rgb, 3));
+
+	/* Nothing reaches the strip before present */
+	zassert_equal(mock_strip_data.update_count, 0);
+
+	zassert_ok(strip_present());
+
+	zassert_equal(mock_strip_data.update_count, 1);
+	zassert_equal(mock_strip_data.last_update_len, 5);
+	assert_pixel(2, 1, 2, 3);
+	assert_pixel(3, 4, 5, 6);
+	assert_pixel(4, 7, 8, 9);
+}
+
+ZTEST(strip_tests, test_strip_present_without_changes_skips_update)
+{
+	zassert_ok(strip_present());
+	zassert_ok(strip_present());
+
+	zassert_equal(mock_strip_data.update_count, 0);
+}
+
+ZTEST(strip_tests, test_strip_writes_are_coalesced_in_one_update)
+{
+	uint8_t red[] = {255, 0, 0};
+
+	for (uint16_t i = 0; i < MOCK_STRIP_LENGTH; i++) {
+		zassert_ok(strip_write(i, red, 1));
+	}
+
+	zassert_ok(strip_present());
+
+	zassert_equal(mock_strip_data.update_count, 1);
+	zassert_equal(mock_strip_data.last_update_len, MOCK_STRIP_LENGTH);
+
+	for (uint16_t i = 0; i < MOCK_STRIP_LENGTH; i++) {
+		assert_pixel(i, 255, 0, 0);
+	}
+}
+
+ZTEST(strip_tests, test_strip_update_stops_at_last_dirty_pixel)
+{
+	uint8_t green[] = {0, 255, 0};
+	uint8_t blue[] = {0, 0, 255};
+
+	zassert_ok(strip_write(6, green, 1));
+	zassert_ok(strip_present());
+
+	zassert_ok(strip_write(1, blue, 1));
+	zassert_ok(strip_present());
+
+	zassert_equal(mock_strip_data.update_count, 2);
+	zassert_equal(mock_strip_data.last_update_len, 2);
+	assert_pixel(1, 0, 0, 255);
+	assert_pixel(6, 0, 255, 0);
+}
+
+ZTEST(strip_tests, test_strip_back_buffer_survives_driver_conversion)
+{
+	uint8_t green[] = {0, 255, 0};
+	uint8_t blue[] = {0, 0, 255};
+
+	zassert_ok(strip_write(0, green, 1));
+	zassert_ok(strip_present());
+
+	/* The mock scrambled the buffer it was given, pixel 0 must come from the back buffer */
+	zassert_ok(strip_write(3, blue, 1));
+	zassert_ok(strip_present());
+
+	assert_pixel(0, 0, 255, 0);
+	assert_pixel(3, 0, 0, 255);
+}
+
+ZTEST(strip_tests, test_strip_write_out_of_range_fails)
+{
+	uint8_t rgb[2 * STRIP_PIXEL_SIZE] = {0};
+
+	zassert_equal(strip_write(MOCK_STRIP_LENGTH - 1, rgb, 2), -EINVAL);
+	zassert_ok(strip_present());
+	zassert_equal(mock_strip_data.update_count, 0);
+}
+
+ZTEST(strip_tests, test_command_strip_write_and_present)
+{
+	ampoule_ExtCommand command = {
+		.opcode = ampoule_ExtOpcode_STRIP_WRITE,
+		.which_operation = ampoule_ExtCommand_strip_write_tag,
+		.operation.strip_write =
+			{
+				.offset = 4,
+				.rgb = {.size = 6, .bytes = {10, 20, 30, 40, 50, 60}},
+			},
+	};
+	ampoule_ExtResponse response;
+
+	zassert_ok(command_ext_process(&command, &response));
+	zassert_true(response.success);
+	zassert_equal(response.opcode, ampoule_ExtOpcode_STRIP_WRITE);
+
+	command = (ampoule_ExtCommand){.opcode = ampoule_ExtOpcode_STRIP_PRESENT};
+	zassert_ok(command_ext_process(&command, &response));
+	zassert_true(response.success);
+
+	zassert_equal(mock_strip_data.update_count, 1);
+	assert_pixel(4, 10, 20, 30);
+	assert_pixel(5, 40, 50, 60);
+}
+
+ZTEST(strip_tests, test_command_strip_write_partial_pixel_fails)
+{
+	ampoule_ExtCommand command = {
+		.opcode = ampoule_ExtOpcode_STRIP_WRITE,
+		.which_operation = ampoule_ExtCommand_strip_write_tag,
+		.operation.strip_write.rgb = {.size = 4},
+	};
+	ampoule_ExtResponse response;
+
+	zassert_equal(command_ext_process(&command, &response), -EINVAL);
+	zassert_false(response.success);
+	zassert_equal(response.error, -EINVAL);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(strip_tests, NULL, NULL, before, NULL, NULL);
@@ -0,0 +1,68 @@
+/**
+ * @file mock_strip
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-09 16:01:44
+ * @brief Mock led_strip driver recording its updates
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/led_strip.h>
+
+#include "mock_strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define DT_DRV_COMPAT ampoule_mock_led_strip
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+struct mock_strip_data mock_strip_data;
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+void mock_strip_reset(void)
+{
+	memset(&mock_strip_data, 0, sizeof(mock_strip_data));
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static int mock_strip_update_rgb(const struct device *dev, struct led_rgb *pixels,
+				 size_t num_pixels)
+{
+	/* Pixels past num_pixels stay latched, like on a real strip */
+	if (mock_strip_data.update_count < MOCK_STRIP_TIMESTAMPS_SIZE) {
+		mock_strip_data.timestamps[mock_strip_data.update_count] = k_cycle_get_32();
+	}
+
+	memcpy(mock_strip_data.pixels, pixels, num_pixels * sizeof(struct led_rgb));
+	mock_strip_data.update_count++;
+	mock_strip_data.last_update_len = num_pixels;
+
+	/* Real drivers may convert the buffer in place */
+	memset(pixels, 0xAA, num_pixels * sizeof(struct led_rgb));
+
+	return 0;
+}
+
+static size_t mock_strip_length(const struct device *dev)
+{
+	return MOCK_STRIP_LENGTH;
+}
+
+static const struct led_strip_driver_api mock_strip_api = {
+	.update_rgb = mock_strip_update_rgb,
+	.length = mock_strip_length,
+};
+
+DEVICE_DT_INST_DEFINE(0, NULL, NULL, NULL, NULL, POST_KERNEL, CONFIG_LED_STRIP_INIT_PRIORITY,
+		      &mock_strip_api);
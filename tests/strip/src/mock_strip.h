@@ -0,0 +1,32 @@
+/**
+ * @file mock_strip
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-09 16:02:18
+ * @brief Mock led_strip driver recording its updates
+ *
+ */
+
+#ifndef MOCK_STRIP_H_
+#define MOCK_STRIP_H_
+
+#include <zephyr/drivers/led_strip.h>
+
+#define MOCK_STRIP_LENGTH DT_PROP(DT_NODELABEL(mock_strip), chain_length)
+
+/* Number of updates whose time is recorded */
+#define MOCK_STRIP_TIMESTAMPS_SIZE 64
+
+struct mock_strip_data {
+	/* Pixels of the last update, what the strip displays */
+	struct led_rgb pixels[MOCK_STRIP_LENGTH];
+	uint32_t update_count;
+	size_t last_update_len;
+	/* Cycle counter at each of the first updates */
+	uint32_t timestamps[MOCK_STRIP_TIMESTAMPS_SIZE];
+};
+
+extern struct mock_strip_data mock_strip_data;
+
+void mock_strip_reset(void);
+
+#endif /* MOCK_STRIP */
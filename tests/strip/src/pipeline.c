@@ -0,0 +1,253 @@
+/**
+ * @file pipeline
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2025-01-11 15:02:37
+ * @brief Check the pixel post-processing kernels against per channel references, then on present
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include "ampoule/command.h"
+#include "ampoule/pixel.h"
+#include "ampoule/strip.h"
+#include "mock_strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+/* Odd so the kernels go through their byte tail, plus one to start unaligned */
+#define BYTES 301
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static const struct pixel_config identity = {
+	.brightness = PIXEL_BRIGHTNESS_MAX,
+	.gamma = false,
+	.order = PIXEL_ORDER_RGB,
+};
+
+static uint8_t random_bytes[BYTES + 1];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static int strip_config(ampoule_StripConfig *config, ampoule_ExtResponse *response)
+{
+	ampoule_ExtCommand command = {
+		.opcode = ampoule_ExtOpcode_STRIP_CONFIG,
+		.which_operation = ampoule_ExtCommand_strip_config_tag,
+		.operation.strip_config = *config,
+	};
+
+	*response = (ampoule_ExtResponse){0};
+
+	return command_ext_process(&command, response);
+}
+
+static void *setup(void)
+{
+	uint32_t seed = 0x91C5E1;
+
+	for (uint32_t i = 0; i < sizeof(random_bytes); i++) {
+		seed = seed * 1103515245 + 12345;
+		random_bytes[i] = seed >> 16;
+	}
+
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	strip_present();
+	mock_strip_reset();
+}
+
+static void after(void *fixture)
+{
+	/* Other suites expect pixels as they were written */
+	zassert_ok(strip_configure(&identity));
+	strip_present();
+}
+
+ZTEST(pixel_tests, test_pixel_brightness_matches_reference)
+{
+	uint8_t bytes[BYTES + 1];
+
+	/* Whichever path is built, DSP or portable, it must give these exact bytes */
+	for (uint32_t brightness = 0; brightness <= PIXEL_BRIGHTNESS_MAX; brightness++) {
+		memcpy(bytes, random_bytes, sizeof(bytes));
+		pixel_brightness(&bytes[1], BYTES, brightness);
+
+		zassert_equal(bytes[0], random_bytes[0], "Wrote before the buffer");
+
+		for (uint32_t i = 1; i < sizeof(bytes); i++) {
+			uint8_t expected = random_bytes[i] * (brightness + 1) / 256;
+
+			zassert_equal(bytes[i], expected, "Byte %u at %u is %u instead of %u", i,
+				      brightness, bytes[i], expected);
+		}
+	}
+}
+
+ZTEST(pixel_tests, test_pixel_gamma_maps_every_value)
+{
+	uint8_t bytes[PIXEL_LUT_SIZE + 3];
+
+	for (uint32_t i = 0; i < PIXEL_LUT_SIZE; i++) {
+		bytes[1 + i] = i;
+	}
+
+	pixel_gamma(&bytes[1], PIXEL_LUT_SIZE + 2, pixel_gamma_lut);
+
+	for (uint32_t i = 0; i < PIXEL_LUT_SIZE; i++) {
+		zassert_equal(bytes[1 + i], pixel_gamma_lut[i]);
+	}
+
+	/* The curve keeps black, white and the order of the values */
+	zassert_equal(pixel_gamma_lut[0], 0);
+	zassert_equal(pixel_gamma_lut[PIXEL_LUT_SIZE - 1], 255);
+
+	for (uint32_t i = 1; i < PIXEL_LUT_SIZE; i++) {
+		zassert_true(pixel_gamma_lut[i] >= pixel_gamma_lut[i - 1]);
+	}
+}
+
+ZTEST(pixel_tests, test_pixel_reorder_every_order)
+{
+	const struct led_rgb expected[PIXEL_ORDER_COUNT] = {
+		[PIXEL_ORDER_RGB] = {.r = 1, .g = 2, .b = 3},
+		[PIXEL_ORDER_RBG] = {.r = 1, .g = 3, .b = 2},
+		[PIXEL_ORDER_GRB] = {.r = 2, .g = 1, .b = 3},
+		[PIXEL_ORDER_GBR] = {.r = 2, .g = 3, .b = 1},
+		[PIXEL_ORDER_BRG] = {.r = 3, .g = 1, .b = 2},
+		[PIXEL_ORDER_BGR] = {.r = 3, .g = 2, .b = 1},
+	};
+
+	for (uint32_t order = 0; order < PIXEL_ORDER_COUNT; order++) {
+		struct led_rgb pixels[2] = {{.r = 1, .g = 2, .b = 3}, {.r = 1, .g = 2, .b = 3}};
+
+		pixel_reorder(pixels, ARRAY_SIZE(pixels), order);
+
+		for (uint32_t i = 0; i < ARRAY_SIZE(pixels); i++) {
+			zassert_true(pixels[i].r == expected[order].r &&
+					     pixels[i].g == expected[order].g &&
+					     pixels[i].b == expected[order].b,
+				     "Order %u pixel %u is %u %u %u", order, i, pixels[i].r,
+				     pixels[i].g, pixels[i].b);
+		}
+	}
+}
+
+ZTEST(pixel_tests, test_pixel_pipeline_matches_kernels_in_turn)
+{
+	static struct pixel_pipeline pipeline;
+	struct led_rgb processed[BYTES / STRIP_PIXEL_SIZE];
+	struct led_rgb expected[ARRAY_SIZE(processed)];
+	struct pixel_config config = {.brightness = 100, .order = PIXEL_ORDER_GRB};
+
+	for (uint32_t gamma = 0; gamma < 2; gamma++) {
+		config.gamma = gamma;
+		zassert_ok(pixel_pipeline_init(&pipeline, &config));
+
+		for (uint32_t i = 0; i < ARRAY_SIZE(expected); i++) {
+			const uint8_t *rgb = &random_bytes[i * STRIP_PIXEL_SIZE];
+
+			expected[i] = (struct led_rgb){.r = rgb[0], .g = rgb[1], .b = rgb[2]};
+		}
+
+		memcpy(processed, expected, sizeof(processed));
+		pixel_pipeline_run(&pipeline, processed, ARRAY_SIZE(processed));
+
+		/* Brightness is folded in the gamma table, it must not show */
+		if (gamma) {
+			pixel_gamma((uint8_t *)expected, sizeof(expected), pixel_gamma_lut);
+		}
+		pixel_brightness((uint8_t *)expected, sizeof(expected), config.brightness);
+		pixel_reorder(expected, ARRAY_SIZE(expected), config.order);
+
+		zassert_mem_equal(processed, expected, sizeof(expected), "Gamma %u differs", gamma);
+	}
+
+	config.order = PIXEL_ORDER_COUNT;
+	zassert_equal(pixel_pipeline_init(&pipeline, &config), -EINVAL);
+}
+
+ZTEST(pixel_tests, test_pixel_strip_config_applies_to_whole_strip)
+{
+	const uint8_t rgb[] = {200, 100, 50};
+	ampoule_StripConfig config = {.has_brightness = true, .brightness = 127};
+	ampoule_ExtResponse response;
+
+	zassert_ok(strip_fill(0, rgb, MOCK_STRIP_LENGTH));
+	zassert_ok(strip_present());
+	zassert_equal(mock_strip_data.pixels[0].r, 200);
+
+	/* Half as bright, shown on the next present without writing anything */
+	zassert_ok(strip_config(&config, &response));
+	zassert_equal(response.which_result, ampoule_ExtResponse_strip_config_tag);
+	zassert_equal(response.result.strip_config.brightness, 127);
+	zassert_false(response.result.strip_config.gamma);
+
+	zassert_ok(strip_present());
+	zassert_equal(mock_strip_data.update_count, 2);
+	zassert_equal(mock_strip_data.last_update_len, MOCK_STRIP_LENGTH);
+
+	for (uint32_t i = 0; i < MOCK_STRIP_LENGTH; i++) {
+		const struct led_rgb *pixel = &mock_strip_data.pixels[i];
+
+		zassert_true(pixel->r == 100 && pixel->g == 50 && pixel->b == 25, "Pixel %u", i);
+	}
+
+	/* Fields left out are kept, the order applies on top of the brightness */
+	config = (ampoule_StripConfig){.has_order = true, .order = ampoule_ColorOrder_ORDER_BGR};
+	zassert_ok(strip_config(&config, &response));
+	zassert_equal(response.result.strip_config.brightness, 127);
+	zassert_equal(response.result.strip_config.order, ampoule_ColorOrder_ORDER_BGR);
+
+	zassert_ok(strip_present());
+	zassert_equal(mock_strip_data.pixels[0].r, 25);
+	zassert_equal(mock_strip_data.pixels[0].b, 100);
+
+	/* The back buffer still holds what was written */
+	config = (ampoule_StripConfig){.has_brightness = true, .brightness = PIXEL_BRIGHTNESS_MAX};
+	zassert_ok(strip_config(&config, &response));
+	config = (ampoule_StripConfig){.has_order = true, .order = ampoule_ColorOrder_ORDER_RGB};
+	zassert_ok(strip_config(&config, &response));
+	zassert_ok(strip_present());
+	zassert_equal(mock_strip_data.pixels[MOCK_STRIP_LENGTH - 1].r, 200);
+}
+
+ZTEST(pixel_tests, test_pixel_strip_config_rejects_invalid)
+{
+	ampoule_StripConfig config = {.has_brightness = true, .brightness = 256};
+	ampoule_ExtResponse response;
+
+	zassert_equal(strip_config(&config, &response), -EINVAL);
+	zassert_false(response.success);
+
+	config = (ampoule_StripConfig){.has_order = true, .order = PIXEL_ORDER_COUNT};
+	zassert_equal(strip_config(&config, &response), -EINVAL);
+
+	/* An empty one only reads, nothing changed nor is pushed again */
+	config = (ampoule_StripConfig){0};
+	zassert_ok(strip_config(&config, &response));
+	zassert_equal(response.result.strip_config.brightness, PIXEL_BRIGHTNESS_MAX);
+	zassert_equal(response.result.strip_config.order, ampoule_ColorOrder_ORDER_RGB);
+
+	zassert_ok(strip_present());
+	zassert_equal(mock_strip_data.update_count, 0);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(pixel_tests, NULL, setup, before, after, NULL);
@@ -0,0 +1,453 @@
+/**
+ * @file pixels
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-11-30 11:08:24
+ * @brief Decode encoded STRIP_WRITE payloads into the mock strip
+ *
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include "pb_encode.h"
+#include "ampoule/command.h"
+#include "ampoule/ingestion.h"
+#include "ampoule/strip.h"
+#include "mock_strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define SCENE_SIZE (MOCK_STRIP_LENGTH * STRIP_PIXEL_SIZE)
+
+/* Frame rate is estimated for a common strip over a common UART, 8N1 */
+#define FPS_PIXELS        300
+#define FPS_BAUDRATE      115200
+#define FPS_BITS_PER_BYTE 10
+
+/* Largest raw write, what fits the rgb field */
+#define RAW_MAX_PIXELS (sizeof(((ampoule_StripWrite *)0)->rgb.bytes) / STRIP_PIXEL_SIZE)
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static ampoule_ExtCommand command;
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+/* Reference encoders, as a host would implement them */
+static uint32_t rle_encode(uint8_t *out, const uint8_t *rgb, uint32_t count)
+{
+	uint32_t len = 0;
+
+	for (uint32_t i = 0; i < count;) {
+		uint32_t run = 1;
+
+		while (i + run < count && run < 256 &&
+		       memcmp(&rgb[i * STRIP_PIXEL_SIZE], &rgb[(i + run) * STRIP_PIXEL_SIZE],
+			      STRIP_PIXEL_SIZE) == 0) {
+			run++;
+		}
+
+		out[len++] = run - 1;
+		memcpy(&out[len], &rgb[i * STRIP_PIXEL_SIZE], STRIP_PIXEL_SIZE);
+		len += STRIP_PIXEL_SIZE;
+		i += run;
+	}
+
+	return len;
+}
+
+static int palette_find(const uint8_t *palette, uint32_t colors, const uint8_t *pixel)
+{
+	for (uint32_t i = 0; i < colors; i++) {
+		if (memcmp(&palette[i * STRIP_PIXEL_SIZE], pixel, STRIP_PIXEL_SIZE) == 0) {
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* Returns the size of the indexes, or 0 if there are more than 16 colors */
+static uint32_t palette_encode(uint8_t *out, uint8_t *palette, uint16_t *palette_size,
+			       const uint8_t *rgb, uint32_t count)
+{
+	uint32_t colors = 0;
+	uint8_t bits;
+
+	for (uint32_t i = 0; i < count; i++) {
+		if (palette_find(palette, colors, &rgb[i * STRIP_PIXEL_SIZE]) >= 0) {
+			continue;
+		}
+
+		if (colors == 16) {
+			return 0;
+		}
+
+		memcpy(&palette[colors++ * STRIP_PIXEL_SIZE], &rgb[i * STRIP_PIXEL_SIZE],
+		       STRIP_PIXEL_SIZE);
+	}
+
+	bits = colors <= 2 ? 1 : colors <= 4 ? 2 : 4;
+	memset(out, 0, DIV_ROUND_UP(count * bits, 8));
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t bit = i * bits;
+
+		out[bit / 8] |= palette_find(palette, colors, &rgb[i * STRIP_PIXEL_SIZE])
+				<< (8 - bits - bit % 8);
+	}
+
+	*palette_size = colors * STRIP_PIXEL_SIZE;
+
+	return DIV_ROUND_UP(count * bits, 8);
+}
+
+static bool pixel_changed(const uint8_t *from, const uint8_t *to, uint32_t i)
+{
+	return memcmp(&from[i * STRIP_PIXEL_SIZE], &to[i * STRIP_PIXEL_SIZE],
+		      STRIP_PIXEL_SIZE) != 0;
+}
+
+static uint32_t delta_encode(uint8_t *out, const uint8_t *from, const uint8_t *to, uint32_t count)
+{
+	uint32_t len = 0;
+
+	for (uint32_t i = 0; i < count;) {
+		uint32_t skip = 0;
+		uint32_t changed = 0;
+
+		while (i + skip < count && skip < 255 && !pixel_changed(from, to, i + skip)) {
+			skip++;
+		}
+
+		i += skip;
+
+		while (i + changed < count && changed < 255 &&
+		       pixel_changed(from, to, i + changed)) {
+			changed++;
+		}
+
+		out[len++] = skip;
+		out[len++] = changed;
+
+		for (uint32_t j = 0; j < changed * STRIP_PIXEL_SIZE; j++) {
+			out[len++] = from[i * STRIP_PIXEL_SIZE + j] ^ to[i * STRIP_PIXEL_SIZE + j];
+		}
+
+		i += changed;
+	}
+
+	return len;
+}
+
+static void command_set(ampoule_PixelEncoding encoding, uint32_t offset, const uint8_t *rgb,
+			uint32_t len)
+{
+	command = (ampoule_ExtCommand){
+		.opcode = ampoule_ExtOpcode_STRIP_WRITE,
+		.which_operation = ampoule_ExtCommand_strip_write_tag,
+		.operation.strip_write =
+			{
+				.offset = offset,
+				.encoding = encoding,
+				.rgb.size = len,
+			},
+	};
+
+	zassert_true(len <= sizeof(command.operation.strip_write.rgb.bytes));
+	memcpy(command.operation.strip_write.rgb.bytes, rgb, len);
+}
+
+static int command_send(void)
+{
+	ampoule_ExtResponse response;
+
+	return command_ext_process(&command, &response);
+}
+
+static void present(void)
+{
+	ampoule_ExtCommand present = {.opcode = ampoule_ExtOpcode_STRIP_PRESENT};
+	ampoule_ExtResponse response;
+
+	zassert_ok(command_ext_process(&present, &response));
+}
+
+static void show_raw(const uint8_t *scene)
+{
+	command_set(ampoule_PixelEncoding_PIXELS_RAW, 0, scene, SCENE_SIZE);
+	zassert_ok(command_send());
+	present();
+}
+
+static void assert_scene(const uint8_t *scene)
+{
+	for (uint16_t i = 0; i < MOCK_STRIP_LENGTH; i++) {
+		struct led_rgb *pixel = &mock_strip_data.pixels[i];
+		const uint8_t *expected = &scene[i * STRIP_PIXEL_SIZE];
+
+		zassert_true(pixel->r == expected[0] && pixel->g == expected[1] &&
+				     pixel->b == expected[2],
+			     "Pixel %u is %02x%02x%02x, expected %02x%02x%02x", i, pixel->r,
+			     pixel->g, pixel->b, expected[0], expected[1], expected[2]);
+	}
+}
+
+/* Paints count pixels with colors picked among the first colors of a fixed set, in bands */
+static void scene_bands(uint8_t *scene, uint32_t count, uint32_t colors, uint32_t band)
+{
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t color = (i / band) % colors;
+
+		scene[i * STRIP_PIXEL_SIZE] = 0x11 * color;
+		scene[i * STRIP_PIXEL_SIZE + 1] = 0xFF - 0x07 * color;
+		scene[i * STRIP_PIXEL_SIZE + 2] = color & 1 ? 0x80 : 0x01;
+	}
+}
+
+/* Fills size bytes with a deterministic pseudo random sequence */
+static void scene_noise(uint8_t *scene, size_t size, uint32_t seed)
+{
+	for (size_t i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		scene[i] = seed >> 16;
+	}
+}
+
+static void before(void *fixture)
+{
+	uint8_t black[SCENE_SIZE] = {0};
+
+	/* Every test starts from a known frame on the strip */
+	show_raw(black);
+	mock_strip_reset();
+}
+
+ZTEST(pixel_tests, test_rle_is_decoded_exactly)
+{
+	uint8_t scene[SCENE_SIZE];
+	uint8_t rle[SCENE_SIZE + MOCK_STRIP_LENGTH];
+
+	scene_bands(scene, MOCK_STRIP_LENGTH, 3, 5);
+
+	command_set(ampoule_PixelEncoding_PIXELS_RLE, 0, rle,
+		    rle_encode(rle, scene, MOCK_STRIP_LENGTH));
+	zassert_ok(command_send());
+	present();
+
+	assert_scene(scene);
+}
+
+ZTEST(pixel_tests, test_rle_run_at_offset)
+{
+	uint8_t scene[SCENE_SIZE] = {0};
+	/* 4 red pixels then 1 blue */
+	const uint8_t rle[] = {3, 0xFF, 0x00, 0x00, 0, 0x00, 0x00, 0xFF};
+
+	for (uint16_t i = 6; i < 10; i++) {
+		scene[i * STRIP_PIXEL_SIZE] = 0xFF;
+	}
+	scene[10 * STRIP_PIXEL_SIZE + 2] = 0xFF;
+
+	command_set(ampoule_PixelEncoding_PIXELS_RLE, 6, rle, sizeof(rle));
+	zassert_ok(command_send());
+	present();
+
+	assert_scene(scene);
+	zassert_equal(mock_strip_data.last_update_len, 11);
+}
+
+ZTEST(pixel_tests, test_palette_is_decoded_exactly_at_every_index_width)
+{
+	const uint32_t palette_colors[] = {2, 3, 4, 9, 16};
+	uint8_t scene[SCENE_SIZE];
+	uint8_t indexes[SCENE_SIZE];
+
+	ARRAY_FOR_EACH(palette_colors, i) {
+		ampoule_StripWrite *write = &command.operation.strip_write;
+		uint8_t palette[16 * STRIP_PIXEL_SIZE];
+		uint16_t palette_size;
+		uint32_t len;
+
+		scene_bands(scene, MOCK_STRIP_LENGTH, palette_colors[i], 1);
+
+		len = palette_encode(indexes, palette, &palette_size, scene, MOCK_STRIP_LENGTH);
+		zassert_not_equal(len, 0);
+
+		command_set(ampoule_PixelEncoding_PIXELS_PALETTE, 0, indexes, len);
+		write->count = MOCK_STRIP_LENGTH;
+		write->palette.size = palette_size;
+		memcpy(write->palette.bytes, palette, palette_size);
+
+		zassert_ok(command_send(), "%u colors", palette_colors[i]);
+		present();
+
+		assert_scene(scene);
+	}
+}
+
+ZTEST(pixel_tests, test_delta_is_decoded_exactly)
+{
+	uint8_t from[SCENE_SIZE];
+	uint8_t to[SCENE_SIZE];
+	uint8_t delta[2 * SCENE_SIZE];
+
+	scene_noise(from, sizeof(from), 0xA5A5A5A5);
+	show_raw(from);
+
+	/* A few pixels change, one of them to the same color once XORed */
+	memcpy(to, from, sizeof(to));
+	to[1 * STRIP_PIXEL_SIZE] ^= 0x5A;
+	to[2 * STRIP_PIXEL_SIZE + 2] ^= 0xFF;
+	memset(&to[9 * STRIP_PIXEL_SIZE], 0x42, 3 * STRIP_PIXEL_SIZE);
+
+	command_set(ampoule_PixelEncoding_PIXELS_DELTA, 0, delta,
+		    delta_encode(delta, from, to, MOCK_STRIP_LENGTH));
+	zassert_ok(command_send());
+	present();
+
+	assert_scene(to);
+
+	/* The same delta applied again goes back to the first frame */
+	zassert_ok(command_send());
+	present();
+
+	assert_scene(from);
+}
+
+ZTEST(pixel_tests, test_invalid_payloads_leave_strip_untouched)
+{
+	ampoule_StripWrite *write = &command.operation.strip_write;
+	/* Runs past the end of the strip */
+	const uint8_t rle[] = {MOCK_STRIP_LENGTH - 1, 1, 2, 3, 0, 4, 5, 6};
+	/* Span changing more pixels than it carries */
+	const uint8_t delta[] = {0, 2, 1, 2, 3};
+	/* Index 2 in a palette of 3 colors is fine, 3 isn't */
+	const uint8_t indexes[] = {0x2F};
+	const uint8_t palette[] = {1, 1, 1, 2, 2, 2, 3, 3, 3};
+
+	command_set(ampoule_PixelEncoding_PIXELS_RLE, 0, rle, sizeof(rle));
+	zassert_equal(command_send(), -EINVAL);
+
+	command_set(ampoule_PixelEncoding_PIXELS_RLE, 0, rle, sizeof(rle) - 1);
+	zassert_equal(command_send(), -EINVAL);
+
+	command_set(ampoule_PixelEncoding_PIXELS_DELTA, 0, delta, sizeof(delta));
+	zassert_equal(command_send(), -EINVAL);
+
+	command_set(ampoule_PixelEncoding_PIXELS_PALETTE, 0, indexes, sizeof(indexes));
+	write->count = 4;
+	write->palette.size = sizeof(palette);
+	memcpy(write->palette.bytes, palette, sizeof(palette));
+	zassert_equal(command_send(), -EINVAL);
+
+	/* Pixel count doesn't match the indexes */
+	write->count = 5;
+	zassert_equal(command_send(), -EINVAL);
+
+	command_set(ampoule_PixelEncoding_PIXELS_RAW, UINT32_MAX, palette, sizeof(palette));
+	zassert_equal(command_send(), -EINVAL);
+
+	command_set(ampoule_PixelEncoding_PIXELS_DELTA + 1, 0, delta, sizeof(delta));
+	zassert_equal(command_send(), -ENOTSUP);
+
+	present();
+	zassert_equal(mock_strip_data.update_count, 0);
+}
+
+/* Bytes on the wire for the current command, in an EXT frame */
+static uint32_t command_wire_size(void)
+{
+	size_t size;
+
+	zassert_true(pb_get_encoded_size(&size, ampoule_ExtCommand_fields, &command));
+
+	return sizeof(uint16_t) + size;
+}
+
+static uint32_t raw_wire_size(const uint8_t *scene, uint32_t count)
+{
+	uint32_t size = 0;
+
+	for (uint32_t offset = 0; offset < count; offset += RAW_MAX_PIXELS) {
+		uint32_t pixels = MIN(RAW_MAX_PIXELS, count - offset);
+
+		command_set(ampoule_PixelEncoding_PIXELS_RAW, offset,
+			    &scene[offset * STRIP_PIXEL_SIZE], pixels * STRIP_PIXEL_SIZE);
+		size += command_wire_size();
+	}
+
+	return size;
+}
+
+static uint32_t fps(uint32_t frame_size)
+{
+	ampoule_ExtCommand present = {.opcode = ampoule_ExtOpcode_STRIP_PRESENT};
+	size_t present_size;
+
+	zassert_true(pb_get_encoded_size(&present_size, ampoule_ExtCommand_fields, &present));
+
+	return FPS_BAUDRATE / FPS_BITS_PER_BYTE / (frame_size + sizeof(uint16_t) + present_size);
+}
+
+ZTEST(pixel_tests, test_encoded_frames_per_second)
+{
+	static uint8_t from[FPS_PIXELS * STRIP_PIXEL_SIZE];
+	static uint8_t to[FPS_PIXELS * STRIP_PIXEL_SIZE];
+	static uint8_t encoded[2 * FPS_PIXELS * STRIP_PIXEL_SIZE];
+	ampoule_StripWrite *write = &command.operation.strip_write;
+	uint8_t palette[16 * STRIP_PIXEL_SIZE];
+	uint16_t palette_size;
+	uint32_t raw_fps;
+	uint32_t encoded_fps;
+
+	/* Eight color bands: runs for RLE, 8 colors for the palette */
+	scene_bands(to, FPS_PIXELS, 8, FPS_PIXELS / 8 + 1);
+	raw_fps = fps(raw_wire_size(to, FPS_PIXELS));
+
+	command_set(ampoule_PixelEncoding_PIXELS_RLE, 0, encoded,
+		    rle_encode(encoded, to, FPS_PIXELS));
+	encoded_fps = fps(command_wire_size());
+	TC_PRINT("%u pixels at %u baud: raw %u fps, rle %u fps\n", FPS_PIXELS, FPS_BAUDRATE,
+		 raw_fps, encoded_fps);
+	zassert_true(encoded_fps >= 10 * raw_fps);
+
+	command_set(ampoule_PixelEncoding_PIXELS_PALETTE, 0, encoded,
+		    palette_encode(encoded, palette, &palette_size, to, FPS_PIXELS));
+	write->count = FPS_PIXELS;
+	write->palette.size = palette_size;
+	memcpy(write->palette.bytes, palette, palette_size);
+	encoded_fps = fps(command_wire_size());
+	TC_PRINT("%u pixels at %u baud: raw %u fps, palette %u fps\n", FPS_PIXELS, FPS_BAUDRATE,
+		 raw_fps, encoded_fps);
+	zassert_true(encoded_fps >= 5 * raw_fps);
+
+	/* Noise, then 10 pixels changing: nothing to compress but the change */
+	scene_noise(from, sizeof(from), 0x5A5A5A5A);
+	memcpy(to, from, sizeof(to));
+	for (uint32_t i = 0; i < 10; i++) {
+		to[i * 29 * STRIP_PIXEL_SIZE] ^= 0xFF;
+	}
+
+	raw_fps = fps(raw_wire_size(to, FPS_PIXELS));
+	command_set(ampoule_PixelEncoding_PIXELS_DELTA, 0, encoded,
+		    delta_encode(encoded, from, to, FPS_PIXELS));
+	encoded_fps = fps(command_wire_size());
+	TC_PRINT("%u pixels at %u baud: raw %u fps, delta %u fps\n", FPS_PIXELS, FPS_BAUDRATE,
+		 raw_fps, encoded_fps);
+	zassert_true(encoded_fps >= 10 * raw_fps);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(pixel_tests, NULL, NULL, before, NULL, NULL);
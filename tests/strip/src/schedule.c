@@ -0,0 +1,250 @@
+/**
+ * @file schedule
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-12-21 14:36:10
+ * @brief Exercise the host clock sync and scheduled commands against the mock strip
+ *
+ * The host clock is synthetic, offset and drifting from the device one by known amounts, its
+ * CLOCK_SYNC samples are delayed like a transport would.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <stdlib.h>
+#include <zephyr/ztest.h>
+#include "ampoule/command.h"
+#include "ampoule/effect.h"
+#include "ampoule/schedule.h"
+#include "ampoule/strip.h"
+#include "mock_strip.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define SAMPLES CONFIG_AMPOULE_SCHEDULE_SYNC_SAMPLES
+
+/* Host clock is wall time in us and runs HOST_DRIFT_PPM faster than the device one */
+#define HOST_EPOCH_US  1734770000000000ULL
+#define HOST_DRIFT_PPM 50
+
+/* Scheduled presents measured, each update of the mock strip is timed */
+#define PRESENTS MOCK_STRIP_TIMESTAMPS_SIZE
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+/* Transport delay of successive samples in us, mostly short with a few stuck behind traffic */
+static const uint32_t delays_us[] = {0, 3000, 40, 800, 15, 5000, 120, 0};
+
+static int32_t errors_us[PRESENTS];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+static uint64_t host_at(int64_t device_us)
+{
+	return HOST_EPOCH_US + (uint64_t)(device_us + device_us * HOST_DRIFT_PPM / 1000000);
+}
+
+/* Samples one every period_us, the latest one at device time end_us */
+static void host_sync(int64_t end_us, int64_t period_us, struct schedule_clock *clock)
+{
+	for (int64_t k = SAMPLES - 1; k >= 0; k--) {
+		int64_t sent_us = end_us - k * period_us;
+		int64_t received_us = sent_us + delays_us[k % ARRAY_SIZE(delays_us)];
+
+		zassert_ok(schedule_sync(host_at(sent_us), received_us, clock));
+	}
+}
+
+static int compare_i32(const void *a, const void *b)
+{
+	int32_t x = *(const int32_t *)a;
+	int32_t y = *(const int32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void before(void *fixture)
+{
+	schedule_reset();
+	effect_stop();
+	strip_present();
+	mock_strip_reset();
+}
+
+static void after(void *fixture)
+{
+	schedule_reset();
+	effect_stop();
+}
+
+ZTEST(schedule_tests, test_schedule_sync_estimates_host_clock)
+{
+	struct schedule_clock clock;
+	int64_t device_us;
+
+	zassert_equal(schedule_to_device_us(host_at(0), &device_us), -EAGAIN);
+
+	host_sync(0, USEC_PER_SEC, &clock);
+
+	zassert_equal(clock.samples, SAMPLES);
+	/* The device clock is the slow one */
+	zassert_within(clock.drift_ppb, -HOST_DRIFT_PPM * 1000, 1000, "Drift %d ppb",
+		       clock.drift_ppb);
+
+	/* Late samples are filtered out, then the estimate holds well past the last one */
+	for (int64_t t = 0; t <= 60 * USEC_PER_SEC; t += 10 * USEC_PER_SEC) {
+		zassert_ok(schedule_to_device_us(host_at(t), &device_us));
+		zassert_within(device_us, t, 10, "%lld us off after %lld s",
+			       (long long)(device_us - t), (long long)(t / USEC_PER_SEC));
+	}
+
+	/* A host restarting its clock starts over instead of skewing the estimate */
+	zassert_ok(schedule_sync(host_at(0) - 60 * USEC_PER_SEC, 0, &clock));
+	zassert_equal(clock.samples, 1);
+}
+
+ZTEST(schedule_tests, test_schedule_present_error_distribution)
+{
+	const uint32_t tick_us = k_ticks_to_us_ceil32(1);
+	uint8_t rgb[STRIP_PIXEL_SIZE];
+	ampoule_ExtResponse response;
+
+	host_sync(schedule_now_us(), 250 * USEC_PER_MSEC, NULL);
+
+	/* Cycles and uptime are read on the same tick boundary */
+	k_sleep(K_TICKS(1));
+	uint32_t base_cycles = k_cycle_get_32();
+	int64_t base_us = schedule_now_us();
+
+	for (uint32_t i = 0; i < PRESENTS; i++) {
+		uint32_t lead_us = 1000 + (i * 7919) % 4000;
+		int64_t target_us = schedule_now_us() + lead_us;
+		ampoule_ExtCommand command = {
+			.opcode = ampoule_ExtOpcode_STRIP_PRESENT,
+			.at_us = host_at(target_us),
+		};
+
+		memset(rgb, i + 1, sizeof(rgb));
+		zassert_ok(strip_write(i % MOCK_STRIP_LENGTH, rgb, 1));
+
+		/* Accepted right away, shown later */
+		zassert_ok(command_ext_process(&command, &response));
+		zassert_true(response.success);
+		zassert_equal(mock_strip_data.update_count, i);
+
+		k_sleep(K_USEC(lead_us + 2 * tick_us));
+		zassert_equal(mock_strip_data.update_count, i + 1, "Present %u didn't run", i);
+
+		int64_t shown_us =
+			base_us + k_cyc_to_us_floor64(mock_strip_data.timestamps[i] - base_cycles);
+
+		errors_us[i] = shown_us - target_us;
+	}
+
+	qsort(errors_us, PRESENTS, sizeof(errors_us[0]), compare_i32);
+
+	int32_t p50 = errors_us[PRESENTS / 2];
+	int32_t p99 = errors_us[PRESENTS * 99 / 100];
+
+	TC_PRINT("Scheduled present error: min %d us, p50 %d us, p99 %d us, max %d us, "
+		 "tick %u us\n",
+		 errors_us[0], p50, p99, errors_us[PRESENTS - 1], tick_us);
+
+	/* Commands wait for the first tick at or after their time, the clock estimate is off by a
+	 * few us at most.
+	 */
+	zassert_true(errors_us[0] >= -10, "Present %d us early", -errors_us[0]);
+	zassert_true(errors_us[PRESENTS - 1] <= tick_us + 10, "Present %d us late",
+		     errors_us[PRESENTS - 1]);
+}
+
+ZTEST(schedule_tests, test_schedule_runs_in_time_order)
+{
+	int64_t now_us = schedule_now_us();
+	ampoule_ExtCommand stop = {
+		.opcode = ampoule_ExtOpcode_EFFECT_STOP,
+		.at_us = host_at(now_us + 30 * USEC_PER_MSEC),
+	};
+	ampoule_ExtCommand start = {
+		.opcode = ampoule_ExtOpcode_EFFECT_START,
+		.which_operation = ampoule_ExtCommand_effect_tag,
+		.operation.effect = {.type = ampoule_EffectType_FADE, .period_ms = 100},
+		.at_us = host_at(now_us + 10 * USEC_PER_MSEC),
+	};
+	ampoule_ExtResponse response;
+
+	host_sync(now_us, 250 * USEC_PER_MSEC, NULL);
+
+	/* Sent last, run first */
+	zassert_ok(command_ext_process(&stop, &response));
+	zassert_ok(command_ext_process(&start, &response));
+	zassert_false(effect_running());
+
+	k_msleep(20);
+	zassert_true(effect_running());
+
+	k_msleep(20);
+	zassert_false(effect_running());
+}
+
+ZTEST(schedule_tests, test_schedule_rejects_what_it_cannot_run)
+{
+	ampoule_ExtCommand present = {
+		.opcode = ampoule_ExtOpcode_STRIP_PRESENT,
+		.at_us = host_at(schedule_now_us() + 10 * USEC_PER_SEC),
+	};
+	ampoule_ExtCommand write = {
+		.opcode = ampoule_ExtOpcode_STRIP_WRITE,
+		.which_operation = ampoule_ExtCommand_strip_write_tag,
+		.operation.strip_write = {.rgb = {.size = 3, .bytes = {1, 2, 3}}},
+		.at_us = present.at_us,
+	};
+	ampoule_ExtCommand sync = {
+		.opcode = ampoule_ExtOpcode_CLOCK_SYNC,
+		.which_operation = ampoule_ExtCommand_clock_sync_tag,
+		.operation.clock_sync = {.host_us = host_at(schedule_now_us())},
+	};
+	ampoule_ExtResponse response;
+
+	/* A host time means nothing before the first sync */
+	zassert_equal(command_ext_process(&present, &response), -EAGAIN);
+	zassert_false(response.success);
+
+	zassert_ok(command_ext_process(&sync, &response));
+	zassert_equal(response.which_result, ampoule_ExtResponse_clock_tag);
+	zassert_equal(response.result.clock.samples, 1);
+	zassert_within(response.result.clock.device_us, schedule_now_us(), 1000);
+
+	zassert_equal(command_ext_process(&write, &response), -ENOTSUP);
+
+	/* Commands without an operation that answer with data aren't deferred either */
+	ampoule_ExtCommand stats = {
+		.opcode = ampoule_ExtOpcode_STATS,
+		.at_us = present.at_us,
+	};
+
+	zassert_equal(command_ext_process(&stats, &response), -ENOTSUP);
+	zassert_false(response.success);
+	sync.at_us = present.at_us;
+	zassert_equal(command_ext_process(&sync, &response), -ENOTSUP);
+
+	for (int i = 0; i < CONFIG_AMPOULE_SCHEDULE_SIZE; i++) {
+		zassert_ok(command_ext_process(&present, &response));
+	}
+
+	zassert_equal(command_ext_process(&present, &response), -ENOMEM);
+	zassert_false(response.success);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+
+ZTEST_SUITE(schedule_tests, NULL, NULL, before, after, NULL);
@@ -0,0 +1,350 @@
+/**
+ * @file main
+ * @author Lucas Denefle - ldenefle@gmail.com
+ * @date 2024-12-14 15:40:52
+ * @brief Exercise the TCP transport over the native_sim host loopback
+ *
+ * Sockets are offloaded to the host, hosts are emulated by sockets of the test itself connecting
+ * to the listening port. Throughput is printed as "BENCH {json}" lines, see
+ * scripts/bench_compare.py.
+ */
+
+/******************************************************************************/
+/* Includes                                                                   */
+/******************************************************************************/
+#include <zephyr/ztest.h>
+#include <zephyr/net/socket.h>
+#include "ampoule/ingestion.h"
+#include "host_clock.h"
+
+/******************************************************************************/
+/* Local Constant, Macro and Type Definitions                                 */
+/******************************************************************************/
+#define HOSTS CONFIG_AMPOULE_TRANSPORT_TCP_MAX_CONNECTIONS
+
+/* Requests streamed by each host of the throughput case */
+#define STREAM_FRAMES 4096
+/* Requests sent before a host half closes its side */
+#define CLOSING_FRAMES 256
+
+#if defined(CONFIG_ARCH_POSIX)
+/* native_sim time stands still while code runs, throughput is measured in host time */
+#define STREAM_HZ    NSEC_PER_SEC
+#define stream_now() ((uint32_t)bench_host_clock_ns())
+#else
+#define STREAM_HZ    sys_clock_hw_cycles_per_sec()
+#define stream_now() k_cycle_get_32()
+#endif
+
+/******************************************************************************/
+/* Local Function Prototypes                                                  */
+/******************************************************************************/
+
+/******************************************************************************/
+/* Local Variable Definitions                                                 */
+/******************************************************************************/
+static const uint8_t ping[] = {0, 2, 8, 1};
+static const uint8_t pong[] = {0, 4, 8, 2, 16, 1};
+
+/* Same request carrying the id 0x1234, pipelined when CONFIG_AMPOULE_INGESTION_PIPELINE is set */
+static const uint8_t ping_id[] = {0x40, 4, 0x12, 0x34, 8, 1};
+static const uint8_t pong_id[] = {0x40, 6, 0x12, 0x34, 8, 2, 16, 1};
+
+/* Plain PING and PONG with CONFIG_AMPOULE_TRANSPORT_TCP_COBS, CRC appended and COBS encoded */
+static const uint8_t cobs_ping[] = {0x01, 0x06, 0x02, 0x08, 0x01, 0x73, 0x28, 0x00};
+static const uint8_t cobs_pong[] = {0x01, 0x08, 0x04, 0x08, 0x02, 0x10, 0x01, 0x7F, 0xE7, 0x00};
+
+static uint8_t stream[sizeof(ping) * STREAM_FRAMES];
+
+/******************************************************************************/
+/* Global Function Definitions                                                */
+/******************************************************************************/
+/* The listener starts with the application, retry until it is up */
+static int host_connect(void)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(CONFIG_AMPOULE_TRANSPORT_TCP_PORT),
+	};
+
+	zassert_equal(zsock_inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr), 1);
+
+	for (int retries = 0; retries < 100; retries++) {
+		int sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+		zassert_true(sock >= 0, "socket failed (%d)", errno);
+
+		if (zsock_connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			return sock;
+		}
+
+		zsock_close(sock);
+		k_msleep(10);
+	}
+
+	ztest_test_fail();
+	return -1;
+}
+
+static void host_send(int sock, const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t sent = zsock_send(sock, data, len, 0);
+
+		zassert_true(sent > 0, "send failed (%d)", errno);
+		data += sent;
+		len -= sent;
+	}
+}
+
+/* Reads up to len bytes checking they repeat expected, returns the bytes read, 0 on EOF */
+static uint32_t host_read(int sock, const uint8_t *expected, uint32_t size, uint32_t offset,
+			  uint32_t len)
+{
+	uint8_t buffer[256];
+
+	ssize_t received = zsock_recv(sock, buffer, MIN(sizeof(buffer), len), 0);
+	zassert_true(received >= 0, "recv failed (%d)", errno);
+
+	for (ssize_t i = 0; i < received; i++) {
+		zassert_equal(buffer[i], expected[(offset + i) % size], "Response byte %u",
+			      offset + i);
+	}
+
+	return received;
+}
+
+static void host_expect(int sock, const uint8_t *expected, uint32_t size, uint32_t len)
+{
+	for (uint32_t offset = 0; offset < len;) {
+		uint32_t received = host_read(sock, expected, size, offset, len - offset);
+
+		zassert_true(received > 0, "Connection closed after %u of %u bytes", offset, len);
+		offset += received;
+	}
+}
+
+static void *setup(void)
+{
+	for (size_t i = 0; i < sizeof(stream); i += sizeof(ping)) {
+		memcpy(&stream[i], ping, sizeof(ping));
+	}
+
+	return NULL;
+}
+
+ZTEST(tcp_tests, test_tcp_ping_shall_pong)
+{
+	int sock = host_connect();
+
+	host_send(sock, ping, sizeof(ping));
+	host_expect(sock, pong, sizeof(pong), sizeof(pong));
+
+	/* Split requests are assembled across reads */
+	host_send(sock, ping, 1);
+	k_msleep(1);
+	host_send(sock, &ping[1], sizeof(ping) - 1);
+	host_expect(sock, pong, sizeof(pong), sizeof(pong));
+
+	zsock_close(sock);
+}
+
+ZTEST(tcp_tests, test_tcp_hosts_served_independently)
+{
+	int socks[HOSTS];
+
+	for (size_t i = 0; i < HOSTS; i++) {
+		socks[i] = host_connect();
+	}
+
+	/* Interleaved requests, every host only gets the responses to its own */
+	for (int round = 0; round < 16; round++) {
+		for (size_t i = 0; i < HOSTS; i++) {
+			if (i % 2) {
+				host_send(socks[i], ping_id, sizeof(ping_id));
+			} else {
+				host_send(socks[i], ping, sizeof(ping));
+			}
+		}
+
+		for (size_t i = HOSTS; i-- > 0;) {
+			if (i % 2) {
+				host_expect(socks[i], pong_id, sizeof(pong_id), sizeof(pong_id));
+			} else {
+				host_expect(socks[i], pong, sizeof(pong), sizeof(pong));
+			}
+		}
+	}
+
+	for (size_t i = 0; i < HOSTS; i++) {
+		zsock_close(socks[i]);
+	}
+}
+
+ZTEST(tcp_tests, test_tcp_half_close_answers_everything)
+{
+	static uint8_t requests[sizeof(ping_id) * CLOSING_FRAMES];
+	uint32_t received = 0;
+	uint32_t len;
+
+	for (size_t i = 0; i < sizeof(requests); i += sizeof(ping_id)) {
+		memcpy(&requests[i], ping_id, sizeof(ping_id));
+	}
+
+	/* More hosts one after the other than there are connections, each one frees its own */
+	for (int host = 0; host < 2 * HOSTS; host++) {
+		int sock = host_connect();
+
+		host_send(sock, requests, sizeof(requests));
+		zassert_equal(zsock_shutdown(sock, ZSOCK_SHUT_WR), 0);
+
+		/* Requests still buffered or in the pipeline are answered before the close */
+		received = 0;
+		while ((len = host_read(sock, pong_id, sizeof(pong_id), received,
+					sizeof(pong_id) * CLOSING_FRAMES - received + 1)) > 0) {
+			received += len;
+		}
+
+		zassert_equal(received, sizeof(pong_id) * CLOSING_FRAMES,
+			      "Host %d: %u of %u requests answered", host,
+			      (uint32_t)(received / sizeof(pong_id)), CLOSING_FRAMES);
+
+		zsock_close(sock);
+	}
+}
+
+ZTEST(tcp_tests, test_tcp_host_not_reading_leaves_others_answering)
+{
+	uint32_t deadline = stream_now() + 10 * STREAM_HZ;
+	uint32_t stalled_since = 0;
+	bool stalled = false;
+
+	if (HOSTS < 2) {
+		ztest_test_skip();
+	}
+
+	int stuck = host_connect();
+	int sock = host_connect();
+
+	/*
+	 * The stuck host never reads, its responses fill the windows until they block its
+	 * connection, which then stops reading requests too. Stalled once nothing is accepted
+	 * for a while.
+	 */
+	while (!stalled && (int32_t)(stream_now() - deadline) < 0) {
+		ssize_t sent = zsock_send(stuck, stream, sizeof(stream), ZSOCK_MSG_DONTWAIT);
+
+		if (sent > 0) {
+			stalled_since = 0;
+			continue;
+		}
+
+		zassert_true(errno == EAGAIN || errno == EWOULDBLOCK, "send failed (%d)", errno);
+		if (stalled_since == 0) {
+			stalled_since = stream_now();
+		}
+
+		stalled = stream_now() - stalled_since > STREAM_HZ / 10;
+		k_msleep(1);
+	}
+
+	zassert_true(stalled, "Stuck host never filled its connection");
+
+	/* Blocked responses of the stuck host only hold up its own connection */
+	uint32_t start = stream_now();
+
+	host_send(sock, ping, sizeof(ping));
+	host_expect(sock, pong, sizeof(pong), sizeof(pong));
+
+	uint64_t latency_ms = (uint64_t)(stream_now() - start) * MSEC_PER_SEC / STREAM_HZ;
+
+	zassert_true(latency_ms < CONFIG_AMPOULE_TRANSPORT_TCP_TX_TIMEOUT_MS / 2,
+		     "PING took %u ms while another host was not reading", (uint32_t)latency_ms);
+
+	zsock_close(stuck);
+	zsock_close(sock);
+}
+
+ZTEST(tcp_tests, test_tcp_stream_throughput)
+{
+	int socks[HOSTS];
+	uint32_t sent[HOSTS] = {0};
+	uint32_t received[HOSTS] = {0};
+	uint32_t pending = HOSTS;
+	const uint32_t total = sizeof(pong) * STREAM_FRAMES;
+
+	for (size_t i = 0; i < HOSTS; i++) {
+		socks[i] = host_connect();
+	}
+
+	uint32_t start = stream_now();
+
+	/* Hosts keep a window of requests in flight, reading responses as they come */
+	while (pending > 0) {
+		for (size_t i = 0; i < HOSTS; i++) {
+			uint32_t in_flight = sent[i] / sizeof(ping) - received[i] / sizeof(pong);
+
+			if (sent[i] < sizeof(stream) && in_flight < 64) {
+				uint32_t len = MIN(sizeof(ping) * 64, sizeof(stream) - sent[i]);
+
+				host_send(socks[i], &stream[sent[i]], len);
+				sent[i] += len;
+			}
+
+			if (received[i] < total) {
+				received[i] += host_read(socks[i], pong, sizeof(pong), received[i],
+							 total - received[i]);
+
+				if (received[i] == total) {
+					pending--;
+				}
+			}
+		}
+	}
+
+	uint32_t elapsed = MAX(stream_now() - start, 1);
+
+	TC_PRINT("BENCH {\"suite\":\"tcp\",\"case\":\"stream\",\"frames\":%u,\"hosts\":%u,"
+		 "\"frames_per_s\":%u,\"bytes_per_s\":%u,\"hz\":%u}\n",
+		 STREAM_FRAMES, HOSTS,
+		 (uint32_t)((uint64_t)HOSTS * STREAM_FRAMES * STREAM_HZ / elapsed),
+		 (uint32_t)((uint64_t)HOSTS * sizeof(stream) * STREAM_HZ / elapsed),
+		 (uint32_t)STREAM_HZ);
+
+	for (size_t i = 0; i < HOSTS; i++) {
+		zsock_close(socks[i]);
+	}
+}
+
+ZTEST(tcp_cobs_tests, test_tcp_cobs_oversize_frame_is_dropped)
+{
+	/* Each code byte adds a zero, so it decodes to more than the ring holds */
+	static uint8_t oversize[CONFIG_AMPOULE_INGESTION_RX_BUF_SIZE + 64];
+	int sock = host_connect();
+
+	memset(oversize, 0x01, sizeof(oversize));
+	oversize[sizeof(oversize) - 1] = 0x00;
+
+	/* Nothing is complete in the ring meanwhile, reading mustn't wait for it to drain */
+	host_send(sock, oversize, sizeof(oversize));
+	host_send(sock, cobs_ping, sizeof(cobs_ping));
+	host_expect(sock, cobs_pong, sizeof(cobs_pong), sizeof(cobs_pong));
+
+	zsock_close(sock);
+}
+
+/******************************************************************************/
+/* Local Function Definitions                                                 */
+/******************************************************************************/
+static bool framing_is_length(const void *global_state)
+{
+	return !IS_ENABLED(CONFIG_AMPOULE_TRANSPORT_TCP_COBS);
+}
+
+static bool framing_is_cobs(const void *global_state)
+{
+	return IS_ENABLED(CONFIG_AMPOULE_TRANSPORT_TCP_COBS);
+}
+
+ZTEST_SUITE(tcp_tests, framing_is_length, setup, NULL, NULL, NULL);
+ZTEST_SUITE(tcp_cobs_tests, framing_is_cobs, NULL, NULL, NULL, NULL);